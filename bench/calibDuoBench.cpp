@@ -0,0 +1,951 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "DuoBundleAdjuster.h"
+#include "DuoCalibrator.h"
+#include "DuoCornerRefiner.h"
+#include "DuoDisparity.h"
+#include "DuoPointCloud.h"
+#include "DuoSyntheticSource.h"
+
+
+//
+// Stage-level benchmarks of calibDuo's hot paths on fixed synthetic inputs.
+//
+// Every stage is run on the same rendered views at QVGA, VGA and DUO_FULL
+// and each call is timed on its own, so the output holds latency
+// distributions and not just averages. Results go to a .json or .csv file
+// that can be diffed between builds and machines.
+//
+
+//
+// Command line options
+//
+struct Options
+{
+  Options()
+    : outPath( "calibDuoBench.json" )
+    , numViews( 40 )
+    , repeat( 3 )
+  {}
+
+  std::string outPath;  // --out <file>: .json or .csv
+  int         numViews; // --views <n>: rendered board poses per size
+  int         repeat;   // --repeat <n>: passes over the views per stage
+};
+
+
+static Options parseOptions( int argc, char** argv )
+{
+  Options options;
+
+  for( int i = 1; i < argc; ++i )
+  {
+    const std::string arg( argv[i] );
+
+    if( arg == "--out" && i + 1 < argc )
+    {
+      options.outPath = argv[++i];
+    }
+    else if( arg == "--views" && i + 1 < argc )
+    {
+      options.numViews = std::max( 10, atoi( argv[++i] ) );
+    }
+    else if( arg == "--repeat" && i + 1 < argc )
+    {
+      options.repeat = std::max( 1, atoi( argv[++i] ) );
+    }
+    else
+    {
+      std::cout << "Ignoring unknown option " << arg << "\n";
+    }
+  }
+
+  return options;
+}
+
+
+//
+// How far the bundle adjuster's solution is from stereoCalibrate's on the
+// same views
+//
+struct Parity
+{
+  Parity()
+    : checked( false )
+    , ok( true )
+    , rmsDiff( 0.0 )
+    , intrinsicsDiff( 0.0 )
+    , rotationDeg( 0.0 )
+    , translation( 0.0 )
+  {}
+
+  bool   checked;         // only for the bundleAdjust stages
+  bool   ok;              // false if it failed or is out of tolerance
+  double rmsDiff;         // px
+  double intrinsicsDiff;  // largest fx, fy, cx, cy difference, px
+  double rotationDeg;
+  double translation;     // fraction of the baseline
+};
+
+
+//
+// Timings of one stage at one image size, in ms per call
+//
+struct StageResult
+{
+  std::string         stage;
+  cv::Size            size;
+  int                 views;    // view count for the solvers, else 0
+  std::vector<double> samples;
+  Parity              parity;
+};
+
+
+//
+// Outputs of a stereo solver that are compared between the two
+//
+struct Solution
+{
+  Solution() : rms( -1.0 ) {}
+
+  double  rms;
+  cv::Mat M1;
+  cv::Mat D1;
+  cv::Mat M2;
+  cv::Mat D2;
+  cv::Mat R;
+  cv::Mat T;
+};
+
+
+//
+// The bundle adjuster solves the same problem as stereoCalibrate, so on the
+// same views the two should agree to within these
+//
+static const double PARITY_RMS_PX        = 0.01;
+static const double PARITY_INTRINSICS_PX = 0.5;
+static const double PARITY_ROTATION_DEG  = 0.02;
+static const double PARITY_TRANSLATION   = 0.005; // fraction of the baseline
+
+
+struct StageStats
+{
+  double mean;
+  double min;
+  double p50;
+  double p90;
+  double p99;
+  double max;
+  double perSecond;
+};
+
+
+static double percentile( const std::vector<double>& sorted, const double p )
+{
+  const size_t i = size_t( p*( sorted.size() - 1 ) + 0.5 );
+  return sorted[std::min( i, sorted.size() - 1 )];
+}
+
+
+static StageStats computeStats( const std::vector<double>& samples )
+{
+  StageStats stats = { 0, 0, 0, 0, 0, 0, 0 };
+
+  if( samples.empty() ) return stats;
+
+  std::vector<double> sorted( samples );
+  std::sort( sorted.begin(), sorted.end() );
+
+  double sum = 0.0;
+  for( const double s : sorted ) sum += s;
+
+  stats.mean      = sum/sorted.size();
+  stats.min       = sorted.front();
+  stats.p50       = percentile( sorted, 0.50 );
+  stats.p90       = percentile( sorted, 0.90 );
+  stats.p99       = percentile( sorted, 0.99 );
+  stats.max       = sorted.back();
+  stats.perSecond = ( stats.mean > 0.0 ) ? 1000.0/stats.mean : 0.0;
+
+  return stats;
+}
+
+
+//
+// Differences between the bundle adjuster's and stereoCalibrate's solutions
+// on the same views, printed and flagged where they exceed the PARITY_
+// tolerances
+//
+static Parity compareSolutions( const int views,
+                                const Solution& calibrated,
+                                const Solution& adjusted )
+{
+  Parity parity;
+
+  parity.checked = true;
+
+  std::cout << "  bundleAdjust vs stereoCalibrate, " << views << " views: ";
+
+  if( calibrated.rms < 0.0 || adjusted.rms < 0.0 ||
+      adjusted.M1.empty() || adjusted.R.empty() )
+  {
+    std::cout << "bundle adjustment failed\n";
+
+    parity.ok = false;
+    return parity;
+  }
+
+  const double rmsDiff = std::abs( adjusted.rms - calibrated.rms );
+
+  //
+  // Largest difference of fx, fy, cx and cy over both cameras
+  //
+  double intrinsicsDiff = 0.0;
+
+  const int rows[4] = { 0, 1, 0, 1 };
+  const int cols[4] = { 0, 1, 2, 2 };
+
+  for( int i = 0; i < 4; ++i )
+  {
+    intrinsicsDiff = std::max( intrinsicsDiff,
+        std::abs( adjusted.M1.at<double>( rows[i], cols[i] ) -
+                  calibrated.M1.at<double>( rows[i], cols[i] ) ) );
+    intrinsicsDiff = std::max( intrinsicsDiff,
+        std::abs( adjusted.M2.at<double>( rows[i], cols[i] ) -
+                  calibrated.M2.at<double>( rows[i], cols[i] ) ) );
+  }
+
+  cv::Mat dr;
+  cv::Rodrigues( adjusted.R*calibrated.R.t(), dr );
+
+  const double rotationDeg = cv::norm( dr )*180.0/CV_PI;
+  const double translation = cv::norm( adjusted.T - calibrated.T )/
+                             cv::norm( calibrated.T );
+
+  const bool ok = rmsDiff        <= PARITY_RMS_PX &&
+                  intrinsicsDiff <= PARITY_INTRINSICS_PX &&
+                  rotationDeg    <= PARITY_ROTATION_DEG &&
+                  translation    <= PARITY_TRANSLATION;
+
+  std::cout << "RMS " << rmsDiff << " px, fx/fy/cx/cy " << intrinsicsDiff
+            << " px, R " << rotationDeg << " deg, T " << 100.0*translation
+            << "% of the baseline" << ( ok ? "\n" : " (differs)\n" );
+
+  parity.ok             = ok;
+  parity.rmsDiff        = rmsDiff;
+  parity.intrinsicsDiff = intrinsicsDiff;
+  parity.rotationDeg    = rotationDeg;
+  parity.translation    = translation;
+
+  return parity;
+}
+
+
+//
+// Time fn() once, in ms
+//
+template<typename Fn>
+static double timeMs( Fn fn )
+{
+  const int64 t = cv::getTickCount();
+  fn();
+  return TicksToMs( cv::getTickCount() - t );
+}
+
+
+static void benchmarkSize( const cv::Size& size,
+                           const Options& options,
+                           std::vector<StageResult>& results )
+{
+  const cv::Size boardSize( 9, 6 );
+
+  DuoCalibrator calibDuo( boardSize,
+                          DuoCalibrator::PATTERN_CHESSBOARD,
+                          size );
+
+  DuoSyntheticSource source( DuoStereoRig::makeDefault( size ),
+                             boardSize,
+                             false,
+                             calibDuo.getObjectPoints(),
+                             GetTargetImagePath( false ),
+                             options.numViews );
+
+  if( !source.isValid() ) exit( 1 );
+
+  std::cout << "Benchmarking " << size.width << "x" << size.height << "\n";
+
+  //
+  // Fixed inputs: render every view once up front
+  //
+  std::vector<cv::Mat> lefts;
+  std::vector<cv::Mat> rights;
+
+  cv::Mat  left;
+  cv::Mat  right;
+  uint64_t seq       = 0;
+  uint32_t timeStamp = 0;
+
+  while( source.grab( left, right, seq, timeStamp ) )
+  {
+    lefts.push_back( left.clone() );
+    rights.push_back( right.clone() );
+  }
+
+  auto addResult = [&]( const std::string& stage, const int views ) -> StageResult&
+  {
+    results.push_back( StageResult() );
+    results.back().stage = stage;
+    results.back().size  = size;
+    results.back().views = views;
+    return results.back();
+  };
+
+  //
+  // findChessboardCorners, with the flags DETECT_FULL_RES uses
+  //
+  std::vector<std::vector<cv::Point2f>> cornersL( lefts.size() );
+  std::vector<std::vector<cv::Point2f>> cornersR( rights.size() );
+
+  {
+    StageResult& r = addResult( "findChessboardCorners", 0 );
+
+    for( int pass = 0; pass < options.repeat; ++pass )
+    {
+      for( size_t i = 0; i < lefts.size(); ++i )
+      {
+        r.samples.push_back( timeMs( [&]()
+        {
+          cv::findChessboardCorners( lefts[i], boardSize, cornersL[i] );
+        } ) );
+
+        cv::findChessboardCorners( rights[i], boardSize, cornersR[i] );
+      }
+    }
+  }
+
+  //
+  // cornerSubPix, with the window and criteria the calibrator uses
+  //
+  const auto termCrit =
+      cv::TermCriteria( cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS,
+                        20, 0.1 );
+
+  {
+    StageResult& r = addResult( "cornerSubPix", 0 );
+
+    std::vector<cv::Point2f> pts;
+
+    for( int pass = 0; pass <= options.repeat; ++pass )
+    {
+      for( size_t i = 0; i < lefts.size(); ++i )
+      {
+        if( cornersL[i].size() != boardSize.area() ) continue;
+
+        pts = cornersL[i];
+
+        const double ms = timeMs( [&]()
+        {
+          cv::cornerSubPix( lefts[i], pts,
+                            cv::Size( 5, 5 ), cv::Size( -1, -1 ), termCrit );
+        } );
+
+        //
+        // The first pass only warms up caches and the allocator
+        //
+        if( pass > 0 ) r.samples.push_back( ms );
+      }
+    }
+  }
+
+  //
+  // Both views of a pair: cornerSubPix one after the other, and the batched
+  // refiner with and without SIMD, with the largest distance of its corners
+  // from cornerSubPix's
+  //
+  {
+    StageResult& r = addResult( "cornerSubPix.pair", 0 );
+
+    std::vector<cv::Point2f> ptsL;
+    std::vector<cv::Point2f> ptsR;
+
+    for( int pass = 0; pass <= options.repeat; ++pass )
+    {
+      for( size_t i = 0; i < lefts.size(); ++i )
+      {
+        if( cornersL[i].size() != boardSize.area() ||
+            cornersR[i].size() != boardSize.area() )
+          continue;
+
+        ptsL = cornersL[i];
+        ptsR = cornersR[i];
+
+        const double ms = timeMs( [&]()
+        {
+          cv::cornerSubPix( lefts[i], ptsL,
+                            cv::Size( 5, 5 ), cv::Size( -1, -1 ), termCrit );
+          cv::cornerSubPix( rights[i], ptsR,
+                            cv::Size( 5, 5 ), cv::Size( -1, -1 ), termCrit );
+        } );
+
+        if( pass > 0 ) r.samples.push_back( ms );
+      }
+    }
+  }
+
+  DuoCornerRefiner refiner( cv::Size( 5, 5 ), cv::Size( -1, -1 ), termCrit );
+
+  for( const bool simd : { true, false } )
+  {
+    refiner.setSimd( simd );
+
+    StageResult& r = addResult( simd ? "DuoCornerRefiner.pair"
+                                     : "DuoCornerRefiner.pair.scalar", 0 );
+
+    std::vector<cv::Point2f> ptsL;
+    std::vector<cv::Point2f> ptsR;
+    std::vector<cv::Point2f> refL;
+    std::vector<cv::Point2f> refR;
+
+    double maxDeviation = 0.0;
+
+    for( int pass = 0; pass <= options.repeat; ++pass )
+    {
+      for( size_t i = 0; i < lefts.size(); ++i )
+      {
+        if( cornersL[i].size() != boardSize.area() ||
+            cornersR[i].size() != boardSize.area() )
+          continue;
+
+        ptsL = cornersL[i];
+        ptsR = cornersR[i];
+
+        const cv::Mat*            images[2] = { &lefts[i], &rights[i] };
+        std::vector<cv::Point2f>* points[2] = { &ptsL, &ptsR };
+
+        const double ms = timeMs( [&]()
+        {
+          refiner.refine( images, points, 2 );
+        } );
+
+        if( pass > 0 )
+        {
+          r.samples.push_back( ms );
+          continue;
+        }
+
+        //
+        // The warm-up pass checks the corners against cornerSubPix
+        //
+        refL = cornersL[i];
+        refR = cornersR[i];
+
+        cv::cornerSubPix( lefts[i], refL,
+                          cv::Size( 5, 5 ), cv::Size( -1, -1 ), termCrit );
+        cv::cornerSubPix( rights[i], refR,
+                          cv::Size( 5, 5 ), cv::Size( -1, -1 ), termCrit );
+
+        for( size_t j = 0; j < refL.size(); ++j )
+        {
+          maxDeviation = std::max( maxDeviation, cv::norm( ptsL[j] - refL[j] ) );
+          maxDeviation = std::max( maxDeviation, cv::norm( ptsR[j] - refR[j] ) );
+        }
+      }
+    }
+
+    std::cout << "  " << r.stage << " ("
+              << ( simd ? DuoCornerRefiner::getInstructionSet() : "scalar" )
+              << "): max " << maxDeviation << " px from cornerSubPix\n";
+  }
+
+  //
+  // Image sets for calibration
+  //
+  for( size_t i = 0; i < lefts.size(); ++i )
+  {
+    if( cornersL[i].size() != boardSize.area() ||
+        cornersR[i].size() != boardSize.area() )
+      continue;
+
+    cv::cornerSubPix( lefts[i], cornersL[i],
+                      cv::Size( 5, 5 ), cv::Size( -1, -1 ), termCrit );
+    cv::cornerSubPix( rights[i], cornersR[i],
+                      cv::Size( 5, 5 ), cv::Size( -1, -1 ), termCrit );
+
+    calibDuo.keepImageSet( cornersL[i], cornersR[i] );
+  }
+
+  const DuoViewStore& imageSets = calibDuo.getImageSets();
+
+  //
+  // stereoCalibrate and the bundle adjuster as a function of view count,
+  // with the calibrator's model, both from a cold start
+  //
+  const auto calibCrit =
+      cv::TermCriteria( cv::TermCriteria::COUNT + cv::TermCriteria::EPS,
+                        30, 1e-6 );
+
+  const int viewCounts[] = { 10, 20, 40, 80, 160 };
+
+  //
+  // Both solvers run on the same subsets of the image sets
+  //
+  std::vector<DuoViewStore> subsets;
+
+  for( const int views : viewCounts )
+  {
+    if( views > int( imageSets.size() ) ) break;
+
+    subsets.push_back( DuoViewStore() );
+    subsets.back().setBoard( imageSets.getBoard() );
+
+    for( int i = 0; i < views; ++i )
+      subsets.back().add( imageSets.left( i ), imageSets.right( i ) );
+  }
+
+  std::vector<Solution> calibrated( subsets.size() );
+  std::vector<Solution> adjusted( subsets.size() );
+
+  for( size_t k = 0; k < subsets.size(); ++k )
+  {
+    StageResult& r = addResult( "stereoCalibrate", viewCounts[k] );
+
+    std::vector<cv::Mat> objectPts;
+    std::vector<cv::Mat> ptsL;
+    std::vector<cv::Mat> ptsR;
+    subsets[k].getArrays( objectPts, ptsL, ptsR );
+
+    Solution& s = calibrated[k];
+
+    for( int pass = 0; pass < options.repeat; ++pass )
+    {
+      cv::Mat E, F;
+
+      r.samples.push_back( timeMs( [&]()
+      {
+        s.rms = cv::stereoCalibrate( objectPts, ptsL, ptsR,
+                                     s.M1, s.D1, s.M2, s.D2, size, s.R, s.T, E, F,
+                                     CV_CALIB_RATIONAL_MODEL | CV_CALIB_SAME_FOCAL_LENGTH,
+                                     calibCrit );
+      } ) );
+    }
+  }
+
+  for( size_t k = 0; k < subsets.size(); ++k )
+  {
+    StageResult& r = addResult( "bundleAdjust", viewCounts[k] );
+
+    DuoBundleAdjuster adjuster( size, calibCrit );
+
+    Solution& s = adjusted[k];
+
+    for( int pass = 0; pass < options.repeat; ++pass )
+    {
+      cv::Mat E, F;
+
+      r.samples.push_back( timeMs( [&]()
+      {
+        s.rms = adjuster.solve( subsets[k], s.M1, s.D1, s.M2, s.D2, s.R, s.T,
+                                E, F, false );
+      } ) );
+    }
+
+    r.parity = compareSolutions( viewCounts[k], calibrated[k], adjusted[k] );
+  }
+
+  if( calibDuo.solve() < 0.0 )
+  {
+    std::cout << "Too few views found at " << size.width << "x" << size.height
+              << ", skipping the rectification stages\n";
+    return;
+  }
+
+  //
+  // stereoRectify plus both undistort maps
+  //
+  {
+    StageResult& r = addResult( "stereoRectify+initUndistortRectifyMap", 0 );
+
+    cv::Mat R1, R2, P1, P2, Q, mapL1, mapL2, mapR1, mapR2;
+
+    for( int pass = 0; pass < options.repeat*10; ++pass )
+    {
+      r.samples.push_back( timeMs( [&]()
+      {
+        cv::stereoRectify( calibDuo.getM1(), calibDuo.getD1(),
+                           calibDuo.getM2(), calibDuo.getD2(),
+                           size,
+                           calibDuo.getR(), calibDuo.getT(),
+                           R1, R2, P1, P2, Q,
+                           CV_CALIB_ZERO_DISPARITY, 0 );
+
+        cv::initUndistortRectifyMap( calibDuo.getM1(), calibDuo.getD1(),
+                                     R1, P1, size, CV_16SC2, mapL1, mapL2 );
+        cv::initUndistortRectifyMap( calibDuo.getM2(), calibDuo.getD2(),
+                                     R2, P2, size, CV_16SC2, mapR1, mapR2 );
+      } ) );
+    }
+  }
+
+  //
+  // Per-frame rectification and disparity through the calibrator
+  //
+  std::vector<double> rectSamplesL;
+  std::vector<double> rectSamplesR;
+  std::vector<double> rectSamplesBoth;
+  std::vector<double> dispSamples;
+  std::vector<double> cloudSamples;
+
+  DuoPointCloud cloud;
+  cloud.setDecimation( 2 );
+
+  cv::Mat rectL;
+  cv::Mat rectR;
+
+  for( int pass = 0; pass <= options.repeat; ++pass )
+  {
+    for( size_t i = 0; i < lefts.size(); ++i )
+    {
+      const double msL = timeMs( [&]()
+      {
+        calibDuo.undistortAndRectifyLeft( lefts[i], rectL );
+      } );
+
+      const double msR = timeMs( [&]()
+      {
+        calibDuo.undistortAndRectifyRight( rights[i], rectR );
+      } );
+
+      const double msB = timeMs( [&]()
+      {
+        calibDuo.undistortAndRectify( lefts[i], rights[i], rectL, rectR );
+      } );
+
+      const double msD = timeMs( [&]()
+      {
+        calibDuo.getDisparity( lefts[i], rights[i] );
+      } );
+
+      const cv::Mat& disparity = calibDuo.computeDisparity( lefts[i], rights[i] );
+
+      const double msC = timeMs( [&]()
+      {
+        cloud.compute( disparity,
+                       calibDuo.getDisparityEngine().getMinDisparity(),
+                       calibDuo.getDisparityQ(),
+                       calibDuo.getDisparityLeft() );
+      } );
+
+      if( pass == 0 ) continue;
+
+      rectSamplesL.push_back( msL );
+      rectSamplesR.push_back( msR );
+      rectSamplesBoth.push_back( msB );
+      dispSamples.push_back( msD );
+      cloudSamples.push_back( msC );
+    }
+  }
+
+  addResult( "undistortAndRectifyLeft",  0 ).samples = rectSamplesL;
+  addResult( "undistortAndRectifyRight", 0 ).samples = rectSamplesR;
+  addResult( "undistortAndRectify",      0 ).samples = rectSamplesBoth;
+  addResult( "getDisparity",             0 ).samples = dispSamples;
+  addResult( "pointCloud",               0 ).samples = cloudSamples;
+
+  //
+  // Each matcher on the full resolution rectified views, raw output
+  //
+  const struct
+  {
+    DuoDisparity::Algorithm algorithm;
+    const char*             name;
+  }
+  matchers[] =
+  {
+    { DuoDisparity::ALGO_BM,          "disparity.bm"     },
+    { DuoDisparity::ALGO_SGBM,        "disparity.sgbm"   },
+    { DuoDisparity::ALGO_SGBM_3WAY,   "disparity.3way"   },
+    { DuoDisparity::ALGO_SGBM_STRIPS, "disparity.strips" }
+  };
+
+  std::vector<cv::Mat> rectifiedL( lefts.size() );
+  std::vector<cv::Mat> rectifiedR( lefts.size() );
+
+  for( size_t i = 0; i < lefts.size(); ++i )
+    calibDuo.undistortAndRectify( lefts[i], rights[i],
+                                  rectifiedL[i], rectifiedR[i] );
+
+  cv::Mat disparity;
+
+  const double baseline = cv::norm( calibDuo.getT() );
+
+  for( const auto& matcher : matchers )
+  {
+    DuoDisparity engine( matcher.algorithm );
+    engine.setDepthRange( calibDuo.getM1().at<double>( 0, 0 ), baseline,
+                          DuoDisparity::MIN_DEPTH_BASELINES*baseline, 0.0 );
+
+    StageResult& r = addResult( matcher.name, 0 );
+
+    for( int pass = 0; pass <= options.repeat; ++pass )
+    {
+      for( size_t i = 0; i < rectifiedL.size(); ++i )
+      {
+        const double ms = timeMs( [&]()
+        {
+          engine.compute( rectifiedL[i], rectifiedR[i], disparity );
+        } );
+
+        if( pass > 0 ) r.samples.push_back( ms );
+      }
+    }
+  }
+
+  //
+  // The strip matcher in temporal mode on a static scene: each view held
+  // for several frames, timing all but its first
+  //
+  {
+    DuoDisparity engine( DuoDisparity::ALGO_SGBM_STRIPS );
+    engine.setTemporal( true );
+    engine.setDepthRange( calibDuo.getM1().at<double>( 0, 0 ), baseline,
+                          DuoDisparity::MIN_DEPTH_BASELINES*baseline, 0.0 );
+
+    StageResult& r = addResult( "disparity.temporal", 0 );
+
+    const int framesPerView = 10;
+
+    for( int pass = 0; pass < options.repeat; ++pass )
+    {
+      for( size_t i = 0; i < rectifiedL.size(); ++i )
+      {
+        for( int frame = 0; frame < framesPerView; ++frame )
+        {
+          const double ms = timeMs( [&]()
+          {
+            engine.compute( rectifiedL[i], rectifiedR[i], disparity );
+          } );
+
+          if( frame > 0 ) r.samples.push_back( ms );
+        }
+      }
+    }
+  }
+
+  //
+  // Full and temporal strips on a moving sequence: from each view, a camera
+  // that pans down 3 rows a frame, so the scene crosses the strip borders,
+  // while the board comes 1 px of disparity closer a frame. Every frame is
+  // timed, including the cut to the next view, and the temporal engine's
+  // search share counts the overlap rows and the re-matched strips.
+  //
+  {
+    const int framesPerView = 10;
+    const int rowsPerFrame  = 3;
+
+    std::vector<cv::Mat> movingL;
+    std::vector<cv::Mat> movingR;
+
+    for( size_t i = 0; i < rectifiedL.size(); ++i )
+    {
+      for( int frame = 0; frame < framesPerView; ++frame )
+      {
+        const double dy = -rowsPerFrame*frame;
+
+        const cv::Mat shiftL = ( cv::Mat_<double>( 2, 3 ) << 1, 0, 0,      0, 1, dy );
+        const cv::Mat shiftR = ( cv::Mat_<double>( 2, 3 ) << 1, 0, -frame, 0, 1, dy );
+
+        movingL.push_back( cv::Mat() );
+        movingR.push_back( cv::Mat() );
+
+        cv::warpAffine( rectifiedL[i], movingL.back(), shiftL,
+                        rectifiedL[i].size(), cv::INTER_NEAREST,
+                        cv::BORDER_REPLICATE );
+        cv::warpAffine( rectifiedR[i], movingR.back(), shiftR,
+                        rectifiedR[i].size(), cv::INTER_NEAREST,
+                        cv::BORDER_REPLICATE );
+      }
+    }
+
+    DuoDisparity full( DuoDisparity::ALGO_SGBM_STRIPS );
+    DuoDisparity temporal( DuoDisparity::ALGO_SGBM_STRIPS );
+    temporal.setTemporal( true );
+
+    for( DuoDisparity* engine : { &full, &temporal } )
+      engine->setDepthRange( calibDuo.getM1().at<double>( 0, 0 ), baseline,
+                             DuoDisparity::MIN_DEPTH_BASELINES*baseline, 0.0 );
+
+    std::vector<double> fullSamples;
+    std::vector<double> temporalSamples;
+
+    double searched     = 0.0;
+    size_t numRematched = 0;
+    size_t numStrips    = 0;
+
+    for( int pass = 0; pass < options.repeat; ++pass )
+    {
+      for( size_t i = 0; i < movingL.size(); ++i )
+      {
+        fullSamples.push_back( timeMs( [&]()
+        {
+          full.compute( movingL[i], movingR[i], disparity );
+        } ) );
+
+        temporalSamples.push_back( timeMs( [&]()
+        {
+          temporal.compute( movingL[i], movingR[i], disparity );
+        } ) );
+
+        searched     += temporal.getSearchFraction();
+        numRematched += temporal.getNumRematched();
+        numStrips    += temporal.getNumStrips();
+      }
+    }
+
+    addResult( "disparity.strips.moving",   0 ).samples = fullSamples;
+    addResult( "disparity.temporal.moving", 0 ).samples = temporalSamples;
+
+    const double speedup = computeStats( fullSamples ).mean/
+                           std::max( computeStats( temporalSamples ).mean, 1e-9 );
+
+    std::cout << "  temporal strips on a moving sequence: " << speedup
+              << "x the speed of full strips, searching "
+              << 100.0*searched/std::max( temporalSamples.size(), size_t( 1 ) )
+              << "% of their disparities with "
+              << 100.0*numRematched/std::max( numStrips, size_t( 1 ) )
+              << "% of the strips re-matched\n";
+  }
+}
+
+
+static void writeCsv( std::ostream& out, const std::vector<StageResult>& results )
+{
+  out << "stage,width,height,views,count,mean_ms,min_ms,p50_ms,p90_ms,"
+         "p99_ms,max_ms,per_second,parity,rms_diff_px,intrinsics_diff_px,"
+         "rotation_diff_deg,translation_diff\n";
+
+  out << std::fixed << std::setprecision( 4 );
+
+  for( const auto& r : results )
+  {
+    const StageStats s = computeStats( r.samples );
+
+    out << r.stage << ","
+        << r.size.width << "," << r.size.height << ","
+        << r.views << ","
+        << r.samples.size() << ","
+        << s.mean << "," << s.min << "," << s.p50 << ","
+        << s.p90 << "," << s.p99 << "," << s.max << ","
+        << s.perSecond;
+
+    //
+    // Empty parity columns for the stages that are not compared
+    //
+    if( r.parity.checked )
+      out << "," << ( r.parity.ok ? "ok" : "differs" ) << ","
+          << r.parity.rmsDiff << "," << r.parity.intrinsicsDiff << ","
+          << r.parity.rotationDeg << "," << r.parity.translation << "\n";
+    else
+      out << ",,,,,\n";
+  }
+}
+
+
+static void writeJson( std::ostream& out, const std::vector<StageResult>& results )
+{
+  out << std::fixed << std::setprecision( 4 );
+
+  out << "{\n"
+      << "  \"opencv\": \"" << CV_VERSION << "\",\n"
+      << "  \"threads\": " << cv::getNumThreads() << ",\n"
+      << "  \"cpus\": " << std::thread::hardware_concurrency() << ",\n"
+      << "  \"results\": [\n";
+
+  for( size_t i = 0; i < results.size(); ++i )
+  {
+    const StageResult& r = results[i];
+    const StageStats   s = computeStats( r.samples );
+
+    out << "    { \"stage\": \"" << r.stage << "\""
+        << ", \"width\": "  << r.size.width
+        << ", \"height\": " << r.size.height
+        << ", \"views\": "  << r.views
+        << ", \"count\": "  << r.samples.size()
+        << ", \"mean_ms\": " << s.mean
+        << ", \"min_ms\": "  << s.min
+        << ", \"p50_ms\": "  << s.p50
+        << ", \"p90_ms\": "  << s.p90
+        << ", \"p99_ms\": "  << s.p99
+        << ", \"max_ms\": "  << s.max
+        << ", \"per_second\": " << s.perSecond;
+
+    if( r.parity.checked )
+      out << ", \"parity\": { \"ok\": " << ( r.parity.ok ? "true" : "false" )
+          << ", \"rms_diff_px\": "        << r.parity.rmsDiff
+          << ", \"intrinsics_diff_px\": " << r.parity.intrinsicsDiff
+          << ", \"rotation_diff_deg\": "  << r.parity.rotationDeg
+          << ", \"translation_diff\": "   << r.parity.translation << " }";
+
+    out << " }" << ( i + 1 < results.size() ? ",\n" : "\n" );
+  }
+
+  out << "  ]\n}\n";
+}
+
+
+int main( int argc, char** argv )
+{
+  const Options options = parseOptions( argc, argv );
+
+  std::vector<StageResult> results;
+
+  const cv::Size sizes[] = { QVGA, VGA, DUO_FULL };
+
+  for( const auto& size : sizes )
+    benchmarkSize( size, options, results );
+
+  std::ofstream out( options.outPath.c_str() );
+  if( !out )
+  {
+    std::cout << "Could not create " << options.outPath << "\n";
+    return 1;
+  }
+
+  const bool csv = options.outPath.size() >= 4 &&
+      options.outPath.compare( options.outPath.size() - 4, 4, ".csv" ) == 0;
+
+  if( csv )
+    writeCsv( out, results );
+  else
+    writeJson( out, results );
+
+  std::cout << "Wrote " << results.size() << " results to "
+            << options.outPath << "\n";
+
+  writeCsv( std::cout, results );
+
+  //
+  // A bundle adjuster that disagrees with stereoCalibrate fails the run
+  //
+  size_t numDiffering = 0;
+
+  for( const auto& r : results )
+    if( r.parity.checked && !r.parity.ok )
+      ++numDiffering;
+
+  if( numDiffering > 0 )
+  {
+    std::cout << "bundleAdjust differs from stereoCalibrate in "
+              << numDiffering << " runs\n";
+    return 1;
+  }
+
+  return 0;
+}
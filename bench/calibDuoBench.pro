@@ -0,0 +1,65 @@
+#
+# calibDuoBench.pro
+#
+# Stage-level benchmarks, built separately from calibDuo:
+#   cd bench && qmake && make && ./calibDuoBench --out results.json
+#
+
+CONFIG += warn_off c++11 console thread
+
+TARGET   = calibDuoBench
+TEMPLATE = app
+
+HEADERS += \
+    ../src/DuoBundleAdjuster.h  \
+    ../src/DuoCalibrator.h      \
+    ../src/DuoCornerRefiner.h   \
+    ../src/DuoDisparity.h       \
+    ../src/DuoFrameSource.h     \
+    ../src/DuoMapCache.h        \
+    ../src/DuoMappedFile.h      \
+    ../src/DuoPointCloud.h      \
+    ../src/DuoProfiler.h        \
+    ../src/DuoRecording.h       \
+    ../src/DuoSession.h         \
+    ../src/DuoSyntheticSource.h \
+    ../src/DuoUtility.h         \
+    ../src/DuoViewStore.h       \
+
+INCLUDEPATH += ../src/
+
+SOURCES += \
+    calibDuoBench.cpp             \
+    ../src/DuoBundleAdjuster.cpp  \
+    ../src/DuoCalibrator.cpp      \
+    ../src/DuoCornerRefiner.cpp   \
+    ../src/DuoDisparity.cpp       \
+    ../src/DuoMapCache.cpp        \
+    ../src/DuoMappedFile.cpp      \
+    ../src/DuoPointCloud.cpp      \
+    ../src/DuoProfiler.cpp        \
+    ../src/DuoRecording.cpp       \
+    ../src/DuoSession.cpp         \
+    ../src/DuoSyntheticSource.cpp \
+    ../src/DuoViewStore.cpp       \
+
+#
+# OpenCV 3.3+
+#
+message( OPENCV_ROOT is $$(OPENCV_ROOT) )
+INCLUDEPATH += $$(OPENCV_ROOT)/include
+LIBS += -L$$(OPENCV_ROOT)/lib
+LIBS += \
+        -lopencv_calib3d     \
+        -lopencv_core        \
+        -lopencv_features2d  \
+        -lopencv_imgproc     \
+        -lopencv_imgcodecs   \
+
+#
+# DUO 3D SDK, for the headers shared with calibDuo
+#
+message( DUO_ROOT is $$(DUO_ROOT) )
+INCLUDEPATH += $$(DUO_ROOT)/include
+LIBS += -L$$(DUO_ROOT)/osx/x64
+LIBS += -lDUO
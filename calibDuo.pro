@@ -2,20 +2,65 @@
 # calibDuo.pro
 #
 
-CONFIG += warn_off c++11 console
+CONFIG += warn_off c++11 console thread
 
 TARGET   = calibDuo
 TEMPLATE = app
 
 HEADERS += \
-    src/DuoCalibrator.h   \
-    src/DuoUtility.h      \
+    src/DuoBatchCalibration.h      \
+    src/DuoBundleAdjuster.h        \
+    src/DuoCalibrator.h            \
+    src/DuoCornerRefiner.h         \
+    src/DuoCoverage.h              \
+    src/DuoDetectionPipeline.h     \
+    src/DuoDisparity.h             \
+    src/DuoFrameSource.h           \
+    src/DuoIncrementalCalibrator.h \
+    src/DuoMapCache.h              \
+    src/DuoMappedFile.h            \
+    src/DuoPointCloud.h            \
+    src/DuoProfiler.h              \
+    src/DuoRecording.h             \
+    src/DuoRectificationMonitor.h  \
+    src/DuoSession.h               \
+    src/DuoSyntheticSource.h       \
+    src/DuoUtility.h               \
+    src/DuoViewStore.h             \
 
 INCLUDEPATH += src/
 
+#
+# Hot-path stage timers (--profile). Remove to compile them out entirely.
+#
+DEFINES += DUO_PROFILE
+
+#
+# The sub-pixel corner refiner uses SSE2 on x86-64. On CPUs that have it,
+# add -mavx2 (or /arch:AVX2 with MSVC) for 8 corners per instruction instead
+# of 4; DUO_NO_SIMD builds only its scalar fallback.
+#
+# QMAKE_CXXFLAGS += -mavx2
+
 SOURCES += \
-    src/calibDuo.cpp      \
-    src/DuoCalibrator.cpp \
+    src/calibDuo.cpp                 \
+    src/DuoBatchCalibration.cpp      \
+    src/DuoBundleAdjuster.cpp        \
+    src/DuoCalibrator.cpp            \
+    src/DuoCornerRefiner.cpp         \
+    src/DuoCoverage.cpp              \
+    src/DuoDetectionPipeline.cpp     \
+    src/DuoDisparity.cpp             \
+    src/DuoIncrementalCalibrator.cpp \
+    src/DuoMapCache.cpp              \
+    src/DuoMappedFile.cpp            \
+    src/DuoPointCloud.cpp            \
+    src/DuoProfiler.cpp              \
+    src/DuoRecording.cpp             \
+    src/DuoRectificationMonitor.cpp  \
+    src/DuoSession.cpp               \
+    src/DuoSyntheticSource.cpp       \
+    src/DuoViewStore.cpp             \
 
 #
 # OpenCV 3+
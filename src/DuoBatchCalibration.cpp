@@ -0,0 +1,491 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include <opencv2/imgcodecs.hpp>
+
+#include "DuoBatchCalibration.h"
+#include "DuoCalibrator.h"
+
+
+//
+// One unit: its image pairs, the corners found in them, and the outcome
+//
+struct DuoBatchUnit
+{
+  DuoBatchUnit()
+    : remaining( 0 )
+    , numDetected( 0 )
+    , numViews( 0 )
+    , numPruned( 0 )
+    , error( -1.0 )
+    , detectMs( 0.0 )
+    , calibrateMs( 0.0 )
+    , ok( false )
+  {}
+
+  std::string                           serial;
+  std::vector<std::string>              leftPaths;
+  std::vector<std::string>              rightPaths;
+
+  //
+  // Corners per pair, empty where the board was not found in both views
+  //
+  std::vector<std::vector<cv::Point2f>> leftPts;
+  std::vector<std::vector<cv::Point2f>> rightPts;
+
+  size_t                                remaining;   // pairs left to detect
+
+  size_t                                numDetected;
+  size_t                                numViews;    // kept after pruning
+  size_t                                numPruned;
+  double                                error;
+  double                                detectMs;    // summed over pairs
+  double                                calibrateMs;
+  bool                                  ok;
+
+  //
+  // The board searches alone, for the unit's intrinsics .yml
+  //
+  DuoDetectionStats                     detection;
+
+  //
+  // What the workers had to say about the unit, printed in one piece once
+  // it is calibrated so that units do not interleave
+  //
+  std::string                           log;
+};
+
+
+//
+// A pair to detect, or with pair < 0 a unit to calibrate
+//
+struct DuoBatchTask
+{
+  size_t unit;
+  int    pair;
+};
+
+
+static void makeDirectory( const std::string& path )
+{
+#ifdef _WIN32
+  _mkdir( path.c_str() );
+#else
+  mkdir( path.c_str(), 0755 );
+#endif
+}
+
+
+static std::string withSeparator( const std::string& dir )
+{
+  if( dir.empty() || dir.back() == '/' || dir.back() == '\\' ) return dir;
+  return dir + "/";
+}
+
+
+//
+// Units under inputDir, from the files of its <serial>/left and
+// <serial>/right directories, sorted by serial and file name
+//
+static std::vector<DuoBatchUnit> findUnits( const std::string& inputDir )
+{
+  std::vector<cv::String> files;
+  cv::glob( withSeparator( inputDir ) + "*", files, true );
+
+  //
+  // serial -> left/right file name -> path
+  //
+  std::map<std::string, std::map<std::string, std::string>> left;
+  std::map<std::string, std::set<std::string>>              right;
+
+  const std::string root = withSeparator( inputDir );
+
+  for( const cv::String& file : files )
+  {
+    std::string path( file );
+    std::replace( path.begin(), path.end(), '\\', '/' );
+
+    const std::string relative =
+        path.compare( 0, root.size(), root ) == 0 ? path.substr( root.size() )
+                                                  : path;
+
+    const size_t a = relative.find( '/' );
+    if( a == std::string::npos ) continue;
+
+    const size_t b = relative.find( '/', a + 1 );
+    if( b == std::string::npos ) continue;
+
+    if( relative.find( '/', b + 1 ) != std::string::npos ) continue;
+
+    const std::string serial = relative.substr( 0, a );
+    const std::string side   = relative.substr( a + 1, b - a - 1 );
+    const std::string name   = relative.substr( b + 1 );
+
+    if( side == "left" )
+      left[serial][name] = path;
+    else if( side == "right" )
+      right[serial].insert( name );
+  }
+
+  std::vector<DuoBatchUnit> units;
+
+  for( const auto& unitFiles : left )
+  {
+    DuoBatchUnit unit;
+    unit.serial = unitFiles.first;
+
+    const std::set<std::string>& rightNames = right[unit.serial];
+
+    for( const auto& leftFile : unitFiles.second )
+    {
+      if( rightNames.count( leftFile.first ) == 0 ) continue;
+
+      unit.leftPaths.push_back( leftFile.second );
+      unit.rightPaths.push_back( root + unit.serial + "/right/" + leftFile.first );
+    }
+
+    if( unit.leftPaths.empty() ) continue;
+
+    unit.leftPts.resize( unit.leftPaths.size() );
+    unit.rightPts.resize( unit.leftPaths.size() );
+    unit.remaining = unit.leftPaths.size();
+
+    units.push_back( unit );
+  }
+
+  return units;
+}
+
+
+static DuoCalibrator::Pattern getPattern( const DuoBatchOptions& options )
+{
+  return options.circles ? DuoCalibrator::PATTERN_ASYMMETRIC_CIRCLES
+                         : DuoCalibrator::PATTERN_CHESSBOARD;
+}
+
+
+//
+// Corners of one pair into the unit, and the search into stats; returns the
+// time taken in ms
+//
+static double detectPair( DuoCalibrator& detector,
+                          const cv::Size& imageSize,
+                          DuoBatchUnit& unit,
+                          const int pair,
+                          DuoDetectionStats& stats,
+                          std::ostream& log )
+{
+  const int64 start = cv::getTickCount();
+
+  const cv::Mat left  = cv::imread( unit.leftPaths[pair],  cv::IMREAD_GRAYSCALE );
+  const cv::Mat right = cv::imread( unit.rightPaths[pair], cv::IMREAD_GRAYSCALE );
+
+  if( left.size() != imageSize || right.size() != imageSize )
+  {
+    log << "skipping " << unit.leftPaths[pair]
+        << ", not a " << imageSize.width << "x" << imageSize.height
+        << " pair\n";
+  }
+  else
+  {
+    std::vector<cv::Point2f> leftPts;
+    std::vector<cv::Point2f> rightPts;
+
+    detector.processFrame( left, right, leftPts, rightPts );
+
+    const size_t area = detector.getBoardSize().area();
+
+    ++stats.numFrames;
+    stats.sumMs += detector.getLastDetectionTimings().totalMs;
+
+    if( leftPts.size() == area && rightPts.size() == area )
+    {
+      ++stats.numBoardsFound;
+
+      unit.leftPts[pair].swap( leftPts );
+      unit.rightPts[pair].swap( rightPts );
+    }
+  }
+
+  return TicksToMs( cv::getTickCount() - start );
+}
+
+
+static void calibrateUnit( const DuoBatchOptions& options, DuoBatchUnit& unit )
+{
+  const int64 start = cv::getTickCount();
+
+  DuoCalibrator calibDuo( options.boardSize,
+                          getPattern( options ),
+                          options.imageSize,
+                          options.squareLength );
+
+  if( options.bundleAdjust )
+    calibDuo.setSolver( DuoCalibrator::SOLVER_BUNDLE_ADJUST );
+
+  calibDuo.setSerialNumber( unit.serial );
+
+  //
+  // The pairs were searched by the workers' calibrators
+  //
+  calibDuo.addDetectionStats( unit.detection );
+
+  std::ostringstream log;
+  calibDuo.setLog( log );
+
+  for( size_t i = 0; i < unit.leftPts.size(); ++i )
+  {
+    if( unit.leftPts[i].empty() ) continue;
+
+    calibDuo.keepImageSet( unit.leftPts[i], unit.rightPts[i] );
+    ++unit.numDetected;
+  }
+
+  const std::string dir = withSeparator( options.outputDir ) + unit.serial + "/";
+  makeDirectory( dir );
+
+  unit.ok = calibDuo.calibrate( dir );
+
+  if( unit.ok )
+  {
+    unit.numViews  = calibDuo.getNumImageSets();
+    unit.numPruned = calibDuo.getPrunedViews().size();
+    unit.error     = calibDuo.getReprojectionError();
+  }
+
+  unit.log        += log.str();
+  unit.calibrateMs = TicksToMs( cv::getTickCount() - start );
+}
+
+
+//
+// The unit's log, a line at a time with its serial in front
+//
+static void printLog( const DuoBatchUnit& unit )
+{
+  std::istringstream log( unit.log );
+  std::string        line;
+
+  while( std::getline( log, line ) )
+    std::cout << unit.serial << ": " << line << "\n";
+}
+
+
+static void writeSummary( const std::string& path,
+                          const std::vector<DuoBatchUnit>& units )
+{
+  FILE* file = fopen( path.c_str(), "w" );
+  if( file == nullptr )
+  {
+    std::cout << "Could not write " << path << "\n";
+    return;
+  }
+
+  fprintf( file, "serial,status,pairs,detected,views,pruned,rms_px,"
+                 "detect_ms,calibrate_ms\n" );
+
+  for( const DuoBatchUnit& unit : units )
+  {
+    fprintf( file, "%s,%s,%d,%d,%d,%d,%.4f,%.1f,%.1f\n",
+             unit.serial.c_str(),
+             unit.ok ? "ok" : "failed",
+             int( unit.leftPaths.size() ),
+             int( unit.numDetected ),
+             int( unit.numViews ),
+             int( unit.numPruned ),
+             unit.error,
+             unit.detectMs,
+             unit.calibrateMs );
+  }
+
+  fclose( file );
+}
+
+
+int RunBatchCalibration( const DuoBatchOptions& options )
+{
+  const int64 start = cv::getTickCount();
+
+  std::vector<DuoBatchUnit> units = findUnits( options.inputDir );
+
+  if( units.empty() )
+  {
+    std::cout << "No units found under " << options.inputDir
+              << " (expected <serial>/left and <serial>/right image pairs)\n";
+    return 1;
+  }
+
+  makeDirectory( options.outputDir );
+
+  size_t numPairs = 0;
+  for( const DuoBatchUnit& unit : units )
+    numPairs += unit.leftPaths.size();
+
+  const int numThreads =
+      options.numThreads > 0 ? options.numThreads
+                             : std::max( int( std::thread::hardware_concurrency() ), 1 );
+
+  std::cout << "Calibrating " << units.size() << " units from " << numPairs
+            << " image pairs on " << numThreads << " threads\n";
+
+  //
+  // Every pair is a task up front. A unit's calibration is queued at the
+  // front when its last pair is done, so that finished units leave the
+  // pool first. Units' counters and times are only updated under the lock.
+  //
+  std::mutex                mutex;
+  std::condition_variable   condition;
+  std::deque<DuoBatchTask>  tasks;
+  size_t                    outstanding = 0;
+
+  for( size_t u = 0; u < units.size(); ++u )
+  {
+    for( size_t p = 0; p < units[u].leftPaths.size(); ++p )
+    {
+      DuoBatchTask task = { u, int( p ) };
+      tasks.push_back( task );
+    }
+  }
+
+  outstanding = tasks.size();
+
+  auto worker = [&]()
+  {
+    //
+    // Detection state is per calibrator, so each thread has its own;
+    // consecutive pairs are unrelated poses, so no tracking
+    //
+    DuoCalibrator detector( options.boardSize,
+                            getPattern( options ),
+                            options.imageSize,
+                            options.squareLength );
+
+    detector.setTracking( false );
+
+    if( options.pyramid )
+      detector.setDetectionMode( DuoCalibrator::DETECT_PYRAMID );
+
+    while( true )
+    {
+      DuoBatchTask task;
+
+      {
+        std::unique_lock<std::mutex> lk( mutex );
+        condition.wait( lk, [&] { return !tasks.empty() || outstanding == 0; } );
+
+        if( tasks.empty() ) return;
+
+        task = tasks.front();
+        tasks.pop_front();
+      }
+
+      DuoBatchUnit& unit = units[task.unit];
+
+      if( task.pair < 0 )
+      {
+        calibrateUnit( options, unit );
+
+        std::unique_lock<std::mutex> lk( mutex );
+
+        printLog( unit );
+
+        std::cout << unit.serial << ": "
+                  << ( unit.ok ? "calibrated" : "FAILED" ) << ", "
+                  << unit.numViews << " views, RMS " << unit.error << " px\n";
+
+        --outstanding;
+        condition.notify_all();
+
+        continue;
+      }
+
+      DuoDetectionStats  stats;
+      std::ostringstream log;
+
+      const double ms = detectPair( detector, options.imageSize, unit,
+                                    task.pair, stats, log );
+
+      std::unique_lock<std::mutex> lk( mutex );
+
+      unit.detectMs += ms;
+      unit.detection.add( stats );
+      unit.log      += log.str();
+
+      if( --unit.remaining == 0 )
+      {
+        DuoBatchTask calibrate = { task.unit, -1 };
+        tasks.push_front( calibrate );
+        ++outstanding;
+      }
+
+      --outstanding;
+      condition.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for( int i = 0; i < numThreads; ++i )
+    threads.push_back( std::thread( worker ) );
+
+  for( std::thread& thread : threads )
+    thread.join();
+
+  const double totalMs = TicksToMs( cv::getTickCount() - start );
+
+  const std::string summaryPath =
+      withSeparator( options.outputDir ) + "batchSummary.csv";
+
+  writeSummary( summaryPath, units );
+
+  //
+  // Summary table
+  //
+  std::cout << "\n" << std::left << std::setw( 20 ) << "serial"
+            << std::right << std::setw( 8 ) << "status"
+            << std::setw( 8 ) << "pairs"
+            << std::setw( 10 ) << "detected"
+            << std::setw( 8 ) << "views"
+            << std::setw( 10 ) << "RMS px"
+            << std::setw( 14 ) << "calibrate ms" << "\n";
+
+  size_t numOk = 0;
+
+  for( const DuoBatchUnit& unit : units )
+  {
+    numOk += unit.ok ? 1 : 0;
+
+    std::cout << std::left << std::setw( 20 ) << unit.serial
+              << std::right << std::setw( 8 ) << ( unit.ok ? "ok" : "FAILED" )
+              << std::setw( 8 ) << unit.leftPaths.size()
+              << std::setw( 10 ) << unit.numDetected
+              << std::setw( 8 ) << unit.numViews
+              << std::fixed << std::setprecision( 3 )
+              << std::setw( 10 ) << unit.error
+              << std::setprecision( 0 )
+              << std::setw( 14 ) << unit.calibrateMs << "\n";
+  }
+
+  std::cout << std::fixed << std::setprecision( 1 )
+            << "\n" << numOk << " of " << units.size() << " units calibrated in "
+            << totalMs/1000.0 << " s, "
+            << units.size()*3600000.0/std::max( totalMs, 1.0 )
+            << " units per hour\n"
+            << "Summary written to " << summaryPath << "\n";
+
+  return ( numOk == units.size() ) ? 0 : 1;
+}
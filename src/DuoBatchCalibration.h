@@ -0,0 +1,55 @@
+#ifndef DUO_BATCH_CALIBRATION_H
+#define DUO_BATCH_CALIBRATION_H
+
+#include <string>
+
+#include <opencv2/core.hpp>
+
+
+//
+// Headless calibration of many units from recorded image pairs
+//
+struct DuoBatchOptions
+{
+  DuoBatchOptions()
+    : boardSize( 9, 6 )
+    , squareLength( 0.0f )
+    , circles( false )
+    , pyramid( false )
+    , bundleAdjust( false )
+    , imageSize( 640, 480 )
+    , numThreads( 0 )
+  {}
+
+  std::string inputDir;     // <inputDir>/<serial>/left/* and right/*
+  std::string outputDir;    // <outputDir>/<serial>/*.yml, summary CSV
+  cv::Size    boardSize;    // inner corners, or circles for the circle grid
+  float       squareLength; // 0 for the printed resources/ targets
+  bool        circles;
+  bool        pyramid;
+  bool        bundleAdjust;
+  cv::Size    imageSize;    // every image must have this size
+  int         numThreads;   // 0 for one per core
+};
+
+
+//
+// Calibrate every unit under options.inputDir.
+//
+// Each unit is a directory named by its serial number, holding left/ and
+// right/ directories of images; a pair is a left and right image with the
+// same file name. Board detection over all pairs of all units runs on a pool
+// of worker threads, and a unit is calibrated on the pool as soon as its
+// last pair is detected, so units finish one after another while the rest
+// are still being detected.
+//
+// The usual intrinsics/extrinsics .yml files and map cache of each unit go
+// to <outputDir>/<serial>/, and a line per unit to
+// <outputDir>/batchSummary.csv. Prints the summary and the throughput in
+// units per hour.
+//
+// Returns 0 if every unit was calibrated, 1 otherwise.
+//
+int RunBatchCalibration( const DuoBatchOptions& options );
+
+#endif // DUO_BATCH_CALIBRATION_H
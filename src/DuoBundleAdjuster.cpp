@@ -0,0 +1,795 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include <opencv2/calib3d.hpp>
+
+#include "DuoBundleAdjuster.h"
+
+
+//
+// Shared parameters. Both eyes use the same focal length, as with
+// CV_CALIB_SAME_FOCAL_LENGTH; distortion is in OpenCV's order
+// k1 k2 p1 p2 k3 k4 k5 k6.
+//
+enum
+{
+  P_FX      = 0,
+  P_FY      = 1,
+  P_CX_L    = 2,
+  P_CY_L    = 3,
+  P_DIST_L  = 4,
+  P_CX_R    = 12,
+  P_CY_R    = 13,
+  P_DIST_R  = 14,
+  P_RVEC    = 22,   // left to right rotation vector
+  P_TVEC    = 25,   // left to right translation
+  NUM_SHARED = 28,
+  NUM_POSE   = 6
+};
+
+//
+// Shared parameters seen by each eye's residuals, in the order the
+// derivatives are laid out; the view's pose follows them
+//
+static const int NUM_SHARED_L = 12;
+static const int NUM_SHARED_R = 18;
+
+static const int SHARED_L[NUM_SHARED_L] =
+{
+  P_FX, P_FY, P_CX_L, P_CY_L,
+  P_DIST_L, P_DIST_L + 1, P_DIST_L + 2, P_DIST_L + 3,
+  P_DIST_L + 4, P_DIST_L + 5, P_DIST_L + 6, P_DIST_L + 7
+};
+
+static const int SHARED_R[NUM_SHARED_R] =
+{
+  P_FX, P_FY, P_CX_R, P_CY_R,
+  P_DIST_R, P_DIST_R + 1, P_DIST_R + 2, P_DIST_R + 3,
+  P_DIST_R + 4, P_DIST_R + 5, P_DIST_R + 6, P_DIST_R + 7,
+  P_RVEC, P_RVEC + 1, P_RVEC + 2, P_TVEC, P_TVEC + 1, P_TVEC + 2
+};
+
+//
+// At most this many views go into the per-camera calibrations that give the
+// starting point without a guess
+//
+static const size_t MAX_INIT_VIEWS = 20;
+
+
+//
+// Dual number with N derivatives, for forward-mode differentiation of the
+// projection. N is a compile-time constant, so every operation is a fixed
+// length loop the compiler unrolls and vectorizes.
+//
+template<int N>
+struct DuoJet
+{
+  DuoJet() : a( 0.0 ) { std::fill( v, v + N, 0.0 ); }
+
+  explicit DuoJet( const double x ) : a( x ) { std::fill( v, v + N, 0.0 ); }
+
+  DuoJet( const double x, const int i ) : a( x )
+  {
+    std::fill( v, v + N, 0.0 );
+    v[i] = 1.0;
+  }
+
+  double a;
+  double v[N];
+};
+
+template<int N>
+inline DuoJet<N> operator+( const DuoJet<N>& f, const DuoJet<N>& g )
+{
+  DuoJet<N> h( f.a + g.a );
+  for( int i = 0; i < N; ++i ) h.v[i] = f.v[i] + g.v[i];
+  return h;
+}
+
+template<int N>
+inline DuoJet<N> operator-( const DuoJet<N>& f, const DuoJet<N>& g )
+{
+  DuoJet<N> h( f.a - g.a );
+  for( int i = 0; i < N; ++i ) h.v[i] = f.v[i] - g.v[i];
+  return h;
+}
+
+template<int N>
+inline DuoJet<N> operator*( const DuoJet<N>& f, const DuoJet<N>& g )
+{
+  DuoJet<N> h( f.a*g.a );
+  for( int i = 0; i < N; ++i ) h.v[i] = f.a*g.v[i] + f.v[i]*g.a;
+  return h;
+}
+
+template<int N>
+inline DuoJet<N> operator/( const DuoJet<N>& f, const DuoJet<N>& g )
+{
+  const double inv = 1.0/g.a;
+  const double q   = f.a*inv;
+
+  DuoJet<N> h( q );
+  for( int i = 0; i < N; ++i ) h.v[i] = ( f.v[i] - q*g.v[i] )*inv;
+  return h;
+}
+
+template<int N>
+inline DuoJet<N> operator+( const DuoJet<N>& f, const double s )
+{
+  DuoJet<N> h( f );
+  h.a += s;
+  return h;
+}
+
+template<int N>
+inline DuoJet<N> operator-( const DuoJet<N>& f, const double s )
+{
+  DuoJet<N> h( f );
+  h.a -= s;
+  return h;
+}
+
+template<int N>
+inline DuoJet<N> operator*( const double s, const DuoJet<N>& f )
+{
+  DuoJet<N> h( s*f.a );
+  for( int i = 0; i < N; ++i ) h.v[i] = s*f.v[i];
+  return h;
+}
+
+template<int N>
+inline DuoJet<N> sqrt( const DuoJet<N>& f )
+{
+  const double r = std::sqrt( f.a );
+
+  DuoJet<N> h( r );
+  const double d = 0.5/r;
+  for( int i = 0; i < N; ++i ) h.v[i] = d*f.v[i];
+  return h;
+}
+
+template<int N>
+inline DuoJet<N> sin( const DuoJet<N>& f )
+{
+  DuoJet<N> h( std::sin( f.a ) );
+  const double d = std::cos( f.a );
+  for( int i = 0; i < N; ++i ) h.v[i] = d*f.v[i];
+  return h;
+}
+
+template<int N>
+inline DuoJet<N> cos( const DuoJet<N>& f )
+{
+  DuoJet<N> h( std::cos( f.a ) );
+  const double d = -std::sin( f.a );
+  for( int i = 0; i < N; ++i ) h.v[i] = d*f.v[i];
+  return h;
+}
+
+template<int N>
+inline double value( const DuoJet<N>& f ) { return f.a; }
+
+inline double value( const double f ) { return f; }
+
+
+//
+// X rotated by the rotation vector r. Near zero rotation the first order
+// form is used, whose derivatives are still exact at r = 0.
+//
+template<typename T>
+static void rotatePoint( const T* r, const T* X, T* out )
+{
+  using std::cos;
+  using std::sin;
+  using std::sqrt;
+
+  const T theta2 = r[0]*r[0] + r[1]*r[1] + r[2]*r[2];
+
+  if( value( theta2 ) > 1e-20 )
+  {
+    const T theta = sqrt( theta2 );
+    const T c     = cos( theta );
+    const T s     = sin( theta );
+
+    const T w[3] = { r[0]/theta, r[1]/theta, r[2]/theta };
+
+    const T wx[3] = { w[1]*X[2] - w[2]*X[1],
+                      w[2]*X[0] - w[0]*X[2],
+                      w[0]*X[1] - w[1]*X[0] };
+
+    const T k = ( w[0]*X[0] + w[1]*X[1] + w[2]*X[2] )*( T( 1.0 ) - c );
+
+    for( int i = 0; i < 3; ++i )
+      out[i] = X[i]*c + wx[i]*s + w[i]*k;
+  }
+  else
+  {
+    out[0] = X[0] + r[1]*X[2] - r[2]*X[1];
+    out[1] = X[1] + r[2]*X[0] - r[0]*X[2];
+    out[2] = X[2] + r[0]*X[1] - r[1]*X[0];
+  }
+}
+
+
+//
+// Pinhole projection with OpenCV's rational distortion model.
+// intr is fx fy cx cy, dist is k1 k2 p1 p2 k3 k4 k5 k6.
+//
+template<typename T>
+static void projectRational( const T* intr, const T* dist, const T* X, T* uv )
+{
+  const T z  = T( 1.0 )/X[2];
+  const T x  = X[0]*z;
+  const T y  = X[1]*z;
+
+  const T x2 = x*x;
+  const T y2 = y*y;
+  const T xy = x*y;
+  const T r2 = x2 + y2;
+  const T r4 = r2*r2;
+  const T r6 = r4*r2;
+
+  const T radial = ( T( 1.0 ) + dist[0]*r2 + dist[1]*r4 + dist[4]*r6 )/
+                   ( T( 1.0 ) + dist[5]*r2 + dist[6]*r4 + dist[7]*r6 );
+
+  const T xd = x*radial + T( 2.0 )*dist[2]*xy + dist[3]*( r2 + T( 2.0 )*x2 );
+  const T yd = y*radial + dist[2]*( r2 + T( 2.0 )*y2 ) + T( 2.0 )*dist[3]*xy;
+
+  uv[0] = intr[0]*xd + intr[2];
+  uv[1] = intr[1]*yd + intr[3];
+}
+
+
+//
+// Left and right projections of a board point. shared is laid out as
+// SHARED_R for the right eye and SHARED_L (its first 12 entries) for the
+// left; pose is the view's rvec and tvec.
+//
+template<typename T>
+static void projectLeft( const T* shared, const T* pose, const cv::Point3f& P, T* uv )
+{
+  const T X[3] = { T( P.x ), T( P.y ), T( P.z ) };
+
+  T Xl[3];
+  rotatePoint( pose, X, Xl );
+  for( int i = 0; i < 3; ++i ) Xl[i] = Xl[i] + pose[3 + i];
+
+  projectRational( shared, shared + 4, Xl, uv );
+}
+
+template<typename T>
+static void projectRight( const T* shared, const T* pose, const cv::Point3f& P, T* uv )
+{
+  const T X[3] = { T( P.x ), T( P.y ), T( P.z ) };
+
+  T Xl[3];
+  rotatePoint( pose, X, Xl );
+  for( int i = 0; i < 3; ++i ) Xl[i] = Xl[i] + pose[3 + i];
+
+  T Xr[3];
+  rotatePoint( shared + 12, Xl, Xr );
+  for( int i = 0; i < 3; ++i ) Xr[i] = Xr[i] + shared[15 + i];
+
+  projectRational( shared, shared + 4, Xr, uv );
+}
+
+
+//
+// Normal equation blocks of one view: U is its share of the shared block,
+// W couples the shared parameters with its pose, V is its pose block, and
+// g and h are the gradients J^T r of the shared parameters and the pose
+//
+struct DuoViewBlocks
+{
+  double U[NUM_SHARED*NUM_SHARED];
+  double W[NUM_SHARED*NUM_POSE];
+  double V[NUM_POSE*NUM_POSE];
+  double g[NUM_SHARED];
+  double h[NUM_POSE];
+  double cost;
+};
+
+
+//
+// Add one residual row to the view's blocks. d holds the row's derivatives,
+// the NS shared ones (indices into the shared parameters given by shared)
+// followed by the pose's.
+//
+template<int NS>
+static void accumulate( const int* shared, const double* d, const double r,
+                        DuoViewBlocks& b )
+{
+  const double* dp = d + NS;
+
+  for( int i = 0; i < NS; ++i )
+  {
+    const int gi = shared[i];
+
+    double* U = b.U + gi*NUM_SHARED;
+    for( int j = 0; j < NS; ++j )
+      U[shared[j]] += d[i]*d[j];
+
+    double* W = b.W + gi*NUM_POSE;
+    for( int k = 0; k < NUM_POSE; ++k )
+      W[k] += d[i]*dp[k];
+
+    b.g[gi] += d[i]*r;
+  }
+
+  for( int k = 0; k < NUM_POSE; ++k )
+  {
+    for( int l = 0; l < NUM_POSE; ++l )
+      b.V[k*NUM_POSE + l] += dp[k]*dp[l];
+
+    b.h[k] += dp[k]*r;
+  }
+}
+
+
+//
+// Residuals and Jacobian blocks of one view
+//
+static void buildView( const std::vector<double>& params,
+                       const double* pose,
+                       const std::vector<cv::Point3f>& objectPts,
+                       const cv::Point2f* ptsL,
+                       const cv::Point2f* ptsR,
+                       DuoViewBlocks& b )
+{
+  std::fill( b.U, b.U + NUM_SHARED*NUM_SHARED, 0.0 );
+  std::fill( b.W, b.W + NUM_SHARED*NUM_POSE,   0.0 );
+  std::fill( b.V, b.V + NUM_POSE*NUM_POSE,     0.0 );
+  std::fill( b.g, b.g + NUM_SHARED,            0.0 );
+  std::fill( b.h, b.h + NUM_POSE,              0.0 );
+  b.cost = 0.0;
+
+  typedef DuoJet<NUM_SHARED_L + NUM_POSE> JetL;
+  typedef DuoJet<NUM_SHARED_R + NUM_POSE> JetR;
+
+  JetL sharedL[NUM_SHARED_L];
+  JetL poseL[NUM_POSE];
+  JetR sharedR[NUM_SHARED_R];
+  JetR poseR[NUM_POSE];
+
+  for( int i = 0; i < NUM_SHARED_L; ++i )
+    sharedL[i] = JetL( params[SHARED_L[i]], i );
+  for( int i = 0; i < NUM_SHARED_R; ++i )
+    sharedR[i] = JetR( params[SHARED_R[i]], i );
+
+  for( int k = 0; k < NUM_POSE; ++k )
+  {
+    poseL[k] = JetL( pose[k], NUM_SHARED_L + k );
+    poseR[k] = JetR( pose[k], NUM_SHARED_R + k );
+  }
+
+  for( size_t p = 0; p < objectPts.size(); ++p )
+  {
+    JetL uvL[2];
+    projectLeft( sharedL, poseL, objectPts[p], uvL );
+
+    const double rL[2] = { uvL[0].a - ptsL[p].x, uvL[1].a - ptsL[p].y };
+
+    accumulate<NUM_SHARED_L>( SHARED_L, uvL[0].v, rL[0], b );
+    accumulate<NUM_SHARED_L>( SHARED_L, uvL[1].v, rL[1], b );
+
+    JetR uvR[2];
+    projectRight( sharedR, poseR, objectPts[p], uvR );
+
+    const double rR[2] = { uvR[0].a - ptsR[p].x, uvR[1].a - ptsR[p].y };
+
+    accumulate<NUM_SHARED_R>( SHARED_R, uvR[0].v, rR[0], b );
+    accumulate<NUM_SHARED_R>( SHARED_R, uvR[1].v, rR[1], b );
+
+    b.cost += rL[0]*rL[0] + rL[1]*rL[1] + rR[0]*rR[0] + rR[1]*rR[1];
+  }
+}
+
+
+//
+// Sum of squared residuals of one view
+//
+static double viewCost( const std::vector<double>& params,
+                        const double* pose,
+                        const std::vector<cv::Point3f>& objectPts,
+                        const cv::Point2f* ptsL,
+                        const cv::Point2f* ptsR )
+{
+  double sharedL[NUM_SHARED_L];
+  double sharedR[NUM_SHARED_R];
+
+  for( int i = 0; i < NUM_SHARED_L; ++i ) sharedL[i] = params[SHARED_L[i]];
+  for( int i = 0; i < NUM_SHARED_R; ++i ) sharedR[i] = params[SHARED_R[i]];
+
+  double cost = 0.0;
+
+  for( size_t p = 0; p < objectPts.size(); ++p )
+  {
+    double uv[2];
+
+    projectLeft( sharedL, pose, objectPts[p], uv );
+    cost += ( uv[0] - ptsL[p].x )*( uv[0] - ptsL[p].x ) +
+            ( uv[1] - ptsL[p].y )*( uv[1] - ptsL[p].y );
+
+    projectRight( sharedR, pose, objectPts[p], uv );
+    cost += ( uv[0] - ptsR[p].x )*( uv[0] - ptsR[p].x ) +
+            ( uv[1] - ptsR[p].y )*( uv[1] - ptsR[p].y );
+  }
+
+  return cost;
+}
+
+
+//
+// First n coefficients of a distortion vector of any shape, zero padded
+//
+static void readCoefficients( const cv::Mat& D, double* out, const int n )
+{
+  std::fill( out, out + n, 0.0 );
+
+  cv::Mat d;
+  D.convertTo( d, CV_64F );
+  d = d.reshape( 1, 1 );
+
+  for( int i = 0; i < std::min( n, d.cols ); ++i )
+    out[i] = d.at<double>( 0, i );
+}
+
+
+DuoBundleAdjuster::DuoBundleAdjuster( const cv::Size& imageSize,
+                                      const cv::TermCriteria& termCrit )
+  : m_imageSize( imageSize )
+  , m_termCrit( termCrit )
+  , m_numIterations( 0 )
+{}
+
+
+void DuoBundleAdjuster::initialize( const DuoViewStore& views,
+                                    const cv::Mat& M1, const cv::Mat& D1,
+                                    const cv::Mat& M2, const cv::Mat& D2,
+                                    const cv::Mat& R,  const cv::Mat& T,
+                                    const bool useGuess )
+{
+  const size_t n = views.size();
+
+  const cv::Mat board = views.getBoardMat();
+
+  cv::Mat K[2];
+  cv::Mat D[2];
+
+  if( useGuess )
+  {
+    M1.convertTo( K[0], CV_64F );
+    M2.convertTo( K[1], CV_64F );
+    D[0] = D1;
+    D[1] = D2;
+  }
+  else
+  {
+    //
+    // Each camera alone on evenly spread views: enough for a starting
+    // point, and a fixed cost however many views there are
+    //
+    std::vector<cv::Mat> subsetObj;
+    std::vector<cv::Mat> subsetPts[2];
+
+    const size_t numInit = std::min( n, MAX_INIT_VIEWS );
+    const double step    = double( n )/numInit;
+
+    for( size_t k = 0; k < numInit; ++k )
+    {
+      const size_t i = std::min( size_t( k*step + 0.5 ), n - 1 );
+
+      subsetObj.push_back( board );
+      subsetPts[0].push_back( views.getLeftMat( i ) );
+      subsetPts[1].push_back( views.getRightMat( i ) );
+    }
+
+    cv::parallel_for_( cv::Range( 0, 2 ), [&]( const cv::Range& range )
+    {
+      for( int v = range.start; v < range.end; ++v )
+      {
+        std::vector<cv::Mat> rvecs;
+        std::vector<cv::Mat> tvecs;
+
+        cv::calibrateCamera( subsetObj, subsetPts[v], m_imageSize, K[v], D[v],
+                             rvecs, tvecs, CV_CALIB_RATIONAL_MODEL );
+      }
+    } );
+  }
+
+  m_params.assign( NUM_SHARED, 0.0 );
+
+  m_params[P_FX]   = 0.5*( K[0].at<double>( 0, 0 ) + K[1].at<double>( 0, 0 ) );
+  m_params[P_FY]   = 0.5*( K[0].at<double>( 1, 1 ) + K[1].at<double>( 1, 1 ) );
+  m_params[P_CX_L] = K[0].at<double>( 0, 2 );
+  m_params[P_CY_L] = K[0].at<double>( 1, 2 );
+  m_params[P_CX_R] = K[1].at<double>( 0, 2 );
+  m_params[P_CY_R] = K[1].at<double>( 1, 2 );
+
+  readCoefficients( D[0], &m_params[P_DIST_L], 8 );
+  readCoefficients( D[1], &m_params[P_DIST_R], 8 );
+
+  //
+  // Board poses in each camera, from which the stereo pose is estimated
+  // per view when there is no guess for it
+  //
+  m_poses.assign( NUM_POSE*n, 0.0 );
+
+  std::vector<cv::Vec3d> rvecsLR( n );
+  std::vector<cv::Vec3d> tvecsLR( n );
+
+  const bool guessRT = useGuess && R.total() == 9 && T.total() == 3;
+
+  cv::parallel_for_( cv::Range( 0, int( n ) ), [&]( const cv::Range& range )
+  {
+    cv::Mat rvecL, tvecL, rvecR, tvecR;
+
+    for( int i = range.start; i < range.end; ++i )
+    {
+      cv::solvePnP( board, views.getLeftMat( i ), K[0], D[0], rvecL, tvecL );
+
+      for( int k = 0; k < 3; ++k )
+      {
+        m_poses[NUM_POSE*i + k]     = rvecL.at<double>( k );
+        m_poses[NUM_POSE*i + 3 + k] = tvecL.at<double>( k );
+      }
+
+      if( guessRT ) continue;
+
+      cv::solvePnP( board, views.getRightMat( i ), K[1], D[1], rvecR, tvecR );
+
+      //
+      // Right pose = (R, T) after the left pose
+      //
+      cv::Mat RL, RR;
+      cv::Rodrigues( rvecL, RL );
+      cv::Rodrigues( rvecR, RR );
+
+      const cv::Mat RLR = RR*RL.t();
+      const cv::Mat TLR = tvecR - RLR*tvecL;
+
+      cv::Mat rvecLR;
+      cv::Rodrigues( RLR, rvecLR );
+
+      for( int k = 0; k < 3; ++k )
+      {
+        rvecsLR[i][k] = rvecLR.at<double>( k );
+        tvecsLR[i][k] = TLR.at<double>( k );
+      }
+    }
+  } );
+
+  if( guessRT )
+  {
+    cv::Mat rvecLR;
+    cv::Rodrigues( R, rvecLR );
+    rvecLR.convertTo( rvecLR, CV_64F );
+
+    cv::Mat t;
+    T.convertTo( t, CV_64F );
+
+    for( int k = 0; k < 3; ++k )
+    {
+      m_params[P_RVEC + k] = rvecLR.at<double>( k );
+      m_params[P_TVEC + k] = t.at<double>( k );
+    }
+  }
+  else
+  {
+    //
+    // Per-component median over the views, robust to a few bad poses
+    //
+    std::vector<double> c( n );
+
+    for( int k = 0; k < 3; ++k )
+    {
+      for( size_t i = 0; i < n; ++i ) c[i] = rvecsLR[i][k];
+      std::nth_element( c.begin(), c.begin() + n/2, c.end() );
+      m_params[P_RVEC + k] = c[n/2];
+
+      for( size_t i = 0; i < n; ++i ) c[i] = tvecsLR[i][k];
+      std::nth_element( c.begin(), c.begin() + n/2, c.end() );
+      m_params[P_TVEC + k] = c[n/2];
+    }
+  }
+}
+
+
+double DuoBundleAdjuster::solve( const DuoViewStore& views,
+                                 cv::Mat& M1, cv::Mat& D1,
+                                 cv::Mat& M2, cv::Mat& D2,
+                                 cv::Mat& R,  cv::Mat& T,
+                                 cv::Mat& E,  cv::Mat& F,
+                                 const bool useGuess )
+{
+  const size_t n = views.size();
+
+  m_numIterations = 0;
+
+  if( n == 0 ) return -1.0;
+
+  const std::vector<cv::Point3f>& objectPts = views.getBoard();
+
+  const size_t numPoints = n*objectPts.size();
+
+  initialize( views, M1, D1, M2, D2, R, T, useGuess );
+
+  const int    maxIterations =
+      ( m_termCrit.type & cv::TermCriteria::COUNT ) ? m_termCrit.maxCount : 30;
+  const double epsilon =
+      ( m_termCrit.type & cv::TermCriteria::EPS ) ? m_termCrit.epsilon : 1e-6;
+
+  std::vector<DuoViewBlocks> blocks( n );
+
+  std::vector<double> trialParams( NUM_SHARED );
+  std::vector<double> trialPoses( NUM_POSE*n );
+  std::vector<double> viewCosts( n );
+
+  //
+  // Damped pose blocks, inverted, and their products with W, per view
+  //
+  std::vector<cv::Matx<double, NUM_POSE, NUM_POSE>> Vinv( n );
+
+  double lambda = 1e-3;
+  double cost   = 0.0;
+
+  for( int iteration = 0; iteration < maxIterations; ++iteration )
+  {
+    cv::parallel_for_( cv::Range( 0, int( n ) ), [&]( const cv::Range& range )
+    {
+      for( int i = range.start; i < range.end; ++i )
+        buildView( m_params, &m_poses[NUM_POSE*i],
+                   objectPts, views.left( i ), views.right( i ), blocks[i] );
+    } );
+
+    cv::Mat U = cv::Mat::zeros( NUM_SHARED, NUM_SHARED, CV_64F );
+    cv::Mat g = cv::Mat::zeros( NUM_SHARED, 1, CV_64F );
+
+    cost = 0.0;
+
+    for( size_t i = 0; i < n; ++i )
+    {
+      U += cv::Mat( NUM_SHARED, NUM_SHARED, CV_64F, blocks[i].U );
+      g += cv::Mat( NUM_SHARED, 1, CV_64F, blocks[i].g );
+      cost += blocks[i].cost;
+    }
+
+    bool   accepted = false;
+    double stepNorm = 0.0;
+
+    //
+    // Raise the damping until a step lowers the cost
+    //
+    while( !accepted && lambda < 1e12 )
+    {
+      //
+      // Reduced system S dx = b over the shared parameters, with
+      // S = U - sum W V^-1 W^T and b = -g + sum W V^-1 h
+      //
+      cv::Mat S = U.clone();
+      cv::Mat b = -g;
+
+      for( int j = 0; j < NUM_SHARED; ++j )
+        S.at<double>( j, j ) *= 1.0 + lambda;
+
+      bool ok = true;
+
+      for( size_t i = 0; i < n && ok; ++i )
+      {
+        cv::Matx<double, NUM_POSE, NUM_POSE> V( blocks[i].V );
+        for( int k = 0; k < NUM_POSE; ++k )
+          V( k, k ) *= 1.0 + lambda;
+
+        ok = cv::invert( V, Vinv[i], cv::DECOMP_CHOLESKY ) != 0.0;
+
+        const cv::Matx<double, NUM_SHARED, NUM_POSE> W( blocks[i].W );
+        const cv::Matx<double, NUM_POSE, 1>          h( blocks[i].h );
+
+        const cv::Matx<double, NUM_SHARED, NUM_POSE> WVinv = W*Vinv[i];
+
+        S -= cv::Mat( WVinv*W.t() );
+        b += cv::Mat( WVinv*h );
+      }
+
+      cv::Mat dx;
+      if( !ok || !cv::solve( S, b, dx, cv::DECOMP_CHOLESKY ) )
+      {
+        lambda *= 10.0;
+        continue;
+      }
+
+      //
+      // Back-substitute each view's pose step: dp = -V^-1 ( h + W^T dx )
+      //
+      const cv::Matx<double, NUM_SHARED, 1> dxm( dx.ptr<double>() );
+
+      stepNorm = cv::norm( dx, cv::NORM_L2SQR );
+
+      for( int j = 0; j < NUM_SHARED; ++j )
+        trialParams[j] = m_params[j] + dxm( j );
+
+      for( size_t i = 0; i < n; ++i )
+      {
+        const cv::Matx<double, NUM_SHARED, NUM_POSE> W( blocks[i].W );
+        const cv::Matx<double, NUM_POSE, 1>          h( blocks[i].h );
+
+        const cv::Matx<double, NUM_POSE, 1> dp = -( Vinv[i]*( h + W.t()*dxm ) );
+
+        for( int k = 0; k < NUM_POSE; ++k )
+        {
+          trialPoses[NUM_POSE*i + k] = m_poses[NUM_POSE*i + k] + dp( k );
+          stepNorm += dp( k )*dp( k );
+        }
+      }
+
+      cv::parallel_for_( cv::Range( 0, int( n ) ), [&]( const cv::Range& range )
+      {
+        for( int i = range.start; i < range.end; ++i )
+          viewCosts[i] = viewCost( trialParams, &trialPoses[NUM_POSE*i],
+                                   objectPts, views.left( i ), views.right( i ) );
+      } );
+
+      double trialCost = 0.0;
+      for( size_t i = 0; i < n; ++i )
+        trialCost += viewCosts[i];
+
+      if( trialCost < cost )
+      {
+        m_params.swap( trialParams );
+        m_poses.swap( trialPoses );
+        cost     = trialCost;
+        lambda   = std::max( lambda*0.1, 1e-12 );
+        accepted = true;
+      }
+      else
+      {
+        lambda *= 10.0;
+      }
+    }
+
+    m_numIterations = iteration + 1;
+
+    if( !accepted ) break;
+
+    //
+    // Converged when the step is small next to the parameters, as in
+    // OpenCV's own Levenberg-Marquardt
+    //
+    const double paramNorm = cv::norm( cv::Mat( m_params ), cv::NORM_L2SQR ) +
+                             cv::norm( cv::Mat( m_poses ),  cv::NORM_L2SQR );
+
+    if( std::sqrt( stepNorm ) <= epsilon*std::sqrt( paramNorm ) ) break;
+  }
+
+  //
+  // Outputs in cv::stereoCalibrate's layout
+  //
+  M1 = ( cv::Mat_<double>( 3, 3 ) << m_params[P_FX], 0.0, m_params[P_CX_L],
+                                     0.0, m_params[P_FY], m_params[P_CY_L],
+                                     0.0, 0.0, 1.0 );
+  M2 = ( cv::Mat_<double>( 3, 3 ) << m_params[P_FX], 0.0, m_params[P_CX_R],
+                                     0.0, m_params[P_FY], m_params[P_CY_R],
+                                     0.0, 0.0, 1.0 );
+
+  D1 = cv::Mat( 1, 8, CV_64F, &m_params[P_DIST_L] ).clone();
+  D2 = cv::Mat( 1, 8, CV_64F, &m_params[P_DIST_R] ).clone();
+
+  cv::Rodrigues( cv::Mat( 3, 1, CV_64F, &m_params[P_RVEC] ), R );
+  T = cv::Mat( 3, 1, CV_64F, &m_params[P_TVEC] ).clone();
+
+  //
+  // E = [T]x R, F = M2^-T E M1^-1, normalized as OpenCV does
+  //
+  const double* t = &m_params[P_TVEC];
+  const cv::Mat Tx = ( cv::Mat_<double>( 3, 3 ) <<   0.0, -t[2],  t[1],
+                                                     t[2],   0.0, -t[0],
+                                                    -t[1],  t[0],   0.0 );
+  E = Tx*R;
+  F = M2.inv().t()*E*M1.inv();
+
+  if( std::abs( F.at<double>( 2, 2 ) ) > 0.0 )
+    F /= F.at<double>( 2, 2 );
+
+  return std::sqrt( cost/( 2*numPoints ) );
+}
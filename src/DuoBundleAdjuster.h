@@ -0,0 +1,79 @@
+#ifndef DUO_BUNDLE_ADJUSTER_H
+#define DUO_BUNDLE_ADJUSTER_H
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "DuoViewStore.h"
+
+
+//
+// Stereo calibration by sparse bundle adjustment, for large view counts.
+//
+// Solves for the same model as cv::stereoCalibrate with
+// CV_CALIB_RATIONAL_MODEL | CV_CALIB_SAME_FOCAL_LENGTH: one focal length for
+// both eyes, a principal point and 8 distortion coefficients per eye, the
+// stereo R/T, and a board pose per view, 28 + 6*views parameters in all.
+//
+// Each view's residuals only involve the shared parameters and its own pose,
+// so the normal equations are block-structured: the pose blocks are
+// eliminated with the Schur complement and only a 28x28 system is solved per
+// Levenberg-Marquardt step. Jacobians are evaluated per view on all cores
+// with forward-mode automatic differentiation, with the number of
+// derivatives fixed at compile time for each eye. The cost of a solve grows
+// linearly with the number of views, where stereoCalibrate's dense normal
+// equations grow with its square.
+//
+class DuoBundleAdjuster
+{
+public:
+
+  DuoBundleAdjuster( const cv::Size& imageSize,
+                     const cv::TermCriteria& termCrit =
+                       cv::TermCriteria( cv::TermCriteria::COUNT +
+                                         cv::TermCriteria::EPS, 30, 1e-6 ) );
+
+  //
+  // Outputs as for cv::stereoCalibrate, from the views of the store. With
+  // useGuess, M1/D1/M2/D2, and R/T when they are set, are the starting
+  // point; otherwise each camera is first calibrated on its own from a
+  // subset of the views. Returns the RMS reprojection error over both eyes,
+  // or a negative value on failure.
+  //
+  double solve( const DuoViewStore& views,
+                cv::Mat& M1, cv::Mat& D1,
+                cv::Mat& M2, cv::Mat& D2,
+                cv::Mat& R,  cv::Mat& T,
+                cv::Mat& E,  cv::Mat& F,
+                const bool useGuess );
+
+  //
+  // Levenberg-Marquardt iterations of the last solve
+  //
+  int getNumIterations() const { return m_numIterations; }
+
+private:
+
+  void initialize( const DuoViewStore& views,
+                   const cv::Mat& M1, const cv::Mat& D1,
+                   const cv::Mat& M2, const cv::Mat& D2,
+                   const cv::Mat& R,  const cv::Mat& T,
+                   const bool useGuess );
+
+private:
+
+  const cv::Size         m_imageSize;
+  const cv::TermCriteria m_termCrit;
+
+  //
+  // Shared parameters (see the layout in the .cpp) and 6 per view: the
+  // board's rotation vector and translation in the left camera
+  //
+  std::vector<double>    m_params;
+  std::vector<double>    m_poses;
+
+  int                    m_numIterations;
+};
+
+#endif // DUO_BUNDLE_ADJUSTER_H
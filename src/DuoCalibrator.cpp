@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <iomanip>
 #include <iostream>
 #include <regex>
@@ -8,7 +11,9 @@
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 
+#include "DuoBundleAdjuster.h"
 #include "DuoCalibrator.h"
+#include "DuoProfiler.h"
 
 
 static std::string now()
@@ -45,11 +50,222 @@ static std::string expandEnvironmentVariables( const std::string& input )
 
 const std::string dateTime = now();
 
-const std::string intrinsics =
-    "cameraFiles/intrinsicsDuoVGA-" + dateTime + ".yml";
+//
+// solve() needs this many image sets, and pruning never goes below it
+//
+const size_t MIN_VIEWS = 10;
+
+//
+// Outlier pruning in solve(), see pruneViews()
+//
+const double PRUNE_MADS           = 3.0;
+const double MIN_PRUNE_ERROR_PX   = 0.25;
+const int    MAX_PRUNE_ITERATIONS = 5;
+
+
+//
+// <kind>Duo<resolution>-<dateTime>.yml, e.g. intrinsicsDuoVGA-<dateTime>.yml
+//
+static std::string calibrationFileName( const std::string& kind,
+                                        const cv::Size& size )
+{
+  std::stringstream ss;
+  ss << kind << "Duo";
+
+  if( size == VGA )
+    ss << "VGA";
+  else if( size == DUO_FULL )
+    ss << "FULL";
+  else if( size == QVGA )
+    ss << "QVGA";
+  else
+    ss << size.width << "x" << size.height;
+
+  ss << "-" << dateTime << ".yml";
+
+  return ss.str();
+}
+
+
+//
+// Disparity is computed at scale, or by default at QVGA height (at full size
+// for smaller images)
+//
+static cv::Size disparitySizeFor( const cv::Size& imageSize, const double scale )
+{
+  const double s = ( scale > 0.0 )
+                     ? std::min( scale, 1.0 )
+                     : std::min( 1.0, double( QVGA.height )/imageSize.height );
+
+  return cv::Size( cvRound( s*imageSize.width ), cvRound( s*imageSize.height ) );
+}
+
+
+//
+// Where a DUO image lies on the 752x480 sensor: each pixel spans binX x binY
+// sensor pixels (see GetDUOBinningFactors) and the image is a window
+// centered on the sensor, starting at x0, y0. Returns false if the image
+// does not fit on the sensor.
+//
+static bool sensorWindow( const cv::Size& size,
+                          int& binX, int& binY,
+                          double& x0, double& y0 )
+{
+  GetDUOBinningFactors( size.width, size.height, binX, binY );
+
+  x0 = 0.5*( WIDTH_FULL  - binX*size.width  );
+  y0 = 0.5*( HEIGHT_FULL - binY*size.height );
+
+  return x0 >= 0.0 && y0 >= 0.0;
+}
+
+
+//
+// Pixels of one DUO resolution in the pixels of another, u' = sx*u + tx and
+// v' = sy*v + ty, by way of the sensor position of the pixel centers. The
+// pinhole part of the model maps exactly; distortion acts on normalized
+// coordinates and does not change.
+//
+static bool pixelTransform( const cv::Size& from, const cv::Size& to,
+                            double& sx, double& sy,
+                            double& tx, double& ty )
+{
+  int    binXA, binYA, binXB, binYB;
+  double x0A, y0A, x0B, y0B;
+
+  if( !sensorWindow( from, binXA, binYA, x0A, y0A ) ||
+      !sensorWindow( to,   binXB, binYB, x0B, y0B ) )
+    return false;
+
+  sx = double( binXA )/binXB;
+  sy = double( binYA )/binYB;
+  tx = ( x0A - x0B + 0.5*( binXA - binXB ) )/binXB;
+  ty = ( y0A - y0B + 0.5*( binYA - binYB ) )/binYB;
+
+  return true;
+}
+
+
+//
+// Camera or projection matrix (3x3 or 3x4) for pixels moved by the
+// transform above
+//
+static void transformProjection( cv::Mat& P,
+                                 const double sx, const double sy,
+                                 const double tx, const double ty )
+{
+  cv::Mat out = P.clone();
+
+  cv::addWeighted( P.row( 0 ), sx, P.row( 2 ), tx, 0.0, out.row( 0 ) );
+  cv::addWeighted( P.row( 1 ), sy, P.row( 2 ), ty, 0.0, out.row( 1 ) );
+
+  P = out;
+}
+
+
+//
+// Disparity-to-depth matrix for pixels moved by the transform above, which
+// also scales the disparity by sx. Scaled by sx to keep Q's usual form.
+//
+static void transformDisparityToDepth( cv::Mat& Q,
+                                       const double sx, const double sy,
+                                       const double tx, const double ty )
+{
+  const cv::Mat A = ( cv::Mat_<double>( 4, 4 ) << sx,  0,  0, tx,
+                                                   0,  sy,  0, ty,
+                                                   0,   0, sx,  0,
+                                                   0,   0,  0,  1 );
+
+  cv::Mat out = Q*A.inv();
+  out *= sx;
+
+  Q = out;
+}
+
+
+static void transformPoints( std::vector<cv::Point2f>& pts,
+                             const double sx, const double sy,
+                             const double tx, const double ty )
+{
+  for( cv::Point2f& pt : pts )
+  {
+    pt.x = float( sx*pt.x + tx );
+    pt.y = float( sy*pt.y + ty );
+  }
+}
+
 
-const std::string extrinsics =
-    "cameraFiles/extrinsicsDuoVGA-" + dateTime + ".yml";
+DuoCalibrator::DuoCalibrator( const cv::Size& boardSize,
+                              const Pattern pattern,
+                              const cv::Size& imageSize,
+                              const float squareLength )
+  : m_pattern( pattern )
+  , m_squareLength( squareLength > 0.0f ? squareLength
+                    : pattern == PATTERN_CHESSBOARD ? 2.533f   // in cm, but this
+                                                    : 1.71f )  // could be m or mm
+  , m_boardSize( boardSize ) // inner corners (this project's "chessboard" is 9x6)
+  , m_imageSize( imageSize ) // VGA by default (could go as high as 752x480)
+  , m_disparitySize( disparitySizeFor( imageSize, 0.0 ) )
+  , m_disparityScale( 0.0 )
+  , m_pruneThreshold( 0.0 )
+  , m_nextViewId( 0 )
+  , m_detectionMode( DETECT_FULL_RES )
+  , m_pyramidLevels( 1 )     // VGA is searched at QVGA
+  , m_cornerRefiner( cv::Size(  5,  5 ),
+                     cv::Size( -1, -1 ),
+                     cv::TermCriteria( cv::TermCriteria::MAX_ITER |
+                                       cv::TermCriteria::EPS,
+                                       20,      // max number of iterations
+                                       0.1 ) )  // min accuracy
+  , m_pyramidRefiner( cv::Size(  3,  3 ),
+                      cv::Size( -1, -1 ),
+                      cv::TermCriteria( cv::TermCriteria::MAX_ITER |
+                                        cv::TermCriteria::EPS,
+                                        10,      // max number of iterations
+                                        0.1 ) )  // min accuracy
+  , m_tracking( true )
+  , m_hasTrack( false )
+  , m_reprojectionError( -1.0 )
+  , m_hasInitialGuess( false )
+  , m_solver( SOLVER_STEREO_CALIBRATE )
+  , m_log( &std::cout )
+  , m_minDepth( 0.0 )
+  , m_maxDepth( 0.0 )
+{
+  if( m_pattern == PATTERN_CHESSBOARD )
+  {
+    initChessboardObjectPts();
+    return;
+  }
+
+  initCircleGridObjectPts();
+
+  //
+  // Blob detector tuned for the printed circle grid at VGA:
+  // few threshold steps (the dots are high contrast black on white), and
+  // tight shape filters so that only the dots survive
+  //
+  cv::SimpleBlobDetector::Params params;
+  params.minThreshold        = 40;
+  params.maxThreshold        = 200;
+  params.thresholdStep       = 20;
+  params.minRepeatability    = 2;
+  params.minDistBetweenBlobs = 4;
+  params.filterByColor       = true;
+  params.blobColor           = 0;
+  params.filterByArea        = true;
+  params.minArea             = 12;
+  params.maxArea             = 12000;
+  params.filterByCircularity = true;
+  params.minCircularity      = 0.6f;
+  params.filterByConvexity   = true;
+  params.minConvexity        = 0.85f;
+  params.filterByInertia     = true;
+  params.minInertiaRatio     = 0.3f;
+
+  m_blobDetector[0] = cv::SimpleBlobDetector::create( params );
+  m_blobDetector[1] = cv::SimpleBlobDetector::create( params );
+}
 
 
 void DuoCalibrator::processFrame( const cv::Mat& left,
@@ -57,248 +273,1276 @@ void DuoCalibrator::processFrame( const cv::Mat& left,
                                   std::vector<cv::Point2f>& leftPtsOut,
                                   std::vector<cv::Point2f>& rightPtsOut )
 {
+  DUO_PROFILE_SCOPE( DUO_STAGE_DETECT );
+
   leftPtsOut.clear();
   rightPtsOut.clear();
 
-  detectChessboardPoints( left,  right, leftPtsOut, rightPtsOut );
-  //detectCirclesGridPoints( left,  right, leftPtsOut, rightPtsOut );
+  if( m_pattern == PATTERN_CHESSBOARD )
+    detectChessboardPoints( left, right, leftPtsOut, rightPtsOut );
+  else
+    detectCircleGridPoints( left, right, leftPtsOut, rightPtsOut );
+
+  ++m_detectionStats.numFrames;
+  m_detectionStats.sumMs += m_lastTimings.totalMs;
+
+  if( leftPtsOut.size()  == m_boardSize.area() &&
+      rightPtsOut.size() == m_boardSize.area() )
+    ++m_detectionStats.numBoardsFound;
 }
 
 
-void DuoCalibrator::calibrate()
+double DuoCalibrator::solve()
 {
-  if( m_objectPts.size() < 10 )
-  {
-    std::cout << "Too few frames, unable to continue with calibration\n";
-    exit(1);
-  }
+  if( m_views.size() < MIN_VIEWS ) return -1.0;
 
-  const auto calibDuoRoot = expandEnvironmentVariables( "${CALIBDUO_ROOT}/" );
+  m_calibTimings = DuoCalibrationTimings();
 
-  std::cout << "Stereo Calibrate...\n";
+  m_pruneThreshold = 0.0;
 
-  const auto termCrit =
-      cv::TermCriteria( cv::TermCriteria::COUNT + cv::TermCriteria::EPS,
-                        30,      // iterations
-                        1e-6 );  // change epsilon
+  //
+  // Views pruned by an earlier solve are gone from m_views; only this
+  // solve's are reported
+  //
+  m_prunedViews.clear();
 
-  const double errorX =
-      cv::stereoCalibrate( m_objectPts, m_imagePtsL, m_imagePtsR,
-                           m_M1, m_D1, m_M2, m_D2,
-                           m_imageSize,
-                           m_R, m_T, m_E, m_F,
-                           CV_CALIB_RATIONAL_MODEL | CV_CALIB_SAME_FOCAL_LENGTH,
-                           termCrit );
+  *m_log << "Stereo Calibrate...\n";
 
-  std::cout << "Stereo Reprojection Error: " << errorX << std::endl;
+  int64 t = cv::getTickCount();
 
-  cv::FileStorage fsI( calibDuoRoot + intrinsics, cv::FileStorage::WRITE );
+  m_reprojectionError = calibrateStereo();
 
-  if( fsI.isOpened() )
+  computeViewErrors();
+
+  for( int i = 0; i < MAX_PRUNE_ITERATIONS; ++i )
   {
-    fsI << "DateTime"          << dateTime
-        << "BoardWidth"        << m_boardSize.width
-        << "BoardHeight"       << m_boardSize.height
-        << "SquareLength"      << m_squareLength
-        << "ImageWidth"        << m_imageSize.width
-        << "ImageHeight"       << m_imageSize.height
-        << "NumImagePairs"     << (int) m_objectPts.size()
-        << "ReprojectionError" << errorX;
+    const size_t numPruned = pruneViews();
+    if( numPruned == 0 ) break;
 
-    fsI << "M1" << m_M1
-        << "D1" << m_D1
-        << "M2" << m_M2
-        << "D2" << m_D2;
+    *m_log << "Stereo Reprojection Error: " << m_reprojectionError
+              << ", dropped " << numPruned << " image sets above "
+              << m_pruneThreshold << " px\n";
 
-    fsI.release();
-  }
-  else
-  {
-    std::cout << "File <intrinsics>.yml could not be opened.\n";
-    exit(1);
+    //
+    // The remaining views barely move the intrinsics: start from them.
+    // The bundle adjuster also starts from the previous R and T, whereas
+    // stereoCalibrate re-initialises them from the per-view poses.
+    //
+    m_hasInitialGuess = true;
+
+    m_reprojectionError = calibrateStereo();
+
+    computeViewErrors();
   }
 
-  std::cout << "Stereo Rectify...\n";
+  m_calibTimings.calibrateMs = TicksToMs( cv::getTickCount() - t );
+
+  *m_log << "Stereo Reprojection Error: " << m_reprojectionError << std::endl;
+
+  *m_log << "Stereo Rectify...\n";
+
+  t = cv::getTickCount();
 
   cv::stereoRectify( m_M1, m_D1, m_M2, m_D2,
                      m_imageSize,
                      m_R, m_T, m_R1, m_R2, m_P1, m_P2, m_Q,
                      CV_CALIB_ZERO_DISPARITY, 0 );
 
-  std::cout << "Undistort Rectify\n";
+  m_calibTimings.rectifyMs = TicksToMs( cv::getTickCount() - t );
 
-  cv::initUndistortRectifyMap( m_M1, m_D1, m_R1, m_P1,
-                               m_imageSize, CV_16SC2,
-                               m_mapL1, m_mapL2 );
+  *m_log << "Undistort Rectify\n";
 
-  cv::initUndistortRectifyMap( m_M2, m_D2, m_R2, m_P2,
-                               m_imageSize, CV_16SC2,
-                               m_mapR1, m_mapR2 );
+  t = cv::getTickCount();
 
-  cv::FileStorage fsX( calibDuoRoot + extrinsics, cv::FileStorage::WRITE );
+  initRectifyMaps();
 
-  if( fsX.isOpened() )
+  m_calibTimings.mapsMs = TicksToMs( cv::getTickCount() - t );
+
+  return m_reprojectionError;
+}
+
+
+//
+// Stereo calibration of the kept views with the selected solver, from the
+// initial guess if there is one
+//
+double DuoCalibrator::calibrateStereo()
+{
+  const auto termCrit =
+      cv::TermCriteria( cv::TermCriteria::COUNT + cv::TermCriteria::EPS,
+                        30,      // iterations
+                        1e-6 );  // change epsilon
+
+  const bool useGuess = m_hasInitialGuess;
+
+  m_hasInitialGuess = false;
+
+  if( m_solver == SOLVER_BUNDLE_ADJUST )
   {
-    fsX << "DateTime"          << dateTime
-        << "BoardWidth"        << m_boardSize.width
-        << "BoardHeight"       << m_boardSize.height
-        << "SquareLength"      << m_squareLength
-        << "ImageWidth"        << m_imageSize.width
-        << "ImageHeight"       << m_imageSize.height
-        << "NumImagePairs"     << (int) m_objectPts.size()
-        << "ReprojectionError" << errorX;
+    DuoBundleAdjuster adjuster( m_imageSize, termCrit );
 
-    fsX << "R"  << m_R
-        << "T"  << m_T
-        << "R1" << m_R1
-        << "R2" << m_R2
-        << "P1" << m_P1
-        << "P2" << m_P2
-        << "Q"  << m_Q;
+    const double error =
+        adjuster.solve( m_views,
+                        m_M1, m_D1, m_M2, m_D2,
+                        m_R, m_T, m_E, m_F,
+                        useGuess );
 
-    fsX << "E" << m_E
-        << "F" << m_F;
+    *m_log << "Bundle adjustment: " << adjuster.getNumIterations()
+              << " iterations over " << m_views.size() << " views\n";
 
-    fsX.release();
+    return error;
   }
-  else
+
+  int flags = CV_CALIB_RATIONAL_MODEL | CV_CALIB_SAME_FOCAL_LENGTH;
+  if( useGuess )
+    flags |= CV_CALIB_USE_INTRINSIC_GUESS;
+
+  //
+  // Headers onto the store, nothing is copied
+  //
+  std::vector<cv::Mat> objectPts;
+  std::vector<cv::Mat> imagePtsL;
+  std::vector<cv::Mat> imagePtsR;
+  m_views.getArrays( objectPts, imagePtsL, imagePtsR );
+
+  return cv::stereoCalibrate( objectPts, imagePtsL, imagePtsR,
+                              m_M1, m_D1, m_M2, m_D2,
+                              m_imageSize,
+                              m_R, m_T, m_E, m_F,
+                              flags,
+                              termCrit );
+}
+
+
+static double rmsDistance( const std::vector<cv::Point2f>& a,
+                           const cv::Point2f* b )
+{
+  double sum = 0.0;
+  for( size_t i = 0; i < a.size(); ++i )
   {
-    std::cout << "File <extrinsics>.yml could not be opened.\n";
-    exit(2);
+    const cv::Point2f d = a[i] - b[i];
+    sum += d.dot( d );
   }
+
+  return a.empty() ? 0.0 : std::sqrt( sum/a.size() );
 }
 
+
 //
-// Detect and extract chessboard corners
+// RMS reprojection error of every kept view, through the current solution.
+// The board pose is solved for in the left view and carried to the right one
+// with R and T, so the right error also shows how well the pair agrees.
 //
-void DuoCalibrator::detectChessboardPoints( const cv::Mat& left,
-                                            const cv::Mat& right,
-                                            std::vector<cv::Point2f>& leftPtsOut,
-                                            std::vector<cv::Point2f>& rightPtsOut )
+void DuoCalibrator::computeViewErrors()
 {
-  static bool initObjectPts = true;
+  cv::Mat rvecLR;
+  cv::Rodrigues( m_R, rvecLR );
+
+  const cv::Mat board = m_views.getBoardMat();
 
-  if( initObjectPts )
+  cv::parallel_for_( cv::Range( 0, int( m_views.size() ) ),
+                     [&]( const cv::Range& range )
   {
-    //
-    // 3D scene points:
-    // Initialize the chessboard corners in the chessboard reference frame.
-    // The corners are at location (x,y,z) = (i,j,0)
-    //
-    for( int i = 0; i < m_boardSize.height; ++i )
+    std::vector<cv::Point2f> projected;
+
+    cv::Mat rvec, tvec, rvecR, tvecR;
+
+    for( int i = range.start; i < range.end; ++i )
     {
-      for( int j = 0; j < m_boardSize.width; ++j )
-      {
-        m_lastObjectPts.push_back( cv::Point3f( i*m_squareLength,
-                                                j*m_squareLength,
-                                                0.0f ) );
-      }
+      cv::solvePnP( board, m_views.getLeftMat( i ), m_M1, m_D1, rvec, tvec );
+
+      cv::projectPoints( board, rvec, tvec, m_M1, m_D1, projected );
+      m_viewErrors[i].left = rmsDistance( projected, m_views.left( i ) );
+
+      cv::composeRT( rvec, tvec, rvecLR, m_T, rvecR, tvecR );
+
+      cv::projectPoints( board, rvecR, tvecR, m_M2, m_D2, projected );
+      m_viewErrors[i].right = rmsDistance( projected, m_views.right( i ) );
     }
+  } );
+}
 
-    initObjectPts = false;
-  }
 
-  const bool foundL = cv::findChessboardCorners( left,
-                                                 m_boardSize,
-                                                 leftPtsOut );
+static double median( std::vector<double> values )
+{
+  std::nth_element( values.begin(),
+                    values.begin() + values.size()/2,
+                    values.end() );
+
+  return values[values.size()/2];
+}
+
+
+//
+// Drop the views whose worse eye is above median + PRUNE_MADS robust
+// standard deviations (from the median absolute deviation) of the errors,
+// but never below MIN_PRUNE_ERROR_PX, and never below MIN_VIEWS views.
+// Returns the number of views dropped.
+//
+size_t DuoCalibrator::pruneViews()
+{
+  const size_t n = m_viewErrors.size();
+
+  std::vector<double> errors( n );
+  for( size_t i = 0; i < n; ++i )
+    errors[i] = std::max( m_viewErrors[i].left, m_viewErrors[i].right );
+
+  const double med = median( errors );
+
+  std::vector<double> deviations( n );
+  for( size_t i = 0; i < n; ++i )
+    deviations[i] = std::abs( errors[i] - med );
 
-  const bool foundR = cv::findChessboardCorners( right,
-                                                 m_boardSize,
-                                                 rightPtsOut );
+  m_pruneThreshold = std::max( med + PRUNE_MADS*1.4826*median( deviations ),
+                               MIN_PRUNE_ERROR_PX );
 
   //
-  // Get sub-pixel accuracy on the corners
+  // Worst first, so that MIN_VIEWS keeps the best ones
   //
-  if( foundL && foundR )
+  std::vector<size_t> order( n );
+  for( size_t i = 0; i < n; ++i ) order[i] = i;
+
+  std::sort( order.begin(), order.end(),
+             [&]( size_t a, size_t b ) { return errors[a] > errors[b]; } );
+
+  std::vector<char> drop( n, 0 );
+  size_t numDropped = 0;
+
+  for( const size_t i : order )
   {
-    static const auto termCrit =
-        cv::TermCriteria( cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS,
-                          20,    // max number of iterations
-                          0.1 ); // min accuracy
+    if( errors[i] <= m_pruneThreshold || n - numDropped <= MIN_VIEWS ) break;
 
-    cv::cornerSubPix( left,
-                      leftPtsOut,
-                      cv::Size(  5,  5 ),
-                      cv::Size( -1, -1 ),
-                      termCrit );
+    drop[i] = 1;
+    ++numDropped;
+  }
 
-    cv::cornerSubPix( right,
-                      rightPtsOut,
-                      cv::Size(  5,  5 ),
-                      cv::Size( -1, -1 ),
-                      termCrit );
+  if( numDropped == 0 ) return 0;
 
-    //
-    // Board is good, save it
-    //
-    m_lastImagePtsL.assign( leftPtsOut.begin(),  leftPtsOut.end()  );
-    m_lastImagePtsR.assign( rightPtsOut.begin(), rightPtsOut.end() );
+  std::vector<char> keep( n, 0 );
+
+  size_t kept = 0;
+  for( size_t i = 0; i < n; ++i )
+  {
+    if( drop[i] )
+    {
+      m_prunedViews.push_back( m_viewErrors[i] );
+      continue;
+    }
+
+    keep[i]            = 1;
+    m_viewErrors[kept] = m_viewErrors[i];
+    ++kept;
   }
+
+  m_views.keep( keep );
+  m_viewErrors.resize( kept );
+
+  return numDropped;
 }
 
 
-void DuoCalibrator::keepMostRecent()
+void DuoCalibrator::setInitialGuess( const cv::Mat& M1,
+                                     const cv::Mat& D1,
+                                     const cv::Mat& M2,
+                                     const cv::Mat& D2 )
 {
-  if( m_lastImagePtsL.size() == m_boardSize.area() &&
-      m_lastImagePtsR.size() == m_boardSize.area() )
-  {
-    // 2D image points
-    m_imagePtsL.push_back( m_lastImagePtsL );
-    m_imagePtsR.push_back( m_lastImagePtsR );
+  M1.copyTo( m_M1 );
+  D1.copyTo( m_D1 );
+  M2.copyTo( m_M2 );
+  D2.copyTo( m_D2 );
 
-    // 3D scene points
-    m_objectPts.push_back( m_lastObjectPts );
-  }
+  m_hasInitialGuess = !m_M1.empty() && !m_M2.empty();
+}
+
+
+//
+// Maps that came from the cache are read-only views of it: drop them, and
+// then the cache, before the maps are computed or loaded again
+//
+void DuoCalibrator::releaseRectifyMaps()
+{
+  m_mapL1.release();
+  m_mapL2.release();
+  m_mapR1.release();
+  m_mapR2.release();
+  m_mapDispL1.release();
+  m_mapDispL2.release();
+  m_mapDispR1.release();
+  m_mapDispR2.release();
+
+  m_mapCache.close();
+}
+
+
+//
+// Undistort/rectify maps for display and for the disparity path, from the
+// current intrinsics and rectification
+//
+void DuoCalibrator::initRectifyMaps()
+{
+  releaseRectifyMaps();
+
+  cv::initUndistortRectifyMap( m_M1, m_D1, m_R1, m_P1,
+                               m_imageSize, CV_16SC2,
+                               m_mapL1, m_mapL2 );
+
+  cv::initUndistortRectifyMap( m_M2, m_D2, m_R2, m_P2,
+                               m_imageSize, CV_16SC2,
+                               m_mapR1, m_mapR2 );
+
+  initDisparityRectification();
+
+  cv::initUndistortRectifyMap( m_M1, m_D1, m_R1, m_P1Disp,
+                               m_disparitySize, CV_16SC2,
+                               m_mapDispL1, m_mapDispL2 );
+
+  cv::initUndistortRectifyMap( m_M2, m_D2, m_R2, m_P2Disp,
+                               m_disparitySize, CV_16SC2,
+                               m_mapDispR1, m_mapDispR2 );
 }
 
 
-const cv::Mat& DuoCalibrator::undistortAndRectifyLeft( const cv::Mat& left ) const
+//
+// Rectification for the disparity path, which goes from the raw image
+// straight to m_disparitySize: the rectified projections are scaled to the
+// smaller image, which scales the disparity too. In Q that cancels out
+// except for its last column. The offset keeps pixel centers where
+// cv::resize would put them.
+//
+void DuoCalibrator::initDisparityRectification()
 {
-  static cv::Mat newLeft;
-  cv::remap( left, newLeft, m_mapL1, m_mapL2, cv::INTER_LINEAR );
-  return newLeft;
+  const double s = double( m_disparitySize.height )/m_imageSize.height;
+  const double c = 0.5*( s - 1.0 );
+
+  m_P1Disp = m_P1.clone();
+  m_P2Disp = m_P2.clone();
+  transformProjection( m_P1Disp, s, s, c, c );
+  transformProjection( m_P2Disp, s, s, c, c );
+
+  m_QDisp = m_Q.clone();
+  transformDisparityToDepth( m_QDisp, s, s, c, c );
+
+  applyDisparityRange( m_disparityContext.engine );
 }
 
 
-const cv::Mat& DuoCalibrator::undistortAndRectifyRight( const cv::Mat& right ) const
+//
+// Disparity range for the depth range, from the rectified focal length in
+// disparity pixels and the baseline. A no-op when the engine already has
+// it, so it is applied on every computeDisparity().
+//
+void DuoCalibrator::applyDisparityRange( DuoDisparity& engine ) const
 {
-  static cv::Mat newRight;
-  cv::remap( right, newRight, m_mapR1, m_mapR2, cv::INTER_LINEAR );
-  return newRight;
+  if( m_P1Disp.empty() || m_T.empty() ) return;
+
+  const double baseline = cv::norm( m_T );
+  const double minDepth = ( m_minDepth > 0.0 )
+                            ? m_minDepth
+                            : DuoDisparity::MIN_DEPTH_BASELINES*baseline;
+
+  engine.setDepthRange( m_P1Disp.at<double>( 0, 0 ), baseline,
+                        minDepth, m_maxDepth );
 }
 
 
-const cv::Mat& DuoCalibrator::getDisparity( const cv::Mat& left,
-                                            const cv::Mat& right ) const
+void DuoCalibrator::setDisparityScale( const double scale )
 {
-  static cv::Mat leftQVGA;
-  static cv::Mat rightQVGA;
+  m_disparityScale = scale;
+
+  const cv::Size size = disparitySizeFor( m_imageSize, scale );
 
-  cv::resize( left,  leftQVGA,  QVGA );
-  cv::resize( right, rightQVGA, QVGA );
+  if( size == m_disparitySize ) return;
 
-  static auto sgbm =
-      cv::StereoSGBM::create(   0,   //mindisp
-                               48,   //numdisp
-                                5,   //SADWindow
-                               25,   //P1
-                               50,   //P2
-                                1,   //dispdiffmax
-                               63,   //prefiltercap
-                               40,   //uniqueness
-                              200,   //speckle window size
-                                2,   //speckle range
-                                cv::StereoSGBM::MODE_SGBM_3WAY );
+  m_disparitySize = size;
 
-  static cv::Mat disp;
-  sgbm->compute( leftQVGA, rightQVGA, disp );
+  if( !m_P1.empty() && !m_P2.empty() && !m_Q.empty() )
+    initRectifyMaps();
+}
+
+
+void DuoCalibrator::setDepthRange( const double minDepth, const double maxDepth )
+{
+  m_minDepth = minDepth;
+  m_maxDepth = maxDepth;
 
-  static cv::Mat disp8;
-  disp.convertTo( disp8, CV_8U, 255.0/(48*16) );
+  applyDisparityRange( m_disparityContext.engine );
+}
 
-  static cv::Mat dispColor;
-  cv::applyColorMap( disp8, dispColor, cv::COLORMAP_JET );
 
-  return dispColor;
+//
+// Move the intrinsics and rectification from the pixels of one resolution
+// to another's. R, T, the distortion and R1/R2 are unchanged; E is too,
+// while F, being in pixels, is recomputed.
+//
+bool DuoCalibrator::convertCalibration( const cv::Size& from, const cv::Size& to )
+{
+  double sx, sy, tx, ty;
+
+  if( !pixelTransform( from, to, sx, sy, tx, ty ) )
+  {
+    *m_log << "Cannot convert a calibration from " << from.width << "x"
+              << from.height << " to " << to.width << "x" << to.height
+              << ", it does not fit on the sensor\n";
+    return false;
+  }
+
+  cv::Mat* cameras[] = { &m_M1, &m_M2, &m_P1, &m_P2 };
+
+  for( cv::Mat* P : cameras )
+  {
+    if( !P->empty() ) transformProjection( *P, sx, sy, tx, ty );
+  }
+
+  if( !m_Q.empty() ) transformDisparityToDepth( m_Q, sx, sy, tx, ty );
+
+  if( !m_F.empty() )
+  {
+    const cv::Mat H = ( cv::Mat_<double>( 3, 3 ) << sx,  0, tx,
+                                                    0,  sy, ty,
+                                                    0,   0,  1 );
+    const cv::Mat Hinv = H.inv();
+
+    cv::Mat F = Hinv.t()*m_F*Hinv;
+    m_F = F;
+  }
+
+  return true;
+}
+
+
+bool DuoCalibrator::setImageSize( const cv::Size& imageSize )
+{
+  if( imageSize == m_imageSize ) return true;
+
+  double sx, sy, tx, ty;
+
+  if( !pixelTransform( m_imageSize, imageSize, sx, sy, tx, ty ) ||
+      !convertCalibration( m_imageSize, imageSize ) )
+    return false;
+
+  m_views.transform( sx, sy, tx, ty );
+
+  transformPoints( m_lastImagePtsL, sx, sy, tx, ty );
+  transformPoints( m_lastImagePtsR, sx, sy, tx, ty );
+
+  m_imageSize     = imageSize;
+  m_disparitySize = disparitySizeFor( imageSize, m_disparityScale );
+  m_hasTrack      = false;
+
+  //
+  // A session's corners are in the pixels of its header
+  //
+  if( m_session.isOpen() )
+  {
+    const std::string path = m_session.getPath();
+    m_session.open( path, getSessionInfo(), m_views );
+  }
+
+  if( !m_P1.empty() && !m_P2.empty() && !m_Q.empty() )
+    initRectifyMaps();
+  else
+    releaseRectifyMaps();
+
+  return true;
+}
+
+
+static cv::Mat viewErrorTable( const std::vector<DuoViewError>& views )
+{
+  cv::Mat table( int( views.size() ), 3, CV_64F );
+
+  for( size_t i = 0; i < views.size(); ++i )
+  {
+    table.at<double>( int( i ), 0 ) = views[i].id;
+    table.at<double>( int( i ), 1 ) = views[i].left;
+    table.at<double>( int( i ), 2 ) = views[i].right;
+  }
+
+  return table;
+}
+
+
+void DuoCalibrator::calibrate()
+{
+  const auto calibDuoRoot = expandEnvironmentVariables( "${CALIBDUO_ROOT}/" );
+
+  if( !calibrate( calibDuoRoot + "cameraFiles/" ) )
+    exit(1);
+}
+
+
+bool DuoCalibrator::calibrate( const std::string& outputDir )
+{
+  const double errorX = solve();
+
+  if( errorX < 0.0 )
+  {
+    *m_log << "Too few frames, unable to continue with calibration\n";
+    return false;
+  }
+
+  m_calibDateTime = dateTime;
+
+  if( m_detectionStats.numFrames > 0 )
+  {
+    *m_log << "Mean Detection Time:       "
+              << m_detectionStats.getMeanMs() << " ms over "
+              << m_detectionStats.numFrames << " frames ("
+              << m_detectionStats.numBoardsFound << " with a board)\n";
+  }
+
+  cv::FileStorage fsI( outputDir + calibrationFileName( "intrinsics", m_imageSize ),
+                       cv::FileStorage::WRITE );
+
+  if( fsI.isOpened() )
+  {
+    fsI << "DateTime"          << dateTime
+        << "Serial"            << m_serial
+        << "BoardWidth"        << m_boardSize.width
+        << "BoardHeight"       << m_boardSize.height
+        << "SquareLength"      << m_squareLength
+        << "ImageWidth"        << m_imageSize.width
+        << "ImageHeight"       << m_imageSize.height
+        << "NumImagePairs"     << (int) m_views.size()
+        << "ReprojectionError" << errorX;
+
+    fsI << "Pattern"
+        << ( m_pattern == PATTERN_CHESSBOARD ? "chessboard"
+                                             : "asymmetric_circles" )
+        << "DetectionMeanMs"   << m_detectionStats.getMeanMs()
+        << "DetectionRate"     << m_detectionStats.getRate();
+
+    fsI << "M1" << m_M1
+        << "D1" << m_D1
+        << "M2" << m_M2
+        << "D2" << m_D2;
+
+    //
+    // Rows of id, left and right RMS error in px, id being the order in which
+    // the image set was kept
+    //
+    fsI << "PruneThreshold" << m_pruneThreshold
+        << "ViewErrors"     << viewErrorTable( m_viewErrors );
+
+    if( !m_prunedViews.empty() )
+      fsI << "PrunedViews" << viewErrorTable( m_prunedViews );
+
+    fsI.release();
+  }
+  else
+  {
+    *m_log << "File <intrinsics>.yml could not be opened.\n";
+    return false;
+  }
+
+  cv::FileStorage fsX( outputDir + calibrationFileName( "extrinsics", m_imageSize ),
+                       cv::FileStorage::WRITE );
+
+  if( fsX.isOpened() )
+  {
+    fsX << "DateTime"          << dateTime
+        << "Serial"            << m_serial
+        << "BoardWidth"        << m_boardSize.width
+        << "BoardHeight"       << m_boardSize.height
+        << "SquareLength"      << m_squareLength
+        << "ImageWidth"        << m_imageSize.width
+        << "ImageHeight"       << m_imageSize.height
+        << "NumImagePairs"     << (int) m_views.size()
+        << "ReprojectionError" << errorX;
+
+    fsX << "R"  << m_R
+        << "T"  << m_T
+        << "R1" << m_R1
+        << "R2" << m_R2
+        << "P1" << m_P1
+        << "P2" << m_P2
+        << "Q"  << m_Q;
+
+    fsX << "E" << m_E
+        << "F" << m_F;
+
+    fsX << "DisparityWidth"  << m_disparitySize.width
+        << "DisparityHeight" << m_disparitySize.height
+        << "P1Disparity"     << m_P1Disp
+        << "P2Disparity"     << m_P2Disp
+        << "QDisparity"      << m_QDisp;
+
+    fsX.release();
+  }
+  else
+  {
+    *m_log << "File <extrinsics>.yml could not be opened.\n";
+    return false;
+  }
+
+  const cv::Mat maps[DUO_NUM_MAPS] =
+  {
+    m_mapL1, m_mapL2, m_mapR1, m_mapR2,
+    m_mapDispL1, m_mapDispL2, m_mapDispR1, m_mapDispR2
+  };
+
+  DuoMapCache::write( DuoMapCache::makePath( outputDir, m_serial,
+                                             m_calibDateTime, m_imageSize ),
+                      m_serial, m_calibDateTime, maps );
+
+  return true;
+}
+
+
+bool DuoCalibrator::load( const std::string& intrinsicsPath,
+                          const std::string& extrinsicsPath )
+{
+  const int64 start = cv::getTickCount();
+
+  cv::FileStorage fsI( intrinsicsPath, cv::FileStorage::READ );
+  cv::FileStorage fsX( extrinsicsPath, cv::FileStorage::READ );
+
+  if( !fsI.isOpened() || !fsX.isOpened() )
+  {
+    *m_log << "Could not open " << intrinsicsPath << " and "
+              << extrinsicsPath << "\n";
+    return false;
+  }
+
+  const cv::Size size( (int) fsI["ImageWidth"], (int) fsI["ImageHeight"] );
+
+  const std::string dateTimeI = (std::string) fsI["DateTime"];
+  const std::string dateTimeX = (std::string) fsX["DateTime"];
+
+  if( dateTimeI != dateTimeX )
+  {
+    *m_log << "Intrinsics and extrinsics are from different calibrations\n";
+    return false;
+  }
+
+  //
+  // A file that predates the Serial entry is keyed as "unknown"
+  //
+  const std::string serial = (std::string) fsI["Serial"];
+
+  if( !m_serial.empty() && !serial.empty() && serial != m_serial )
+  {
+    *m_log << "Warning: calibration is for DUO " << serial
+              << ", this is DUO " << m_serial << "\n";
+  }
+
+  m_serial            = serial;
+  m_calibDateTime     = dateTimeI;
+  m_reprojectionError = (double) fsI["ReprojectionError"];
+
+  fsI["M1"] >> m_M1;
+  fsI["D1"] >> m_D1;
+  fsI["M2"] >> m_M2;
+  fsI["D2"] >> m_D2;
+
+  fsX["R"]  >> m_R;
+  fsX["T"]  >> m_T;
+  fsX["R1"] >> m_R1;
+  fsX["R2"] >> m_R2;
+  fsX["P1"] >> m_P1;
+  fsX["P2"] >> m_P2;
+  fsX["Q"]  >> m_Q;
+  fsX["E"]  >> m_E;
+  fsX["F"]  >> m_F;
+
+  if( m_M1.empty() || m_D1.empty() || m_M2.empty() || m_D2.empty() ||
+      m_R1.empty() || m_R2.empty() || m_P1.empty() || m_P2.empty() ||
+      m_Q.empty() )
+  {
+    *m_log << "Calibration files are incomplete\n";
+    return false;
+  }
+
+  //
+  // E.g. a full resolution calibration for binned QVGA streaming
+  //
+  if( size != m_imageSize )
+  {
+    if( !convertCalibration( size, m_imageSize ) ) return false;
+
+    *m_log << "Converted calibration from " << size.width << "x"
+              << size.height << " to " << m_imageSize.width << "x"
+              << m_imageSize.height << "\n";
+  }
+
+  //
+  // The cache sits next to the .yml files, where calibrate() wrote it
+  //
+  const size_t slash = intrinsicsPath.find_last_of( "/\\" );
+
+  const std::string cacheDir =
+      ( slash == std::string::npos ) ? std::string()
+                                     : intrinsicsPath.substr( 0, slash + 1 );
+
+  const std::string cachePath =
+      DuoMapCache::makePath( cacheDir, m_serial,
+                             m_calibDateTime, m_imageSize );
+
+  initDisparityRectification();
+
+  releaseRectifyMaps();
+
+  bool cached = false;
+
+  if( m_mapCache.open( cachePath, m_serial, m_calibDateTime,
+                       m_imageSize, m_disparitySize ) )
+  {
+    m_mapL1     = m_mapCache.getMap( DUO_MAP_L1 );
+    m_mapL2     = m_mapCache.getMap( DUO_MAP_L2 );
+    m_mapR1     = m_mapCache.getMap( DUO_MAP_R1 );
+    m_mapR2     = m_mapCache.getMap( DUO_MAP_R2 );
+    m_mapDispL1 = m_mapCache.getMap( DUO_MAP_DISP_L1 );
+    m_mapDispL2 = m_mapCache.getMap( DUO_MAP_DISP_L2 );
+    m_mapDispR1 = m_mapCache.getMap( DUO_MAP_DISP_R1 );
+    m_mapDispR2 = m_mapCache.getMap( DUO_MAP_DISP_R2 );
+
+    cached = true;
+  }
+  else
+  {
+    initRectifyMaps();
+
+    const cv::Mat maps[DUO_NUM_MAPS] =
+    {
+      m_mapL1, m_mapL2, m_mapR1, m_mapR2,
+      m_mapDispL1, m_mapDispL2, m_mapDispR1, m_mapDispR2
+    };
+
+    DuoMapCache::write( cachePath, m_serial, m_calibDateTime, maps );
+  }
+
+  *m_log << "Loaded calibration " << m_calibDateTime << " in "
+            << TicksToMs( cv::getTickCount() - start ) << " ms"
+            << ( cached ? " (maps from cache)\n" : "\n" );
+
+  return true;
+}
+
+//
+// Detect and extract chessboard corners
+//
+void DuoCalibrator::detectChessboardPoints( const cv::Mat& left,
+                                            const cv::Mat& right,
+                                            std::vector<cv::Point2f>& leftPtsOut,
+                                            std::vector<cv::Point2f>& rightPtsOut )
+{
+  //
+  // Left and right views are searched concurrently on OpenCV's thread pool.
+  // As soon as one view fails the pair is useless, so the other view skips
+  // whatever work it has not started yet.
+  //
+  const cv::Mat*            images[2] = { &left, &right };
+  std::vector<cv::Point2f>* points[2] = { &leftPtsOut, &rightPtsOut };
+
+  DuoDetectionTimings timings;
+  std::atomic<bool>   failed( false );
+
+  const int64 start = cv::getTickCount();
+
+  cv::parallel_for_( cv::Range( 0, 2 ), [&]( const cv::Range& range )
+  {
+    for( int i = range.start; i < range.end; ++i )
+    {
+      if( failed ) continue;
+
+      const int64 t = cv::getTickCount();
+
+      const bool found = findChessboard( i, *images[i], *points[i],
+                                         timings.tracked[i] );
+
+      timings.findMs[i] = TicksToMs( cv::getTickCount() - t );
+
+      if( !found ) failed = true;
+    }
+  }, 2 );
+
+  if( !failed )
+  {
+    //
+    // Get sub-pixel accuracy on the corners of both views in one batch,
+    // which is timed as a whole: its groups mix the two views
+    //
+    const int64 t = cv::getTickCount();
+
+    {
+      DUO_PROFILE_SCOPE( DUO_STAGE_SUBPIX );
+
+      m_cornerRefiner.refine( images, points, 2 );
+    }
+
+    timings.refineMs = TicksToMs( cv::getTickCount() - t );
+  }
+
+  timings.totalMs = TicksToMs( cv::getTickCount() - start );
+
+  m_lastTimings = timings;
+
+  m_hasTrack = m_tracking && !failed;
+
+  if( !failed )
+  {
+    //
+    // Board is good, save it
+    //
+    m_lastImagePtsL.assign( leftPtsOut.begin(),  leftPtsOut.end()  );
+    m_lastImagePtsR.assign( rightPtsOut.begin(), rightPtsOut.end() );
+  }
+}
+
+
+//
+// Detect and extract asymmetric circle grid centers
+//
+void DuoCalibrator::detectCircleGridPoints( const cv::Mat& left,
+                                            const cv::Mat& right,
+                                            std::vector<cv::Point2f>& leftPtsOut,
+                                            std::vector<cv::Point2f>& rightPtsOut )
+{
+  //
+  // Blob centroids are already sub-pixel accurate, so there is no refinement
+  // step; both views are still searched concurrently
+  //
+  const cv::Mat*            images[2] = { &left, &right };
+  std::vector<cv::Point2f>* points[2] = { &leftPtsOut, &rightPtsOut };
+
+  DuoDetectionTimings timings;
+  std::atomic<bool>   failed( false );
+
+  const int64 start = cv::getTickCount();
+
+  cv::parallel_for_( cv::Range( 0, 2 ), [&]( const cv::Range& range )
+  {
+    for( int i = range.start; i < range.end; ++i )
+    {
+      if( failed ) continue;
+
+      const int64 t = cv::getTickCount();
+
+      const bool found = cv::findCirclesGrid( *images[i],
+                                              m_boardSize,
+                                              *points[i],
+                                              cv::CALIB_CB_ASYMMETRIC_GRID,
+                                              m_blobDetector[i] );
+
+      timings.findMs[i] = TicksToMs( cv::getTickCount() - t );
+
+      if( !found )
+      {
+        failed = true;
+        points[i]->clear();
+      }
+    }
+  }, 2 );
+
+  timings.totalMs = TicksToMs( cv::getTickCount() - start );
+
+  m_lastTimings = timings;
+
+  if( !failed )
+  {
+    m_lastImagePtsL.assign( leftPtsOut.begin(),  leftPtsOut.end()  );
+    m_lastImagePtsR.assign( rightPtsOut.begin(), rightPtsOut.end() );
+  }
+}
+
+
+//
+// 3D scene points:
+// Initialize the chessboard corners in the chessboard reference frame.
+// The corners are at location (x,y,z) = (i,j,0)
+//
+void DuoCalibrator::initChessboardObjectPts()
+{
+  std::vector<cv::Point3f> objectPts;
+
+  for( int i = 0; i < m_boardSize.height; ++i )
+  {
+    for( int j = 0; j < m_boardSize.width; ++j )
+    {
+      objectPts.push_back( cv::Point3f( i*m_squareLength,
+                                        j*m_squareLength,
+                                        0.0f ) );
+    }
+  }
+
+  m_views.setBoard( objectPts );
+}
+
+
+//
+// 3D scene points:
+// Initialize the circle centers in the grid reference frame, in the order
+// findCirclesGrid returns them for CALIB_CB_ASYMMETRIC_GRID. Every other row
+// is shifted by one spacing.
+//
+void DuoCalibrator::initCircleGridObjectPts()
+{
+  std::vector<cv::Point3f> objectPts;
+
+  for( int i = 0; i < m_boardSize.height; ++i )
+  {
+    for( int j = 0; j < m_boardSize.width; ++j )
+    {
+      objectPts.push_back( cv::Point3f( ( 2*j + i%2 )*m_squareLength,
+                                        i*m_squareLength,
+                                        0.0f ) );
+    }
+  }
+
+  m_views.setBoard( objectPts );
+}
+
+
+//
+// Region of interest for the board in the next frame: the bounding box of
+// the previous corners, grown by two squares to take in the outer row of
+// squares plus inter-frame motion
+//
+static cv::Rect predictBoardRegion( const std::vector<cv::Point2f>& lastPts,
+                                    const cv::Size& boardSize,
+                                    const cv::Size& imageSize )
+{
+  const cv::Rect box = cv::boundingRect( lastPts );
+
+  const double cells  = ( boardSize.width - 1 )*( boardSize.height - 1 );
+  const double square = std::sqrt( box.area()/std::max( cells, 1.0 ) );
+  const int    margin = cvCeil( 2.0*square ) + 8;
+
+  const cv::Rect grown( box.x - margin,
+                        box.y - margin,
+                        box.width  + 2*margin,
+                        box.height + 2*margin );
+
+  return grown & cv::Rect( 0, 0, imageSize.width, imageSize.height );
+}
+
+
+//
+// Find the chessboard corners in one view (0 = left, 1 = right) to pixel
+// accuracy; sub-pixel refinement at full resolution is left to the caller.
+// With a track from the previous frame only the predicted region is searched,
+// so the cost follows the size of the board rather than of the image.
+//
+bool DuoCalibrator::findChessboard( const int view,
+                                    const cv::Mat& image,
+                                    std::vector<cv::Point2f>& ptsOut,
+                                    bool& trackedOut )
+{
+  trackedOut = false;
+
+  if( m_hasTrack )
+  {
+    const auto& lastPts = ( view == 0 ) ? m_lastImagePtsL : m_lastImagePtsR;
+
+    const cv::Rect roi =
+        predictBoardRegion( lastPts, m_boardSize, image.size() );
+
+    //
+    // Not worth it when the board fills most of the frame
+    //
+    if( roi.area() < 0.6*image.size().area() &&
+        searchChessboard( view, image( roi ), ptsOut ) )
+    {
+      for( auto& p : ptsOut )
+      {
+        p.x += roi.x;
+        p.y += roi.y;
+      }
+
+      trackedOut = true;
+      return true;
+    }
+  }
+
+  return searchChessboard( view, image, ptsOut );
+}
+
+
+//
+// Search the whole of the given image for the board
+//
+bool DuoCalibrator::searchChessboard( const int view,
+                                      const cv::Mat& image,
+                                      std::vector<cv::Point2f>& ptsOut )
+{
+  if( m_detectionMode == DETECT_FULL_RES )
+    return cv::findChessboardCorners( image, m_boardSize, ptsOut );
+
+  //
+  // Coarse search on the smallest pyramid level. CALIB_CB_FAST_CHECK rejects
+  // frames without a board in a few ms.
+  //
+  std::vector<cv::Mat>& pyramid = m_pyramid[view];
+  pyramid.resize( m_pyramidLevels );
+
+  const cv::Mat* src = &image;
+  for( int l = 0; l < m_pyramidLevels; ++l )
+  {
+    cv::pyrDown( *src, pyramid[l] );
+    src = &pyramid[l];
+  }
+
+  const bool found =
+      cv::findChessboardCorners( *src,
+                                 m_boardSize,
+                                 ptsOut,
+                                 cv::CALIB_CB_ADAPTIVE_THRESH |
+                                 cv::CALIB_CB_NORMALIZE_IMAGE |
+                                 cv::CALIB_CB_FAST_CHECK );
+  if( !found ) return false;
+
+  //
+  // Walk back up the pyramid. pyrDown centers pixel i of a level on pixel 2i
+  // of the level below it, so corners map up by a plain factor of 2. The
+  // intermediate levels are refined with a small window so the error stays
+  // within the full resolution cornerSubPix window.
+  //
+  for( int l = m_pyramidLevels - 1; l >= 0; --l )
+  {
+    for( auto& p : ptsOut )
+    {
+      p.x *= 2.0f;
+      p.y *= 2.0f;
+    }
+
+    if( l > 0 )
+    {
+      m_pyramidRefiner.refine( pyramid[l-1], ptsOut );
+    }
+  }
+
+  return true;
+}
+
+
+void DuoCalibrator::setDetectionMode( DetectionMode mode, int pyramidLevels )
+{
+  m_detectionMode = mode;
+  m_pyramidLevels = std::max( 1, std::min( pyramidLevels, 3 ) );
+}
+
+
+void DuoCalibrator::keepMostRecent()
+{
+  keepImageSet( m_lastImagePtsL, m_lastImagePtsR );
+}
+
+
+void DuoCalibrator::keepImageSet( const std::vector<cv::Point2f>& leftPts,
+                                  const std::vector<cv::Point2f>& rightPts )
+{
+  if( leftPts.size()  == m_views.getPointsPerView() &&
+      rightPts.size() == m_views.getPointsPerView() &&
+      !leftPts.empty() )
+    addImageSet( leftPts.data(), rightPts.data() );
+}
+
+
+void DuoCalibrator::addImageSet( const cv::Point2f* leftPts,
+                                 const cv::Point2f* rightPts )
+{
+  m_views.add( leftPts, rightPts );
+
+  DuoViewError view;
+  view.id = m_nextViewId++;
+  m_viewErrors.push_back( view );
+
+  if( m_session.isOpen() )
+    m_session.append( leftPts, rightPts );
+}
+
+
+DuoSessionInfo DuoCalibrator::getSessionInfo() const
+{
+  DuoSessionInfo info;
+  info.pattern      = m_pattern;
+  info.boardSize    = m_boardSize;
+  info.squareLength = m_squareLength;
+  info.imageSize    = m_imageSize;
+
+  return info;
+}
+
+
+bool DuoCalibrator::openSession( const std::string& path )
+{
+  m_session.close();
+
+  //
+  // Resume: whatever the file holds is kept, then the file is rewritten
+  // with all kept image sets, which also drops a view a crash cut short
+  //
+  FILE* file = fopen( path.c_str(), "rb" );
+
+  if( file != nullptr )
+  {
+    fclose( file );
+
+    const int numResumed = mergeSession( path );
+    if( numResumed < 0 ) return false;
+
+    *m_log << "Resumed " << numResumed << " image sets from " << path << "\n";
+  }
+
+  return m_session.open( path, getSessionInfo(), m_views );
+}
+
+
+int DuoCalibrator::mergeSession( const std::string& path )
+{
+  DuoSessionReader reader;
+  if( !reader.open( path ) ) return -1;
+
+  const DuoSessionInfo& info = reader.getInfo();
+
+  if( info.pattern      != m_pattern   ||
+      info.boardSize    != m_boardSize ||
+      info.squareLength != m_squareLength )
+  {
+    *m_log << path << " is a session of another board\n";
+    return -1;
+  }
+
+  DuoViewStore views;
+  reader.read( views );
+
+  if( info.imageSize != m_imageSize )
+  {
+    double sx, sy, tx, ty;
+
+    if( !pixelTransform( info.imageSize, m_imageSize, sx, sy, tx, ty ) )
+    {
+      *m_log << path << " is of another camera resolution\n";
+      return -1;
+    }
+
+    views.transform( sx, sy, tx, ty );
+  }
+
+  m_views.reserve( m_views.size() + views.size() );
+
+  for( size_t i = 0; i < views.size(); ++i )
+    addImageSet( views.left( i ), views.right( i ) );
+
+  return int( views.size() );
+}
+
+
+void DuoCalibrator::undistortAndRectifyLeft( const cv::Mat& left,
+                                             cv::Mat& leftOut ) const
+{
+  cv::remap( left, leftOut, m_mapL1, m_mapL2, cv::INTER_LINEAR );
+}
+
+
+void DuoCalibrator::undistortAndRectifyRight( const cv::Mat& right,
+                                              cv::Mat& rightOut ) const
+{
+  cv::remap( right, rightOut, m_mapR1, m_mapR2, cv::INTER_LINEAR );
+}
+
+
+//
+// Rows of a remap per task of remapBoth(); fewer and the tasks cost more
+// than they save
+//
+static const int MIN_REMAP_ROWS = 16;
+
+//
+// Remap of two views at once. The outputs are created up front, then each
+// view is split into stripes of rows remapped independently, so both views
+// share the cores instead of taking turns. A map's rows give the source
+// positions of the same rows of the output, which makes any stripe of rows
+// a remap of its own.
+//
+static void remapBoth( const cv::Mat& left,
+                       const cv::Mat& right,
+                       const cv::Mat& mapL1, const cv::Mat& mapL2,
+                       const cv::Mat& mapR1, const cv::Mat& mapR2,
+                       cv::Mat& leftOut,
+                       cv::Mat& rightOut )
+{
+  leftOut.create( mapL1.size(), left.type() );
+  rightOut.create( mapR1.size(), right.type() );
+
+  const int rows    = std::min( leftOut.rows, rightOut.rows );
+  const int stripes = std::max( 1, std::min( ( cv::getNumThreads() + 1 )/2,
+                                             rows/MIN_REMAP_ROWS ) );
+
+  const cv::Mat* sources[2] = { &left,  &right };
+  const cv::Mat* maps1[2]   = { &mapL1, &mapR1 };
+  const cv::Mat* maps2[2]   = { &mapL2, &mapR2 };
+  cv::Mat*       outputs[2] = { &leftOut, &rightOut };
+
+  cv::parallel_for_( cv::Range( 0, 2*stripes ), [&]( const cv::Range& range )
+  {
+    for( int i = range.start; i < range.end; ++i )
+    {
+      const int view   = i/stripes;
+      const int stripe = i%stripes;
+
+      const int height = outputs[view]->rows;
+      const cv::Range stripeRows( height*stripe/stripes,
+                                  height*( stripe + 1 )/stripes );
+
+      cv::Mat dst = outputs[view]->rowRange( stripeRows );
+
+      cv::remap( *sources[view], dst,
+                 maps1[view]->rowRange( stripeRows ),
+                 maps2[view]->rowRange( stripeRows ),
+                 cv::INTER_LINEAR );
+    }
+  } );
+}
+
+
+void DuoCalibrator::undistortAndRectify( const cv::Mat& left,
+                                         const cv::Mat& right,
+                                         cv::Mat& leftOut,
+                                         cv::Mat& rightOut ) const
+{
+  remapBoth( left, right, m_mapL1, m_mapL2, m_mapR1, m_mapR2,
+             leftOut, rightOut );
+}
+
+
+const cv::Mat& DuoCalibrator::computeDisparity( const cv::Mat& left,
+                                                const cv::Mat& right,
+                                                DuoDisparityContext& context ) const
+{
+  remapBoth( left, right,
+             m_mapDispL1, m_mapDispL2, m_mapDispR1, m_mapDispR2,
+             context.left, context.right );
+
+  applyDisparityRange( context.engine );
+
+  context.engine.compute( context.left, context.right, context.disparity );
+
+  return context.disparity;
+}
+
+
+const cv::Mat& DuoCalibrator::getDisparity( const cv::Mat& left,
+                                            const cv::Mat& right,
+                                            DuoDisparityContext& context ) const
+{
+  context.engine.colorize( computeDisparity( left, right, context ),
+                           context.color );
+
+  return context.color;
+}
+
+
+const cv::Mat& DuoCalibrator::computeDisparity( const cv::Mat& left,
+                                                const cv::Mat& right )
+{
+  return computeDisparity( left, right, m_disparityContext );
+}
+
+
+const cv::Mat& DuoCalibrator::getDisparity( const cv::Mat& left,
+                                            const cv::Mat& right )
+{
+  return getDisparity( left, right, m_disparityContext );
 }
 
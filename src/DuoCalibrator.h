@@ -1,9 +1,17 @@
 #ifndef DUO_CALIBRATOR_H
 #define DUO_CALIBRATOR_H
 
+#include <ostream>
+
 #include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
 
+#include "DuoCornerRefiner.h"
+#include "DuoDisparity.h"
+#include "DuoMapCache.h"
+#include "DuoSession.h"
 #include "DuoUtility.h"
+#include "DuoViewStore.h"
 
 
 const cv::Size QVGA     = cv::Size( WIDTH_QVGA, HEIGHT_QVGA );
@@ -11,15 +19,173 @@ const cv::Size VGA      = cv::Size( WIDTH_VGA,  HEIGHT_VGA  );
 const cv::Size DUO_FULL = cv::Size( WIDTH_FULL, HEIGHT_FULL );
 
 
+//
+// Cost of the most recent board detection, in ms. In the per-view arrays
+// index 0 is the left view, 1 the right view.
+//
+struct DuoDetectionTimings
+{
+  DuoDetectionTimings() : refineMs( 0.0 ), totalMs( 0.0 )
+  {
+    findMs[0]  = findMs[1]  = 0.0;
+    tracked[0] = tracked[1] = false;
+  }
+
+  double findMs[2];    // findChessboardCorners
+  double refineMs;     // sub-pixel refinement, both views in one batch
+  double totalMs;      // wall time for both views
+  bool   tracked[2];   // board was found inside the predicted region
+};
+
+
+//
+// Board detection over a capture session: the DetectionMeanMs and
+// DetectionRate of the intrinsics .yml
+//
+struct DuoDetectionStats
+{
+  DuoDetectionStats() : numFrames( 0 ), numBoardsFound( 0 ), sumMs( 0.0 ) {}
+
+  void add( const DuoDetectionStats& other )
+  {
+    numFrames      += other.numFrames;
+    numBoardsFound += other.numBoardsFound;
+    sumMs          += other.sumMs;
+  }
+
+  double getMeanMs() const { return numFrames > 0 ? sumMs/numFrames : 0.0; }
+
+  double getRate() const
+  {
+    return numFrames > 0 ? double( numBoardsFound )/numFrames : 0.0;
+  }
+
+  size_t numFrames;       // frame pairs searched
+  size_t numBoardsFound;  // of them with the board in both views
+  double sumMs;           // wall time of the searches
+};
+
+
+//
+// Cost of the stages of the most recent calibration, in ms
+//
+struct DuoCalibrationTimings
+{
+  DuoCalibrationTimings() : calibrateMs( 0.0 ), rectifyMs( 0.0 ), mapsMs( 0.0 )
+  {}
+
+  double calibrateMs;  // stereoCalibrate
+  double rectifyMs;    // stereoRectify
+  double mapsMs;       // initUndistortRectifyMap, both views
+};
+
+
+//
+// RMS reprojection error of one kept image set, in px
+//
+struct DuoViewError
+{
+  DuoViewError() : id( 0 ), left( 0.0 ), right( 0.0 ) {}
+
+  int    id;     // order in which the image set was kept, from 0
+  double left;
+  double right;
+};
+
+
 class DuoCalibrator
 {
 public:
 
-  DuoCalibrator( const cv::Size& boardSize )
-    : m_squareLength( 2.533 )  // in cm, but this could be changed to m or mm
-    , m_boardSize( boardSize ) // inner corners (this project's "chessboard" is 9x6)
-    , m_imageSize( VGA )       // default resolution (could go as high as 752x480)
-  {}
+  //
+  // How the chessboard is searched for in each view
+  //
+  enum DetectionMode
+  {
+    DETECT_FULL_RES, // search the full resolution image
+    DETECT_PYRAMID   // search a downscaled pyramid level with a fast reject,
+                     // then refine the corners at full resolution
+  };
+
+  //
+  // Calibration target
+  //
+  enum Pattern
+  {
+    PATTERN_CHESSBOARD,        // resources/DuoCalibrationGrid.png (9x6)
+    PATTERN_ASYMMETRIC_CIRCLES // resources/DuoCalibrationCircles.png (4x11)
+  };
+
+  //
+  // Stereo calibration solver used by solve()
+  //
+  enum Solver
+  {
+    SOLVER_STEREO_CALIBRATE, // cv::stereoCalibrate
+    SOLVER_BUNDLE_ADJUST     // DuoBundleAdjuster, same model, for many views
+  };
+
+  //
+  // squareLength is the chessboard's square length, or for the circle grid
+  // the spacing between circle centers (see m_squareLength); zero for the
+  // printed resources/ targets
+  //
+  DuoCalibrator( const cv::Size& boardSize,
+                 const Pattern pattern = PATTERN_CHESSBOARD,
+                 const cv::Size& imageSize = VGA,
+                 const float squareLength = 0.0f );
+
+  const cv::Size& getImageSize() const { return m_imageSize; }
+
+  //
+  // Size of the images getDisparity() computes on: by default the image
+  // scaled down to QVGA height, e.g. 320x240 for VGA and 376x240 for
+  // DUO_FULL
+  //
+  const cv::Size& getDisparitySize() const { return m_disparitySize; }
+
+  //
+  // Disparity image size as a fraction of the image size, 1 for full
+  // resolution; <= 0 for the QVGA height default
+  //
+  void setDisparityScale( const double scale );
+
+  //
+  // Depths the disparity range covers, in the units of the square length.
+  // The range follows from the calibrated baseline and focal length;
+  // minDepth <= 0 is DuoDisparity::MIN_DEPTH_BASELINES baselines and
+  // maxDepth <= 0 no limit.
+  //
+  void setDepthRange( const double minDepth, const double maxDepth );
+
+  //
+  // The matcher behind the getDisparity() without a context, e.g. to choose
+  // its algorithm
+  //
+  DuoDisparity& getDisparityEngine() { return m_disparityContext.engine; }
+
+  //
+  // Switch to another DUO resolution. The current calibration, if any, and
+  // the kept image sets are converted exactly to the new pixels (see
+  // convertCalibration) and the rectification maps regenerated, so e.g. a
+  // full resolution calibration serves binned QVGA streaming.
+  // Returns false if the size does not fit on the sensor.
+  //
+  bool setImageSize( const cv::Size& imageSize );
+
+  void setDetectionMode( DetectionMode mode, int pyramidLevels = 1 );
+
+  DetectionMode getDetectionMode() const { return m_detectionMode; }
+
+  void setSolver( Solver solver ) { m_solver = solver; }
+
+  Solver getSolver() const { return m_solver; }
+
+  //
+  // When enabled, the board is first searched for in a region predicted from
+  // the previous frame's corners, falling back to the whole image
+  //
+  void setTracking( bool enable ) { m_tracking = enable; m_hasTrack = false; }
 
   void processFrame( const cv::Mat& left,
                      const cv::Mat& right,
@@ -28,15 +194,211 @@ public:
 
   void keepMostRecent();
 
-  size_t getNumImageSets() { return m_objectPts.size(); }
+  void keepImageSet( const std::vector<cv::Point2f>& leftPts,
+                     const std::vector<cv::Point2f>& rightPts );
+
+  size_t getNumImageSets() const { return m_views.size(); }
+
+  //
+  // The kept image sets' corners
+  //
+  const DuoViewStore& getImageSets() const { return m_views; }
+
+  //
+  // Keep a session file (.duoses) at path: the image sets already in it,
+  // e.g. of a run that ended before calibrating, are added to the kept
+  // ones, then every image set kept from here on is appended to it.
+  // Returns false if the file cannot be written or is a session of another
+  // board.
+  //
+  bool openSession( const std::string& path );
+
+  void closeSession() { m_session.close(); }
+
+  //
+  // Add the image sets of another session of the same board, converted to
+  // this resolution if they were taken at another, and append them to the
+  // open session if there is one. Returns the number added, or -1 if path
+  // is not a session of this board.
+  //
+  int mergeSession( const std::string& path );
+
+  const cv::Size& getBoardSize() const { return m_boardSize; }
+
+  Pattern getPattern() const { return m_pattern; }
+
+  const DuoDetectionTimings& getLastDetectionTimings() const
+  {
+    return m_lastTimings;
+  }
+
+  const DuoDetectionStats& getDetectionStats() const
+  {
+    return m_detectionStats;
+  }
 
+  //
+  // Count detection done elsewhere, e.g. by the batch workers' calibrators,
+  // as this calibrator's
+  //
+  void addDetectionStats( const DuoDetectionStats& stats )
+  {
+    m_detectionStats.add( stats );
+  }
+
+  //
+  // Where progress and errors are printed, std::cout by default. The
+  // stream must outlive the calibrator's use of it.
+  //
+  void setLog( std::ostream& log ) { m_log = &log; }
+
+  //
+  // Solve for the stereo calibration from the kept image sets, then compute
+  // the rectification and its undistort maps. Nothing is written to disk.
+  //
+  // Image sets whose reprojection error is an outlier (see pruneViews) are
+  // dropped and the calibration re-solved from the previous result, until
+  // none are left.
+  //
+  // Returns the RMS reprojection error, or a negative value if there are
+  // too few image sets.
+  //
+  double solve();
+
+  //
+  // Start the next solve() from these intrinsics instead of from scratch,
+  // e.g. the running estimate of a DuoIncrementalCalibrator
+  //
+  void setInitialGuess( const cv::Mat& M1,
+                        const cv::Mat& D1,
+                        const cv::Mat& M2,
+                        const cv::Mat& D2 );
+
+  //
+  // solve() and write the intrinsics/extrinsics .yml files, plus the
+  // rectification map cache, to ${CALIBDUO_ROOT}/cameraFiles. Exits if the
+  // calibration fails.
+  //
   void calibrate();
 
-  const cv::Mat& undistortAndRectifyLeft( const cv::Mat& left ) const;
+  //
+  // As above, to outputDir (ending in a separator). Returns false if there
+  // are too few image sets or the files cannot be written.
+  //
+  bool calibrate( const std::string& outputDir );
+
+  //
+  // Load a calibration written by calibrate(). A calibration made at another
+  // resolution or binning is converted to this one. The rectification maps
+  // come from the memory-mapped map cache when there is one for this camera,
+  // resolution and calibration, else they are computed and cached.
+  // Returns false if the files cannot be read.
+  //
+  bool load( const std::string& intrinsicsPath,
+             const std::string& extrinsicsPath );
+
+  //
+  // DUO serial number, recorded with the calibration and part of the map
+  // cache key
+  //
+  void setSerialNumber( const std::string& serial ) { m_serial = serial; }
+
+  const std::string& getSerialNumber() const { return m_serial; }
+
+  //
+  // Timestamp of the current calibration, as in its file names
+  //
+  const std::string& getCalibrationDateTime() const { return m_calibDateTime; }
+
+  double getReprojectionError() const { return m_reprojectionError; }
+
+  const DuoCalibrationTimings& getCalibrationTimings() const
+  {
+    return m_calibTimings;
+  }
+
+  //
+  // Per-view errors of the kept image sets, in the order they were kept, and
+  // of the ones the last solve() dropped as outliers
+  //
+  const std::vector<DuoViewError>& getViewErrors() const { return m_viewErrors; }
+
+  const std::vector<DuoViewError>& getPrunedViews() const { return m_prunedViews; }
+
+  //
+  // Board corners in board coordinates, in detection order
+  //
+  const std::vector<cv::Point3f>& getObjectPoints() const
+  {
+    return m_views.getBoard();
+  }
+
+  const cv::Mat& getM1() const { return m_M1; }
+  const cv::Mat& getD1() const { return m_D1; }
+  const cv::Mat& getM2() const { return m_M2; }
+  const cv::Mat& getD2() const { return m_D2; }
+  const cv::Mat& getR()  const { return m_R;  }
+  const cv::Mat& getT()  const { return m_T;  }
+
+  //
+  // Undistorted and rectified views into buffers of the caller's, allocated
+  // on the first call and reused after that. Nothing here is shared between
+  // calls, so several threads may rectify with one calibrator at once.
+  //
+  void undistortAndRectifyLeft( const cv::Mat& left, cv::Mat& leftOut ) const;
+
+  void undistortAndRectifyRight( const cv::Mat& right, cv::Mat& rightOut ) const;
+
+  //
+  // Both views, the two remaps running in parallel in row stripes
+  //
+  void undistortAndRectify( const cv::Mat& left,
+                            const cv::Mat& right,
+                            cv::Mat& leftOut,
+                            cv::Mat& rightOut ) const;
+
+  //
+  // Disparity at getDisparitySize() straight from the raw left and right
+  // images: each view goes through a single remap that undistorts, rectifies
+  // and downscales at once. The full resolution rectified images are not
+  // needed for this. CV_16S in 1/16 px, see DuoDisparity.
+  //
+  // The rectified views and the disparity go to context, whose matcher is
+  // given the range of setDepthRange(). Returns context.disparity. One
+  // context per thread or pipeline stage; the calibrator itself is only
+  // read.
+  //
+  const cv::Mat& computeDisparity( const cv::Mat& left,
+                                   const cv::Mat& right,
+                                   DuoDisparityContext& context ) const;
+
+  //
+  // As above, colorized for display: returns context.color
+  //
+  const cv::Mat& getDisparity( const cv::Mat& left,
+                               const cv::Mat& right,
+                               DuoDisparityContext& context ) const;
 
-  const cv::Mat& undistortAndRectifyRight( const cv::Mat& right ) const;
+  //
+  // The two above with the calibrator's own context, for a single stream
+  //
+  const cv::Mat& computeDisparity( const cv::Mat& left, const cv::Mat& right );
 
-  const cv::Mat& getDisparity( const cv::Mat& left, const cv::Mat& right ) const;
+  const cv::Mat& getDisparity( const cv::Mat& left, const cv::Mat& right );
+
+  //
+  // Left view of the last computeDisparity() without a context, rectified at
+  // getDisparitySize(), e.g. for the intensity of a DuoPointCloud
+  //
+  const cv::Mat& getDisparityLeft() const { return m_disparityContext.left; }
+
+  //
+  // Rectified projections and disparity-to-depth matrix in the pixels of the
+  // disparity images
+  //
+  const cv::Mat& getDisparityP1() const { return m_P1Disp; }
+  const cv::Mat& getDisparityP2() const { return m_P2Disp; }
+  const cv::Mat& getDisparityQ()  const { return m_QDisp;  }
 
 private:
 
@@ -44,35 +406,130 @@ private:
                                const cv::Mat& right,
                                std::vector<cv::Point2f>& leftPtsOut,
                                std::vector<cv::Point2f>& rightPtsOut );
-  //
-  // TODO: Implement this, should give better results
-  //
-  //void detectCircleGridPoints( const cv::Mat& left,
-  //                             const cv::Mat& right,
-  //                             std::vector<cv::Point2f>& leftPtsOut,
-  //                             std::vector<cv::Point2f>& rightPtsOut );
+
+  bool findChessboard( const int view,
+                       const cv::Mat& image,
+                       std::vector<cv::Point2f>& ptsOut,
+                       bool& trackedOut );
+
+  bool searchChessboard( const int view,
+                         const cv::Mat& image,
+                         std::vector<cv::Point2f>& ptsOut );
+
+
+  void detectCircleGridPoints( const cv::Mat& left,
+                               const cv::Mat& right,
+                               std::vector<cv::Point2f>& leftPtsOut,
+                               std::vector<cv::Point2f>& rightPtsOut );
+
+  double calibrateStereo();
+
+  void computeViewErrors();
+
+  size_t pruneViews();
+
+  void releaseRectifyMaps();
+
+  void initRectifyMaps();
+
+  void initDisparityRectification();
+
+  bool convertCalibration( const cv::Size& from, const cv::Size& to );
+
+  void applyDisparityRange( DuoDisparity& engine ) const;
+
+  void addImageSet( const cv::Point2f* leftPts, const cv::Point2f* rightPts );
+
+  DuoSessionInfo getSessionInfo() const;
+
+  void initChessboardObjectPts();
+
+  void initCircleGridObjectPts();
 
 private:
 
+  const Pattern                         m_pattern;
+
+  //
+  // Chessboard square length, or for the circle grid the spacing between
+  // circle centers: the distance between a circle and its diagonal
+  // neighbour along the grid's rows, not a square's side
+  //
   const float                           m_squareLength;
 
   const cv::Size                        m_boardSize;
-  const cv::Size                        m_imageSize;
+  cv::Size                              m_imageSize;
+  cv::Size                              m_disparitySize;
+  double                                m_disparityScale;
 
   //
-  // Object points in world coordinates
+  // Image points in pixel coordinates of the kept image sets, with the
+  // object points in world coordinates they share, and the session file
+  // they are appended to
   //
-  std::vector<std::vector<cv::Point3f>> m_objectPts;
-  std::vector<cv::Point3f>              m_lastObjectPts;
+  DuoViewStore                          m_views;
+  DuoSessionWriter                      m_session;
+
+  std::vector<cv::Point2f>              m_lastImagePtsL;
+  std::vector<cv::Point2f>              m_lastImagePtsR;
 
   //
-  // Image points in pixel coordinates
+  // Reprojection error of each kept image set, and the image sets pruned
+  // as outliers with the error they were dropped at
   //
-  std::vector<std::vector<cv::Point2f>> m_imagePtsL;
-  std::vector<std::vector<cv::Point2f>> m_imagePtsR;
+  std::vector<DuoViewError>             m_viewErrors;
+  std::vector<DuoViewError>             m_prunedViews;
+  double                                m_pruneThreshold;
+  int                                   m_nextViewId;
 
-  std::vector<cv::Point2f>              m_lastImagePtsL;
-  std::vector<cv::Point2f>              m_lastImagePtsR;
+  DuoDetectionTimings                   m_lastTimings;
+
+  DetectionMode                         m_detectionMode;
+  int                                   m_pyramidLevels;
+
+  //
+  // Downscaled images for DETECT_PYRAMID, one pyramid per view
+  //
+  std::vector<cv::Mat>                  m_pyramid[2];
+
+  //
+  // Sub-pixel refinement of the chessboard corners at full resolution, and
+  // on the way back up the pyramid
+  //
+  DuoCornerRefiner                      m_cornerRefiner;
+  DuoCornerRefiner                      m_pyramidRefiner;
+
+  //
+  // Temporal tracking: m_hasTrack is set while the previous frame produced a
+  // good pair, in which case m_lastImagePtsL/R are that frame's corners
+  //
+  bool                                  m_tracking;
+  bool                                  m_hasTrack;
+
+  //
+  // Blob detectors for the circle grid, one per view
+  //
+  cv::Ptr<cv::FeatureDetector>          m_blobDetector[2];
+
+  //
+  // Detection cost over the whole capture session
+  //
+  DuoDetectionStats                     m_detectionStats;
+
+  DuoCalibrationTimings                 m_calibTimings;
+  double                                m_reprojectionError;
+
+  //
+  // m_M1/m_D1/m_M2/m_D2 hold a guess for the next solve()
+  //
+  bool                                  m_hasInitialGuess;
+
+  Solver                                m_solver;
+
+  std::ostream*                         m_log;
+
+  std::string                           m_serial;
+  std::string                           m_calibDateTime;
 
   //
   // Camera Intrinsics
@@ -102,6 +559,31 @@ private:
   cv::Mat                               m_mapL2;
   cv::Mat                               m_mapR1;
   cv::Mat                               m_mapR2;
+
+  //
+  // Fused undistort, rectify and downscale to m_disparitySize for the
+  // disparity path, and the rectification in those pixels
+  //
+  cv::Mat                               m_P1Disp;
+  cv::Mat                               m_P2Disp;
+  cv::Mat                               m_QDisp;
+  cv::Mat                               m_mapDispL1;
+  cv::Mat                               m_mapDispL2;
+  cv::Mat                               m_mapDispR1;
+  cv::Mat                               m_mapDispR2;
+
+  double                                m_minDepth;
+  double                                m_maxDepth;
+
+  //
+  // Buffers of computeDisparity() and getDisparity() without a context
+  //
+  DuoDisparityContext                   m_disparityContext;
+
+  //
+  // Backs the maps above when they were loaded from the cache
+  //
+  DuoMapCache                           m_mapCache;
 };
 
 #endif // DUO_CALIBRATOR_H
@@ -0,0 +1,526 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include <opencv2/imgproc.hpp>
+
+#include "DuoCornerRefiner.h"
+
+//
+// The kernel's lane width follows the instruction set the file is compiled
+// for (see calibDuo.pro); DUO_NO_SIMD leaves only the scalar fallback
+//
+#if !defined( DUO_NO_SIMD ) && defined( __AVX__ )
+#include <immintrin.h>
+#define DUO_SUBPIX_AVX
+#elif !defined( DUO_NO_SIMD ) && \
+      ( defined( __SSE2__ ) || defined( _M_X64 ) || \
+        ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 ) )
+#include <xmmintrin.h>
+#define DUO_SUBPIX_SSE2
+#endif
+
+
+//
+// cornerSubPix's bounds
+//
+static const int MAX_ITERS = 100;
+
+
+//
+// A corner of the batch: its image and its index in that image's points
+//
+struct DuoCornerRef
+{
+  int image;
+  int index;
+};
+
+
+//
+// What the kernel needs of the refiner
+//
+struct DuoSubPixParams
+{
+  cv::Size     win;       // half the window size
+  const float* mask;
+  int          maxIters;
+  double       eps2;
+};
+
+
+//
+// Lanes of single precision floats: one per corner of a group. The kernel
+// is written once against these and instantiated for each width.
+//
+struct DuoLanesScalar
+{
+  typedef float V;
+
+  static const int N = 1;
+
+  static V    zero()                       { return 0.0f; }
+  static V    set( const float x )         { return x; }
+  static V    load( const float* p )       { return *p; }
+  static void store( float* p, const V v ) { *p = v; }
+
+  static V add( const V a, const V b ) { return a + b; }
+  static V sub( const V a, const V b ) { return a - b; }
+  static V mul( const V a, const V b ) { return a*b; }
+};
+
+#ifdef DUO_SUBPIX_SSE2
+struct DuoLanesSse2
+{
+  typedef __m128 V;
+
+  static const int N = 4;
+
+  static V    zero()                       { return _mm_setzero_ps(); }
+  static V    set( const float x )         { return _mm_set1_ps( x ); }
+  static V    load( const float* p )       { return _mm_loadu_ps( p ); }
+  static void store( float* p, const V v ) { _mm_storeu_ps( p, v ); }
+
+  static V add( const V a, const V b ) { return _mm_add_ps( a, b ); }
+  static V sub( const V a, const V b ) { return _mm_sub_ps( a, b ); }
+  static V mul( const V a, const V b ) { return _mm_mul_ps( a, b ); }
+};
+#endif
+
+#ifdef DUO_SUBPIX_AVX
+struct DuoLanesAvx
+{
+  typedef __m256 V;
+
+  static const int N = 8;
+
+  static V    zero()                       { return _mm256_setzero_ps(); }
+  static V    set( const float x )         { return _mm256_set1_ps( x ); }
+  static V    load( const float* p )       { return _mm256_loadu_ps( p ); }
+  static void store( float* p, const V v ) { _mm256_storeu_ps( p, v ); }
+
+  static V add( const V a, const V b ) { return _mm256_add_ps( a, b ); }
+  static V sub( const V a, const V b ) { return _mm256_sub_ps( a, b ); }
+  static V mul( const V a, const V b ) { return _mm256_mul_ps( a, b ); }
+};
+#endif
+
+
+//
+// The qw x qh pixels from (x0, y0) into every stride-th float of dst, row
+// by row, replicating the image's border as getRectSubPix does
+//
+static void gatherPixels( const cv::Mat& image,
+                          const int x0, const int y0,
+                          const int qw, const int qh,
+                          float* dst,
+                          const int stride )
+{
+  const bool inside = x0 >= 0 && x0 + qw <= image.cols &&
+                      y0 >= 0 && y0 + qh <= image.rows;
+
+  for( int r = 0; r < qh; ++r, dst += qw*stride )
+  {
+    const int y = inside ? y0 + r
+                         : std::min( std::max( y0 + r, 0 ), image.rows - 1 );
+
+    const uchar* row = image.ptr<uchar>( y );
+
+    if( inside )
+    {
+      for( int c = 0; c < qw; ++c )
+        dst[c*stride] = row[x0 + c];
+    }
+    else
+    {
+      for( int c = 0; c < qw; ++c )
+        dst[c*stride] = row[std::min( std::max( x0 + c, 0 ), image.cols - 1 )];
+    }
+  }
+}
+
+
+//
+// Bilinear pw x ph patch of each lane from its pixels, with the lane's
+// four weights at weights[0], [N], [2N] and [3N]
+//
+template<class L>
+static void interpolate( const float* pixels,
+                         const float* weights,
+                         const int pw, const int ph,
+                         float* patch )
+{
+  const int N  = L::N;
+  const int qw = pw + 1;
+
+  const typename L::V w00 = L::load( weights );
+  const typename L::V w01 = L::load( weights + N );
+  const typename L::V w10 = L::load( weights + 2*N );
+  const typename L::V w11 = L::load( weights + 3*N );
+
+  for( int r = 0; r < ph; ++r )
+  {
+    const float* q0 = pixels + r*qw*N;
+    const float* q1 = q0 + qw*N;
+    float*       p  = patch + r*pw*N;
+
+    for( int c = 0; c < pw; ++c )
+    {
+      const typename L::V top = L::add( L::mul( w00, L::load( q0 + c*N ) ),
+                                        L::mul( w01, L::load( q0 + ( c + 1 )*N ) ) );
+      const typename L::V bot = L::add( L::mul( w10, L::load( q1 + c*N ) ),
+                                        L::mul( w11, L::load( q1 + ( c + 1 )*N ) ) );
+
+      L::store( p + c*N, L::add( top, bot ) );
+    }
+  }
+}
+
+
+//
+// cornerSubPix's a, b, c, bb1 and bb2 of each lane: the structure tensor
+// of the window and its moments, at sums[0], [N], .., [4N]. A row is
+// summed in the lanes, and the rows in double precision.
+//
+template<class L>
+static void sumGradients( const float* patch,
+                          const int pw,
+                          const DuoSubPixParams& params,
+                          double* sums )
+{
+  typedef typename L::V V;
+
+  const int N    = L::N;
+  const int winW = 2*params.win.width  + 1;
+  const int winH = 2*params.win.height + 1;
+
+  std::fill( sums, sums + 5*N, 0.0 );
+
+  float row[5*N];
+
+  for( int i = 0; i < winH; ++i )
+  {
+    const V py = L::set( float( i - params.win.height ) );
+
+    V a   = L::zero();
+    V b   = L::zero();
+    V c   = L::zero();
+    V bb1 = L::zero();
+    V bb2 = L::zero();
+
+    const float* p    = patch + ( ( i + 1 )*pw + 1 )*N;
+    const float* mask = params.mask + i*winW;
+
+    for( int j = 0; j < winW; ++j, p += N )
+    {
+      const V m  = L::set( mask[j] );
+      const V px = L::set( float( j - params.win.width ) );
+
+      const V gx = L::sub( L::load( p + N ),    L::load( p - N ) );
+      const V gy = L::sub( L::load( p + pw*N ), L::load( p - pw*N ) );
+
+      const V gxx = L::mul( L::mul( gx, gx ), m );
+      const V gxy = L::mul( L::mul( gx, gy ), m );
+      const V gyy = L::mul( L::mul( gy, gy ), m );
+
+      a   = L::add( a, gxx );
+      b   = L::add( b, gxy );
+      c   = L::add( c, gyy );
+      bb1 = L::add( bb1, L::add( L::mul( gxx, px ), L::mul( gxy, py ) ) );
+      bb2 = L::add( bb2, L::add( L::mul( gxy, px ), L::mul( gyy, py ) ) );
+    }
+
+    L::store( row,       a );
+    L::store( row + N,   b );
+    L::store( row + 2*N, c );
+    L::store( row + 3*N, bb1 );
+    L::store( row + 4*N, bb2 );
+
+    for( int k = 0; k < 5*N; ++k )
+      sums[k] += row[k];
+  }
+}
+
+
+//
+// Refines count <= L::N corners, one per lane, with cornerSubPix's
+// iterations. Lanes that have converged ride along with zero weights until
+// the last one has.
+//
+template<class L>
+static void refineGroup( const DuoSubPixParams& params,
+                         const cv::Mat* const* images,
+                         std::vector<cv::Point2f>* const* points,
+                         const DuoCornerRef* corners,
+                         const int count,
+                         float* pixels,
+                         float* patch )
+{
+  const int N  = L::N;
+  const int pw = 2*params.win.width  + 3;
+  const int ph = 2*params.win.height + 3;
+
+  cv::Point2f start[N];
+  cv::Point2f cur[N];
+  int         iters[N];
+  bool        active[N];
+  float       weights[4*N];
+  double      sums[5*N];
+
+  int numActive = 0;
+
+  for( int l = 0; l < N; ++l )
+  {
+    active[l] = l < count;
+    iters[l]  = 0;
+
+    if( !active[l] ) continue;
+
+    start[l] = cur[l] = ( *points[corners[l].image] )[corners[l].index];
+    ++numActive;
+  }
+
+  while( numActive > 0 )
+  {
+    //
+    // Pixels under each patch, which getRectSubPix centers on the corner
+    //
+    for( int l = 0; l < N; ++l )
+    {
+      if( !active[l] )
+      {
+        weights[l] = weights[N + l] = weights[2*N + l] = weights[3*N + l] = 0.0f;
+        continue;
+      }
+
+      const float tx = cur[l].x - ( pw - 1 )*0.5f;
+      const float ty = cur[l].y - ( ph - 1 )*0.5f;
+      const int   x0 = cvFloor( tx );
+      const int   y0 = cvFloor( ty );
+      const float a  = tx - x0;
+      const float b  = ty - y0;
+
+      weights[l]       = ( 1.0f - a )*( 1.0f - b );
+      weights[N + l]   = a*( 1.0f - b );
+      weights[2*N + l] = ( 1.0f - a )*b;
+      weights[3*N + l] = a*b;
+
+      gatherPixels( *images[corners[l].image], x0, y0, pw + 1, ph + 1,
+                    pixels + l, N );
+    }
+
+    interpolate<L>( pixels, weights, pw, ph, patch );
+    sumGradients<L>( patch, pw, params, sums );
+
+    //
+    // Solve each lane's 2x2 system for the step
+    //
+    for( int l = 0; l < N; ++l )
+    {
+      if( !active[l] ) continue;
+
+      const double a   = sums[l];
+      const double b   = sums[N + l];
+      const double c   = sums[2*N + l];
+      const double bb1 = sums[3*N + l];
+      const double bb2 = sums[4*N + l];
+
+      const double det = a*c - b*b;
+
+      bool done = std::fabs( det ) <= DBL_EPSILON*DBL_EPSILON;
+
+      if( !done )
+      {
+        const double scale = 1.0/det;
+
+        const cv::Point2f next( float( cur[l].x + c*scale*bb1 - b*scale*bb2 ),
+                                float( cur[l].y - b*scale*bb1 + a*scale*bb2 ) );
+
+        const double err = ( next.x - cur[l].x )*( next.x - cur[l].x ) +
+                           ( next.y - cur[l].y )*( next.y - cur[l].y );
+
+        cur[l] = next;
+
+        const cv::Mat& image = *images[corners[l].image];
+
+        done = next.x < 0 || next.x >= image.cols ||
+               next.y < 0 || next.y >= image.rows ||
+               ++iters[l] >= params.maxIters ||
+               err <= params.eps2;
+      }
+
+      if( done )
+      {
+        active[l] = false;
+        --numActive;
+      }
+    }
+  }
+
+  //
+  // A corner that wandered out of its window did not converge, and keeps
+  // its initial position
+  //
+  for( int l = 0; l < count; ++l )
+  {
+    if( std::fabs( cur[l].x - start[l].x ) > params.win.width ||
+        std::fabs( cur[l].y - start[l].y ) > params.win.height )
+      cur[l] = start[l];
+
+    ( *points[corners[l].image] )[corners[l].index] = cur[l];
+  }
+}
+
+
+//
+// Every corner, in groups of L::N split between OpenCV's threads
+//
+template<class L>
+static void refineAll( const DuoSubPixParams& params,
+                       const cv::Mat* const* images,
+                       std::vector<cv::Point2f>* const* points,
+                       const std::vector<DuoCornerRef>& corners )
+{
+  const int N         = L::N;
+  const int numGroups = ( int( corners.size() ) + N - 1 )/N;
+  const int pw        = 2*params.win.width  + 3;
+  const int ph        = 2*params.win.height + 3;
+
+  cv::parallel_for_( cv::Range( 0, numGroups ), [&]( const cv::Range& range )
+  {
+    //
+    // Lane-interleaved: float i of lane l is at i*N + l. The pixels of
+    // lanes without a corner stay zero.
+    //
+    std::vector<float> pixels( ( pw + 1 )*( ph + 1 )*N, 0.0f );
+    std::vector<float> patch( pw*ph*N );
+
+    for( int g = range.start; g < range.end; ++g )
+    {
+      const int first = g*N;
+      const int count = std::min( N, int( corners.size() ) - first );
+
+      refineGroup<L>( params, images, points, &corners[first], count,
+                      pixels.data(), patch.data() );
+    }
+  } );
+}
+
+
+DuoCornerRefiner::DuoCornerRefiner( const cv::Size& winSize,
+                                    const cv::Size& zeroZone,
+                                    const cv::TermCriteria& criteria )
+  : m_winSize( winSize )
+  , m_zeroZone( zeroZone )
+  , m_criteria( criteria )
+  , m_maxIters( MAX_ITERS )
+  , m_eps2( 0.0 )
+  , m_simd( true )
+{
+  CV_Assert( winSize.width > 0 && winSize.height > 0 );
+
+  if( criteria.type & cv::TermCriteria::MAX_ITER )
+    m_maxIters = std::min( std::max( criteria.maxCount, 1 ), MAX_ITERS );
+
+  if( criteria.type & cv::TermCriteria::EPS )
+    m_eps2 = std::max( criteria.epsilon, 0.0 )*std::max( criteria.epsilon, 0.0 );
+
+  //
+  // Weights fall off as exp(-r^2) with r 1 at the window's edge
+  //
+  const int winW = 2*winSize.width  + 1;
+  const int winH = 2*winSize.height + 1;
+
+  m_mask.resize( winW*winH );
+
+  for( int i = 0; i < winH; ++i )
+  {
+    const float y  = float( i - winSize.height )/winSize.height;
+    const float vy = std::exp( -y*y );
+
+    for( int j = 0; j < winW; ++j )
+    {
+      const float x = float( j - winSize.width )/winSize.width;
+      m_mask[i*winW + j] = float( vy*std::exp( -x*x ) );
+    }
+  }
+
+  if( zeroZone.width >= 0 && zeroZone.height >= 0 &&
+      2*zeroZone.width + 1 < winW && 2*zeroZone.height + 1 < winH )
+  {
+    for( int i = winSize.height - zeroZone.height; i <= winSize.height + zeroZone.height; ++i )
+      for( int j = winSize.width - zeroZone.width; j <= winSize.width + zeroZone.width; ++j )
+        m_mask[i*winW + j] = 0.0f;
+  }
+}
+
+
+void DuoCornerRefiner::refine( const cv::Mat* const* images,
+                               std::vector<cv::Point2f>* const* points,
+                               const int numImages ) const
+{
+  std::vector<DuoCornerRef> corners;
+
+  for( int i = 0; i < numImages; ++i )
+  {
+    if( points[i]->empty() ) continue;
+
+    if( images[i]->type() != CV_8UC1 )
+    {
+      cv::cornerSubPix( *images[i], *points[i], m_winSize, m_zeroZone, m_criteria );
+      continue;
+    }
+
+    for( int j = 0; j < int( points[i]->size() ); ++j )
+    {
+      const DuoCornerRef ref = { i, j };
+      corners.push_back( ref );
+    }
+  }
+
+  if( corners.empty() ) return;
+
+  DuoSubPixParams params;
+  params.win      = m_winSize;
+  params.mask     = m_mask.data();
+  params.maxIters = m_maxIters;
+  params.eps2     = m_eps2;
+
+#if defined( DUO_SUBPIX_AVX )
+  if( m_simd )
+  {
+    refineAll<DuoLanesAvx>( params, images, points, corners );
+    return;
+  }
+#elif defined( DUO_SUBPIX_SSE2 )
+  if( m_simd )
+  {
+    refineAll<DuoLanesSse2>( params, images, points, corners );
+    return;
+  }
+#endif
+
+  refineAll<DuoLanesScalar>( params, images, points, corners );
+}
+
+
+void DuoCornerRefiner::refine( const cv::Mat& image,
+                               std::vector<cv::Point2f>& points ) const
+{
+  const cv::Mat*            images[1] = { &image };
+  std::vector<cv::Point2f>* pts[1]    = { &points };
+
+  refine( images, pts, 1 );
+}
+
+
+const char* DuoCornerRefiner::getInstructionSet()
+{
+#if defined( DUO_SUBPIX_AVX )
+  return "AVX";
+#elif defined( DUO_SUBPIX_SSE2 )
+  return "SSE2";
+#else
+  return "scalar";
+#endif
+}
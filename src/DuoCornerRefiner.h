@@ -0,0 +1,80 @@
+#ifndef DUO_CORNER_REFINER_H
+#define DUO_CORNER_REFINER_H
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+
+//
+// Sub-pixel corner refinement with cv::cornerSubPix's algorithm, for the
+// corners of several images at once.
+//
+// cornerSubPix refines one corner at a time, and most of its time goes into
+// summing the gradient terms over the window. Here the corners of all the
+// images are refined in groups, one corner per SIMD lane: 8 with AVX, 4
+// with SSE2, and 1 in the scalar fallback. Every window pixel's terms are
+// then summed for a whole group in a few vector instructions, and the
+// groups are split between OpenCV's threads, so the two views of a pair
+// and larger boards spread over the cores.
+//
+// Sums are kept in single precision within a window row and in double
+// precision across rows. Corners agree with cornerSubPix to about 1e-3 px,
+// unless the two take different iteration counts because a step lands
+// right at the criteria's epsilon.
+//
+// refine() only reads the refiner, so one refiner can be shared between
+// threads.
+//
+class DuoCornerRefiner
+{
+public:
+
+  //
+  // As for cv::cornerSubPix: half the window size, half the size of the
+  // dead zone in its middle (-1, -1 for none) and when to stop iterating
+  //
+  DuoCornerRefiner( const cv::Size& winSize,
+                    const cv::Size& zeroZone,
+                    const cv::TermCriteria& criteria );
+
+  //
+  // Refines points[i] in images[i] for i < numImages, in place. Images
+  // that are not CV_8UC1 are passed on to cv::cornerSubPix.
+  //
+  void refine( const cv::Mat* const* images,
+               std::vector<cv::Point2f>* const* points,
+               const int numImages ) const;
+
+  void refine( const cv::Mat& image, std::vector<cv::Point2f>& points ) const;
+
+  //
+  // Refines with the scalar fallback even where SIMD is available, to check
+  // the two against each other
+  //
+  void setSimd( bool enable ) { m_simd = enable; }
+
+  bool getSimd() const { return m_simd; }
+
+  //
+  // Instruction set of the compiled kernel: "AVX", "SSE2" or "scalar"
+  //
+  static const char* getInstructionSet();
+
+private:
+
+  cv::Size           m_winSize;
+  cv::Size           m_zeroZone;
+  cv::TermCriteria   m_criteria;
+  int                m_maxIters;
+  double             m_eps2;      // squared, as the steps are compared
+
+  //
+  // Gaussian weight of each window pixel, zero in the dead zone
+  //
+  std::vector<float> m_mask;
+
+  bool               m_simd;
+};
+
+#endif // DUO_CORNER_REFINER_H
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/imgproc.hpp>
+
+#include "DuoCoverage.h"
+
+
+//
+// A board tilted by roughly 15 degrees or more about an axis makes its far
+// edge this much (log ratio) shorter than the near one
+//
+static const double TILT_LOG_RATIO = 0.08;
+
+//
+// Board area as a share of the image: far below the first, near above the
+// second
+//
+static const double FAR_AREA  = 0.08;
+static const double NEAR_AREA = 0.25;
+
+static const int NUM_TILT_BINS     = 3;
+static const int NUM_DISTANCE_BINS = 3;
+
+//
+// Views per cell at which the heatmap turns fully green
+//
+static const int CELL_TARGET = 3;
+
+
+static int tiltBin( const double longEdge, const double shortEdge )
+{
+  const double r = std::log( std::max( longEdge, 1e-3 )/std::max( shortEdge, 1e-3 ) );
+
+  if( r < -TILT_LOG_RATIO ) return 0;
+  if( r >  TILT_LOG_RATIO ) return 2;
+  return 1;
+}
+
+
+DuoCoverage::DuoCoverage( const cv::Size& imageSize,
+                          const cv::Size& boardSize,
+                          const cv::Size& gridSize )
+  : m_imageSize( imageSize )
+  , m_boardSize( boardSize )
+  , m_gridSize( gridSize )
+  , m_poseCounts( getNumPoseBins(), 0 )
+{
+  for( int v = 0; v < 2; ++v )
+  {
+    m_cellCounts[v].assign( m_gridSize.area(), 0 );
+    m_heatmapStale[v] = true;
+  }
+}
+
+
+int DuoCoverage::getNumPoseBins()
+{
+  return NUM_TILT_BINS*NUM_TILT_BINS*NUM_DISTANCE_BINS;
+}
+
+
+int DuoCoverage::cellIndex( const cv::Point2f& pt ) const
+{
+  const int x = std::min( std::max( int( pt.x*m_gridSize.width/m_imageSize.width ), 0 ),
+                          m_gridSize.width - 1 );
+  const int y = std::min( std::max( int( pt.y*m_gridSize.height/m_imageSize.height ), 0 ),
+                          m_gridSize.height - 1 );
+
+  return y*m_gridSize.width + x;
+}
+
+
+int DuoCoverage::poseBin( const std::vector<cv::Point2f>& pts ) const
+{
+  const int w = m_boardSize.width;
+  const int n = m_boardSize.area();
+
+  if( int( pts.size() ) != n ) return -1;
+
+  //
+  // Outer corners. The detector may report the board rotated by 180
+  // degrees, so start from the corner nearest the image's top left to keep
+  // the tilt signs consistent.
+  //
+  cv::Point2f a = pts[0];
+  cv::Point2f b = pts[w - 1];
+  cv::Point2f c = pts[n - 1];
+  cv::Point2f d = pts[n - w];
+
+  if( a.x + a.y > c.x + c.y )
+  {
+    std::swap( a, c );
+    std::swap( b, d );
+  }
+
+  const int tiltA = tiltBin( cv::norm( a - b ), cv::norm( d - c ) );
+  const int tiltB = tiltBin( cv::norm( a - d ), cv::norm( b - c ) );
+
+  const std::vector<cv::Point2f> outline = { a, b, c, d };
+
+  const double area = cv::contourArea( outline )/m_imageSize.area();
+
+  const int distance = ( area < FAR_AREA ) ? 0 : ( area < NEAR_AREA ) ? 1 : 2;
+
+  return ( tiltA*NUM_TILT_BINS + tiltB )*NUM_DISTANCE_BINS + distance;
+}
+
+
+double DuoCoverage::cellGain( const int view,
+                              const std::vector<cv::Point2f>& pts ) const
+{
+  std::vector<char> touched( m_gridSize.area(), 0 );
+
+  for( const cv::Point2f& pt : pts )
+    touched[cellIndex( pt )] = 1;
+
+  double gain = 0.0;
+  int    n    = 0;
+
+  for( size_t i = 0; i < touched.size(); ++i )
+  {
+    if( !touched[i] ) continue;
+
+    gain += 1.0/( 1 + m_cellCounts[view][i] );
+    ++n;
+  }
+
+  return ( n > 0 ) ? gain/n : 0.0;
+}
+
+
+double DuoCoverage::score( const std::vector<cv::Point2f>& leftPts,
+                           const std::vector<cv::Point2f>& rightPts ) const
+{
+  const int bin = poseBin( leftPts );
+  if( bin < 0 ) return 0.0;
+
+  const double imageGain = 0.5*( cellGain( 0, leftPts ) + cellGain( 1, rightPts ) );
+  const double poseGain  = 1.0/( 1 + m_poseCounts[bin] );
+
+  return std::max( imageGain, poseGain );
+}
+
+
+void DuoCoverage::add( const std::vector<cv::Point2f>& leftPts,
+                       const std::vector<cv::Point2f>& rightPts )
+{
+  const int bin = poseBin( leftPts );
+  if( bin < 0 ) return;
+
+  ++m_poseCounts[bin];
+
+  const std::vector<cv::Point2f>* pts[2] = { &leftPts, &rightPts };
+
+  for( int v = 0; v < 2; ++v )
+  {
+    std::vector<char> touched( m_gridSize.area(), 0 );
+
+    for( const cv::Point2f& pt : *pts[v] )
+      touched[cellIndex( pt )] = 1;
+
+    for( size_t i = 0; i < touched.size(); ++i )
+      m_cellCounts[v][i] += touched[i];
+
+    m_heatmapStale[v] = true;
+  }
+}
+
+
+double DuoCoverage::getCoverage( const int view ) const
+{
+  const std::vector<int>& counts = m_cellCounts[view];
+
+  return double( counts.size() - std::count( counts.begin(), counts.end(), 0 ) )/
+         counts.size();
+}
+
+
+int DuoCoverage::getNumPosesSeen() const
+{
+  return int( m_poseCounts.size() -
+              std::count( m_poseCounts.begin(), m_poseCounts.end(), 0 ) );
+}
+
+
+void DuoCoverage::drawHeatmap( const int view, cv::Mat& display ) const
+{
+  if( m_heatmapStale[view] || m_heatmap[view].size() != display.size() )
+  {
+    cv::Mat cells( m_gridSize, CV_8UC3 );
+
+    for( int i = 0; i < m_gridSize.area(); ++i )
+    {
+      const double t = std::min( m_cellCounts[view][i], CELL_TARGET )/
+                       double( CELL_TARGET );
+
+      cells.at<cv::Vec3b>( i/m_gridSize.width, i%m_gridSize.width ) =
+          cv::Vec3b( 0, uchar( 255*t ), uchar( 255*( 1.0 - t ) ) );
+    }
+
+    cv::resize( cells, m_heatmap[view], display.size(), 0, 0, cv::INTER_NEAREST );
+
+    m_heatmapStale[view] = false;
+  }
+
+  cv::addWeighted( display, 0.75, m_heatmap[view], 0.25, 0.0, display );
+}
@@ -0,0 +1,84 @@
+#ifndef DUO_COVERAGE_H
+#define DUO_COVERAGE_H
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+
+//
+// Tracks what the kept views cover, to decide whether a new detection adds
+// information to the calibration:
+//
+//  - image coverage, on a grid of cells over each view
+//  - pose, as a bin of board tilt about either axis and of distance
+//
+// Tilt and distance come from the board's outline in the left view (edge
+// length ratios and area), so no calibration is needed to score a pose.
+//
+class DuoCoverage
+{
+public:
+
+  DuoCoverage( const cv::Size& imageSize,
+               const cv::Size& boardSize,
+               const cv::Size& gridSize = cv::Size( 8, 6 ) );
+
+  //
+  // Novelty of a detected pair in [0, 1]: the larger of the share of new
+  // image area, weighted by how often each cell was seen before, and
+  // 1/(1 + views already in the pose bin)
+  //
+  double score( const std::vector<cv::Point2f>& leftPts,
+                const std::vector<cv::Point2f>& rightPts ) const;
+
+  //
+  // Record a kept pair
+  //
+  void add( const std::vector<cv::Point2f>& leftPts,
+            const std::vector<cv::Point2f>& rightPts );
+
+  //
+  // Share of grid cells seen at least once, per view (0 left, 1 right)
+  //
+  double getCoverage( const int view ) const;
+
+  int getNumPosesSeen() const;
+
+  static int getNumPoseBins();
+
+  //
+  // Blend a heatmap of the view's coverage into its display image: red cells
+  // were never seen, green cells were seen often enough
+  //
+  void drawHeatmap( const int view, cv::Mat& display ) const;
+
+private:
+
+  int cellIndex( const cv::Point2f& pt ) const;
+
+  int poseBin( const std::vector<cv::Point2f>& pts ) const;
+
+  double cellGain( const int view, const std::vector<cv::Point2f>& pts ) const;
+
+private:
+
+  const cv::Size        m_imageSize;
+  const cv::Size        m_boardSize;
+  const cv::Size        m_gridSize;
+
+  //
+  // Views seen per grid cell, row-major, one grid per view
+  //
+  std::vector<int>      m_cellCounts[2];
+
+  std::vector<int>      m_poseCounts;
+
+  //
+  // Heatmaps at display size, rebuilt when the counts change
+  //
+  mutable cv::Mat       m_heatmap[2];
+  mutable bool          m_heatmapStale[2];
+};
+
+#endif // DUO_COVERAGE_H
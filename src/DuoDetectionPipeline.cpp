@@ -0,0 +1,161 @@
+#include "DuoDetectionPipeline.h"
+
+
+DuoDetectionPipeline::DuoDetectionPipeline( DuoCalibrator& calibrator )
+  : m_calibrator( calibrator )
+  , m_stop( false )
+  , m_hasPending( false )
+  , m_nextId( 0 )
+  , m_numSkipped( 0 )
+  , m_pendingId( 0 )
+  , m_workId( 0 )
+{
+  m_worker = std::thread( &DuoDetectionPipeline::run, this );
+}
+
+
+DuoDetectionPipeline::~DuoDetectionPipeline()
+{
+  stop();
+}
+
+
+uint64_t DuoDetectionPipeline::submit( const cv::Mat& left,
+                                       const cv::Mat& right )
+{
+  std::unique_lock<std::mutex> lk( m_mutex );
+
+  if( m_hasPending )
+    ++m_numSkipped;
+
+  //
+  // copyTo reuses the pending buffers once they have the right size
+  //
+  left.copyTo( m_pendingL );
+  right.copyTo( m_pendingR );
+
+  m_pendingId  = ++m_nextId;
+  m_hasPending = true;
+
+  m_cv.notify_one();
+
+  return m_pendingId;
+}
+
+
+bool DuoDetectionPipeline::latest( DuoDetection& out ) const
+{
+  std::unique_lock<std::mutex> lk( m_mutex );
+
+  if( m_latest.frameId == 0 ) return false;
+
+  out.frameId  = m_latest.frameId;
+  out.valid    = m_latest.valid;
+  out.detectMs = m_latest.detectMs;
+  out.timings  = m_latest.timings;
+  out.leftPts.assign( m_latest.leftPts.begin(), m_latest.leftPts.end() );
+  out.rightPts.assign( m_latest.rightPts.begin(), m_latest.rightPts.end() );
+
+  return true;
+}
+
+
+bool DuoDetectionPipeline::newestValid( DuoDetection& out ) const
+{
+  std::unique_lock<std::mutex> lk( m_mutex );
+
+  if( !m_newestValid.valid ) return false;
+
+  out.frameId  = m_newestValid.frameId;
+  out.valid    = true;
+  out.detectMs = m_newestValid.detectMs;
+  out.timings  = m_newestValid.timings;
+  out.leftPts.assign( m_newestValid.leftPts.begin(),
+                      m_newestValid.leftPts.end() );
+  out.rightPts.assign( m_newestValid.rightPts.begin(),
+                       m_newestValid.rightPts.end() );
+
+  m_newestValid.left.copyTo( out.left );
+  m_newestValid.right.copyTo( out.right );
+
+  return true;
+}
+
+
+uint64_t DuoDetectionPipeline::getNumSkipped() const
+{
+  std::unique_lock<std::mutex> lk( m_mutex );
+  return m_numSkipped;
+}
+
+
+void DuoDetectionPipeline::stop()
+{
+  {
+    std::unique_lock<std::mutex> lk( m_mutex );
+    m_stop = true;
+    m_cv.notify_one();
+  }
+
+  if( m_worker.joinable() )
+    m_worker.join();
+}
+
+
+void DuoDetectionPipeline::run()
+{
+  std::vector<cv::Point2f> leftPts;
+  std::vector<cv::Point2f> rightPts;
+
+  const size_t boardArea = m_calibrator.getBoardSize().area();
+
+  while( true )
+  {
+    {
+      std::unique_lock<std::mutex> lk( m_mutex );
+      m_cv.wait( lk, [this] { return m_stop || m_hasPending; } );
+
+      if( m_stop ) return;
+
+      //
+      // Take ownership of the newest frame, leaving our old buffers behind
+      // for the capture stage to fill
+      //
+      cv::swap( m_pendingL, m_workL );
+      cv::swap( m_pendingR, m_workR );
+      m_workId     = m_pendingId;
+      m_hasPending = false;
+    }
+
+    const int64 start = cv::getTickCount();
+
+    m_calibrator.processFrame( m_workL, m_workR, leftPts, rightPts );
+
+    const double ms = TicksToMs( cv::getTickCount() - start );
+
+    const bool valid = leftPts.size()  == boardArea &&
+                       rightPts.size() == boardArea;
+
+    std::unique_lock<std::mutex> lk( m_mutex );
+
+    m_latest.frameId  = m_workId;
+    m_latest.valid    = valid;
+    m_latest.detectMs = ms;
+    m_latest.timings  = m_calibrator.getLastDetectionTimings();
+    m_latest.leftPts.assign( leftPts.begin(), leftPts.end() );
+    m_latest.rightPts.assign( rightPts.begin(), rightPts.end() );
+
+    if( valid )
+    {
+      m_newestValid.frameId  = m_workId;
+      m_newestValid.valid    = true;
+      m_newestValid.detectMs = ms;
+      m_newestValid.timings  = m_latest.timings;
+      m_newestValid.leftPts.assign( leftPts.begin(), leftPts.end() );
+      m_newestValid.rightPts.assign( rightPts.begin(), rightPts.end() );
+
+      m_workL.copyTo( m_newestValid.left );
+      m_workR.copyTo( m_newestValid.right );
+    }
+  }
+}
@@ -0,0 +1,111 @@
+#ifndef DUO_DETECTION_PIPELINE_H
+#define DUO_DETECTION_PIPELINE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "DuoCalibrator.h"
+
+
+//
+// Detection result, tagged with the id of the frame it was computed from
+//
+struct DuoDetection
+{
+  DuoDetection() : frameId( 0 ), valid( false ), detectMs( 0.0 ) {}
+
+  uint64_t                 frameId;
+  bool                     valid;
+  double                   detectMs;
+
+  DuoDetectionTimings      timings;
+
+  std::vector<cv::Point2f> leftPts;
+  std::vector<cv::Point2f> rightPts;
+
+  //
+  // Only filled in by DuoDetectionPipeline::newestValid()
+  //
+  cv::Mat                  left;
+  cv::Mat                  right;
+};
+
+
+//
+// Runs the calibrator's board detection on a worker thread so the capture and
+// display stages never wait on it.
+//
+// The capture stage submit()s every frame. The worker always picks up the most
+// recently submitted frame; frames submitted while it is busy are replaced and
+// counted as skipped. DuoCalibrator::processFrame keeps per-frame state, so
+// there is exactly one detection worker per calibrator.
+//
+class DuoDetectionPipeline
+{
+public:
+
+  DuoDetectionPipeline( DuoCalibrator& calibrator );
+
+  ~DuoDetectionPipeline();
+
+  //
+  // Copies the frame into the pending slot and returns its id (never blocks
+  // on detection)
+  //
+  uint64_t submit( const cv::Mat& left, const cv::Mat& right );
+
+  //
+  // Most recently completed detection, valid or not (points only, no images)
+  //
+  bool latest( DuoDetection& out ) const;
+
+  //
+  // Most recent detection with a full board in both views, including a copy
+  // of the frame it was found in
+  //
+  bool newestValid( DuoDetection& out ) const;
+
+  uint64_t getNumSkipped() const;
+
+  void stop();
+
+private:
+
+  void run();
+
+private:
+
+  DuoCalibrator&          m_calibrator;
+
+  mutable std::mutex      m_mutex;
+  std::condition_variable m_cv;
+  std::thread             m_worker;
+
+  bool                    m_stop;
+  bool                    m_hasPending;
+
+  uint64_t                m_nextId;
+  uint64_t                m_numSkipped;
+
+  //
+  // Frame handed over by the capture stage, and the one being processed.
+  // Their buffers are swapped rather than copied.
+  //
+  uint64_t                m_pendingId;
+  cv::Mat                 m_pendingL;
+  cv::Mat                 m_pendingR;
+
+  uint64_t                m_workId;
+  cv::Mat                 m_workL;
+  cv::Mat                 m_workR;
+
+  DuoDetection            m_latest;
+  DuoDetection            m_newestValid;
+};
+
+#endif // DUO_DETECTION_PIPELINE_H
@@ -0,0 +1,447 @@
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/imgproc.hpp>
+
+#include "DuoDisparity.h"
+#include "DuoProfiler.h"
+
+
+//
+// StereoBM needs larger blocks than SGBM to match reliably
+//
+static const int BM_BLOCK_SIZE = 9;
+
+//
+// Rows each strip is extended by above and below, so that the matching
+// costs of the SGBM paths have settled by the time they reach the rows the
+// strip owns. Strips are not made shorter than MIN_STRIP_ROWS, so an
+// interior strip matches at most 1.5 times the rows it owns.
+//
+static const int STRIP_OVERLAP  = 16;
+static const int MIN_STRIP_ROWS = 64;
+
+//
+// A band spans the disparities of the previous frame's matches in a strip,
+// but for BAND_PERCENTILE of them at either end, plus BAND_MARGIN px either
+// side for motion
+//
+static const double BAND_PERCENTILE = 0.01;
+static const int    BAND_MARGIN     = 4;
+
+//
+// Full search of a strip when fewer of its pixels than MIN_VALID_FRACTION
+// matched last frame, when a narrow search keeps less than MIN_KEPT_MATCHES
+// of those matches, or puts more than MAX_EDGE_FRACTION of them within a
+// pixel of a band edge that is not an end of the full range
+//
+static const double MIN_VALID_FRACTION = 0.1;
+static const double MIN_KEPT_MATCHES   = 0.85;
+static const double MAX_EDGE_FRACTION  = 0.05;
+
+static const int FULL_SEARCH_FRAMES = 30;
+
+
+DuoDisparity::DuoDisparity( const Algorithm algorithm )
+  : m_algorithm( algorithm )
+  , m_minDisparity( 0 )
+  , m_numDisparities( 48 )
+  , m_stale( true )
+  , m_temporal( false )
+  , m_hasPrevious( false )
+  , m_framesSinceFullSearch( 0 )
+  , m_searchFraction( 1.0 )
+  , m_numRematched( 0 )
+{
+}
+
+
+void DuoDisparity::setAlgorithm( const Algorithm algorithm )
+{
+  if( algorithm == m_algorithm ) return;
+
+  m_algorithm = algorithm;
+  m_stale     = true;
+}
+
+
+void DuoDisparity::setTemporal( const bool enable )
+{
+  if( enable == m_temporal ) return;
+
+  m_temporal = enable;
+  m_stale    = true;
+}
+
+
+void DuoDisparity::setRange( const int minDisparity, const int numDisparities )
+{
+  const int n = std::max( 16, ( numDisparities + 15 )/16*16 );
+
+  if( minDisparity == m_minDisparity && n == m_numDisparities ) return;
+
+  m_minDisparity   = minDisparity;
+  m_numDisparities = n;
+  m_stale          = true;
+}
+
+
+void DuoDisparity::setDepthRange( const double focalPx,
+                                  const double baseline,
+                                  const double minDepth,
+                                  const double maxDepth )
+{
+  //
+  // Disparity in px is focalPx*baseline/depth
+  //
+  const double fb = focalPx*std::abs( baseline );
+
+  if( fb <= 0.0 || minDepth <= 0.0 ) return;
+
+  const int minDisparity =
+      ( maxDepth > minDepth ) ? int( std::floor( fb/maxDepth ) ) : 0;
+
+  const int maxDisparity = int( std::ceil( fb/minDepth ) );
+
+  setRange( minDisparity, maxDisparity - minDisparity + 1 );
+}
+
+
+cv::Ptr<cv::StereoSGBM> DuoDisparity::createSgbm( const int mode ) const
+{
+  return cv::StereoSGBM::create( m_minDisparity,
+                                 m_numDisparities,
+                                 BLOCK_SIZE,
+                                 SGBM_P1,
+                                 SGBM_P2,
+                                 DISP12_MAX_DIFF,
+                                 PRE_FILTER_CAP,
+                                 UNIQUENESS_RATIO,
+                                 SPECKLE_WINDOW,
+                                 SPECKLE_RANGE,
+                                 mode );
+}
+
+
+//
+// Matchers and buffers for images of this size
+//
+void DuoDisparity::configure( const cv::Size& size )
+{
+  m_size  = size;
+  m_stale = false;
+
+  m_matcher = cv::Ptr<cv::StereoMatcher>();
+  m_strips.clear();
+
+  m_hasPrevious    = false;
+  m_searchFraction = 1.0;
+  m_numRematched   = 0;
+
+  switch( m_algorithm )
+  {
+    case ALGO_BM:
+    {
+      cv::Ptr<cv::StereoBM> bm = cv::StereoBM::create( m_numDisparities,
+                                                       BM_BLOCK_SIZE );
+      bm->setMinDisparity( m_minDisparity );
+      bm->setPreFilterCap( 31 );
+      bm->setTextureThreshold( 10 );
+      bm->setUniquenessRatio( 15 );
+      bm->setSpeckleWindowSize( SPECKLE_WINDOW );
+      bm->setSpeckleRange( SPECKLE_RANGE );
+      bm->setDisp12MaxDiff( DISP12_MAX_DIFF );
+
+      m_matcher = bm;
+      break;
+    }
+
+    case ALGO_SGBM:
+      m_matcher = createSgbm( cv::StereoSGBM::MODE_SGBM );
+      break;
+
+    case ALGO_SGBM_3WAY:
+      m_matcher = createSgbm( cv::StereoSGBM::MODE_SGBM_3WAY );
+      break;
+
+    case ALGO_HH:
+      m_matcher = createSgbm( cv::StereoSGBM::MODE_HH );
+      break;
+
+    case ALGO_SGBM_STRIPS:
+    {
+      //
+      // MODE_SGBM_3WAY is parallel within OpenCV already; the strips bring
+      // MODE_SGBM's 5 paths onto every core. Speckles are filtered once on
+      // the stitched result instead of in each strip, where a speckle that
+      // crosses a strip border would be judged on its parts.
+      // Temporal mode keeps the same strips. Shorter ones would follow the
+      // scene more closely, but their overlap rows and the rounding of each
+      // band to 16 disparities cost more than the narrower bands save.
+      //
+      const int numStrips =
+          std::max( 1, std::min( cv::getNumThreads(), size.height/MIN_STRIP_ROWS ) );
+
+      m_strips.resize( numStrips );
+
+      for( int i = 0; i < numStrips; ++i )
+      {
+        Strip& strip = m_strips[i];
+
+        const int y0 = size.height*i/numStrips;
+        const int y1 = size.height*( i + 1 )/numStrips;
+
+        strip.owned = cv::Range( y0, y1 );
+        strip.rows  = cv::Range( std::max( 0, y0 - STRIP_OVERLAP ),
+                                 std::min( size.height, y1 + STRIP_OVERLAP ) );
+
+        strip.matcher = createSgbm( cv::StereoSGBM::MODE_SGBM );
+        strip.matcher->setSpeckleWindowSize( 0 );
+        strip.disparity.create( strip.rows.size(), size.width, CV_16S );
+        strip.histogram.assign( m_numDisparities, 0 );
+        strip.validFraction = 0.0;
+        strip.searched      = m_numDisparities;
+        strip.rematched     = false;
+      }
+      break;
+    }
+  }
+}
+
+
+//
+// Band of the previous frame's matches in the strip, or false if the strip
+// needs a full search
+//
+bool DuoDisparity::narrowBand( Strip& strip,
+                               int& minDisparity,
+                               int& numDisparities ) const
+{
+  if( strip.validFraction < MIN_VALID_FRACTION ) return false;
+
+  const std::vector<int>& histogram = strip.histogram;
+
+  int total = 0;
+  for( const int n : histogram ) total += n;
+
+  const int skip = int( BAND_PERCENTILE*total );
+
+  int lo = 0;
+  for( int n = 0; lo < m_numDisparities - 1 && n + histogram[lo] <= skip; ++lo )
+    n += histogram[lo];
+
+  int hi = m_numDisparities - 1;
+  for( int n = 0; hi > lo && n + histogram[hi] <= skip; --hi )
+    n += histogram[hi];
+
+  const int first = m_minDisparity + lo - BAND_MARGIN;
+  const int last  = m_minDisparity + hi + BAND_MARGIN;
+
+  numDisparities = ( last - first + 16 )/16*16;
+
+  if( numDisparities >= m_numDisparities ) return false;
+
+  minDisparity = std::min( std::max( first, m_minDisparity ),
+                           m_minDisparity + m_numDisparities - numDisparities );
+
+  return true;
+}
+
+
+//
+// Whether a narrow search of the strip can stand: it kept the matches of the
+// previous frame, and they are not crowding a cut edge of the band
+//
+bool DuoDisparity::acceptBand( const Strip& strip,
+                               const int minDisparity,
+                               const int numDisparities ) const
+{
+  const int  top      = strip.owned.start - strip.rows.start;
+  const bool cutBelow = minDisparity > m_minDisparity;
+  const bool cutAbove = minDisparity + numDisparities < m_minDisparity + m_numDisparities;
+
+  const int first     = 16*minDisparity;
+  const int lowEdge   = 16*( minDisparity + 1 );
+  const int highEdge  = 16*( minDisparity + numDisparities - 2 );
+
+  int valid = 0;
+  int edge  = 0;
+
+  for( int y = top; y < top + strip.owned.size(); ++y )
+  {
+    const short* d = strip.disparity.ptr<short>( y );
+
+    for( int x = 0; x < strip.disparity.cols; ++x )
+    {
+      if( d[x] < first ) continue;
+
+      ++valid;
+
+      if( ( cutBelow && d[x] < lowEdge ) || ( cutAbove && d[x] >= highEdge ) )
+        ++edge;
+    }
+  }
+
+  const double numPixels = double( strip.owned.size() )*strip.disparity.cols;
+
+  return valid >= MIN_KEPT_MATCHES*strip.validFraction*numPixels &&
+         edge  <= MAX_EDGE_FRACTION*valid;
+}
+
+
+//
+// Copy the rows the strip owns into the result, away from its cut edges.
+// Pixels with no match in a band starting at minDisparity are marked as no
+// match of the full range, and the strip's histogram is updated for the
+// next frame's band.
+//
+void DuoDisparity::keepStrip( Strip& strip,
+                              const int minDisparity,
+                              cv::Mat& disparity )
+{
+  const int   top     = strip.owned.start - strip.rows.start;
+  const int   first   = 16*minDisparity;
+  const short invalid = short( 16*( m_minDisparity - 1 ) );
+
+  std::vector<int>& histogram = strip.histogram;
+  std::fill( histogram.begin(), histogram.end(), 0 );
+
+  int valid = 0;
+
+  for( int y = 0; y < strip.owned.size(); ++y )
+  {
+    const short* src = strip.disparity.ptr<short>( top + y );
+    short*       dst = disparity.ptr<short>( strip.owned.start + y );
+
+    for( int x = 0; x < disparity.cols; ++x )
+    {
+      if( src[x] < first )
+      {
+        dst[x] = invalid;
+        continue;
+      }
+
+      dst[x] = src[x];
+
+      ++valid;
+      ++histogram[std::min( ( src[x] >> 4 ) - m_minDisparity, m_numDisparities - 1 )];
+    }
+  }
+
+  strip.validFraction = double( valid )/( double( strip.owned.size() )*disparity.cols );
+}
+
+
+void DuoDisparity::computeStrips( const cv::Mat& left,
+                                  const cv::Mat& right,
+                                  cv::Mat& disparity )
+{
+  const bool fullSearch = !m_temporal || !m_hasPrevious ||
+                          ++m_framesSinceFullSearch >= FULL_SEARCH_FRAMES;
+
+  if( fullSearch ) m_framesSinceFullSearch = 0;
+
+  cv::parallel_for_( cv::Range( 0, int( m_strips.size() ) ),
+                     [&]( const cv::Range& range )
+  {
+    for( int i = range.start; i < range.end; ++i )
+    {
+      Strip& strip = m_strips[i];
+
+      auto match = [&]( const int minDisparity, const int numDisparities )
+      {
+        strip.matcher->setMinDisparity( minDisparity );
+        strip.matcher->setNumDisparities( numDisparities );
+        strip.matcher->compute( left.rowRange( strip.rows ),
+                                right.rowRange( strip.rows ),
+                                strip.disparity );
+        strip.searched += numDisparities;
+      };
+
+      int minDisparity   = m_minDisparity;
+      int numDisparities = m_numDisparities;
+
+      const bool narrow =
+          !fullSearch && narrowBand( strip, minDisparity, numDisparities );
+
+      strip.searched  = 0;
+      strip.rematched = false;
+
+      match( minDisparity, numDisparities );
+
+      if( narrow && !acceptBand( strip, minDisparity, numDisparities ) )
+      {
+        minDisparity   = m_minDisparity;
+        numDisparities = m_numDisparities;
+
+        match( minDisparity, numDisparities );
+
+        strip.rematched = true;
+      }
+
+      keepStrip( strip, minDisparity, disparity );
+    }
+  } );
+
+  cv::filterSpeckles( disparity,
+                      16*( m_minDisparity - 1 ),
+                      SPECKLE_WINDOW,
+                      16*SPECKLE_RANGE,
+                      m_speckleBuffer );
+
+  m_hasPrevious = m_temporal;
+
+  //
+  // Over the rows each strip matched, overlap included, as a full search of
+  // the same strips matches those too
+  //
+  double searched = 0.0;
+  double full     = 0.0;
+
+  m_numRematched = 0;
+
+  for( const Strip& strip : m_strips )
+  {
+    searched += double( strip.rows.size() )*strip.searched;
+    full     += double( strip.rows.size() )*m_numDisparities;
+
+    m_numRematched += strip.rematched ? 1 : 0;
+  }
+
+  m_searchFraction = searched/full;
+}
+
+
+void DuoDisparity::compute( const cv::Mat& left,
+                            const cv::Mat& right,
+                            cv::Mat& disparity )
+{
+  DUO_PROFILE_SCOPE( DUO_STAGE_SGBM );
+
+  if( m_stale || left.size() != m_size )
+    configure( left.size() );
+
+  if( m_algorithm == ALGO_SGBM_STRIPS )
+  {
+    disparity.create( left.size(), CV_16S );
+    computeStrips( left, right, disparity );
+  }
+  else
+  {
+    m_matcher->compute( left, right, disparity );
+  }
+}
+
+
+void DuoDisparity::colorize( const cv::Mat& disparity, cv::Mat& color )
+{
+  //
+  // minDisparity maps to 0 and the end of the range to 255; no match is
+  // below the range and saturates to 0
+  //
+  const double scale = 255.0/( 16.0*m_numDisparities );
+
+  disparity.convertTo( m_disparity8, CV_8U, scale, -scale*16.0*m_minDisparity );
+
+  cv::applyColorMap( m_disparity8, color, cv::COLORMAP_JET );
+}
@@ -0,0 +1,203 @@
+#ifndef DUO_DISPARITY_H
+#define DUO_DISPARITY_H
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+
+
+//
+// Disparity from a rectified stereo pair, with a choice of matcher.
+//
+// The matchers and their buffers are allocated on the first compute() at a
+// given size and reused after that; outputs go to buffers of the caller's.
+// The disparity is CV_16S in 1/16 px (cv::StereoMatcher's fixed point),
+// with (minDisparity - 1)*16 where there is no match.
+//
+// An instance is not shared between threads: each thread or pipeline stage
+// has its own, e.g. in a DuoDisparityContext.
+//
+class DuoDisparity
+{
+public:
+
+  enum Algorithm
+  {
+    ALGO_BM,          // cv::StereoBM: fastest, holes in low texture
+    ALGO_SGBM,        // cv::StereoSGBM MODE_SGBM, 5 paths
+    ALGO_SGBM_3WAY,   // cv::StereoSGBM MODE_SGBM_3WAY
+    ALGO_HH,          // cv::StereoSGBM MODE_HH, 8 paths, slowest
+    ALGO_SGBM_STRIPS  // MODE_SGBM, 5 paths, on overlapping horizontal
+                      // strips, one per core
+  };
+
+  DuoDisparity( const Algorithm algorithm = ALGO_SGBM_STRIPS );
+
+  void setAlgorithm( const Algorithm algorithm );
+
+  Algorithm getAlgorithm() const { return m_algorithm; }
+
+  //
+  // Disparities searched: minDisparity up to minDisparity + numDisparities,
+  // numDisparities being rounded up to a multiple of 16
+  //
+  void setRange( const int minDisparity, const int numDisparities );
+
+  //
+  // The range that covers depths from minDepth to maxDepth (no limit if
+  // maxDepth <= 0), for a rectified focal length in px and a baseline in the
+  // units of the depths
+  //
+  void setDepthRange( const double focalPx,
+                      const double baseline,
+                      const double minDepth,
+                      const double maxDepth );
+
+  int getMinDisparity()   const { return m_minDisparity; }
+  int getNumDisparities() const { return m_numDisparities; }
+
+  //
+  // Strips of the last ALGO_SGBM_STRIPS compute()
+  //
+  int getNumStrips() const { return int( m_strips.size() ); }
+
+  //
+  // Temporal mode, for ALGO_SGBM_STRIPS on a video stream: each strip only
+  // searches the band of disparities the previous frame found in it, plus a
+  // margin. A strip is searched over the whole range again when its band is
+  // unknown (too few matches last frame), when the narrow search loses
+  // matches the previous frame had, or when many matches pile up at the
+  // band's edges, i.e. the scene left the band. Every FULL_SEARCH_FRAMES
+  // frames all strips are searched in full.
+  //
+  void setTemporal( const bool enable );
+
+  bool getTemporal() const { return m_temporal; }
+
+  //
+  // Disparities searched by the last compute() relative to a full search of
+  // the same strips, counting the narrow searches that were rejected and
+  // matched again in full; above 1 if many were
+  //
+  double getSearchFraction() const { return m_searchFraction; }
+
+  //
+  // Strips of the last compute() whose narrow search was rejected
+  //
+  int getNumRematched() const { return m_numRematched; }
+
+  //
+  // Disparity of the left view of a rectified CV_8UC1 pair. disparity is
+  // allocated on the first call and reused after that.
+  //
+  void compute( const cv::Mat& left, const cv::Mat& right, cv::Mat& disparity );
+
+  //
+  // A disparity from compute() as a JET color image, near in red, likewise
+  // reused
+  //
+  void colorize( const cv::Mat& disparity, cv::Mat& color );
+
+  //
+  // Nearest depth covered by default, in baselines
+  //
+  static const int MIN_DEPTH_BASELINES = 5;
+
+  //
+  // Parameters of the semi-global matchers, for the 5x5 blocks used here
+  //
+  static const int BLOCK_SIZE        = 5;
+  static const int SGBM_P1           = 25;
+  static const int SGBM_P2           = 50;
+  static const int DISP12_MAX_DIFF   = 1;
+  static const int PRE_FILTER_CAP    = 63;
+  static const int UNIQUENESS_RATIO  = 40;
+  static const int SPECKLE_WINDOW    = 200;
+  static const int SPECKLE_RANGE     = 2;
+
+private:
+
+  void configure( const cv::Size& size );
+
+  cv::Ptr<cv::StereoSGBM> createSgbm( const int mode ) const;
+
+  void computeStrips( const cv::Mat& left, const cv::Mat& right, cv::Mat& disparity );
+
+  struct Strip;
+
+  bool narrowBand( Strip& strip, int& minDisparity, int& numDisparities ) const;
+
+  bool acceptBand( const Strip& strip,
+                   const int minDisparity,
+                   const int numDisparities ) const;
+
+  void keepStrip( Strip& strip, const int minDisparity, cv::Mat& disparity );
+
+private:
+
+  Algorithm                            m_algorithm;
+
+  int                                  m_minDisparity;
+  int                                  m_numDisparities;
+
+  //
+  // Matchers for the size they were configured for; set stale by any change
+  // of algorithm or range
+  //
+  cv::Size                             m_size;
+  bool                                 m_stale;
+
+  cv::Ptr<cv::StereoMatcher>           m_matcher;
+
+  //
+  // ALGO_SGBM_STRIPS: a matcher and an output buffer per strip
+  //
+  struct Strip
+  {
+    cv::Range               owned;     // rows of the result the strip sets
+    cv::Range               rows;      // rows it is matched on, overlapping
+                                       // its neighbours'
+    cv::Ptr<cv::StereoSGBM> matcher;
+    cv::Mat                 disparity; // rows x width
+
+    //
+    // Temporal mode: matches per disparity over the owned rows and their
+    // share of the owned pixels, of the last frame, the number of
+    // disparities searched, over both searches if the narrow one was
+    // rejected
+    //
+    std::vector<int>        histogram;
+    double                  validFraction;
+    int                     searched;
+    bool                    rematched;
+  };
+
+  std::vector<Strip>                   m_strips;
+
+  bool                                 m_temporal;
+  bool                                 m_hasPrevious;
+  int                                  m_framesSinceFullSearch;
+  double                               m_searchFraction;
+  int                                  m_numRematched;
+
+  cv::Mat                              m_speckleBuffer;
+  cv::Mat                              m_disparity8;
+};
+
+
+//
+// Everything one stream through the disparity path writes to: a matcher and
+// the buffers of each step, reused from frame to frame. One per thread or
+// pipeline stage; see DuoCalibrator::computeDisparity().
+//
+struct DuoDisparityContext
+{
+  DuoDisparity engine;
+  cv::Mat      left;       // views rectified at the disparity size
+  cv::Mat      right;
+  cv::Mat      disparity;  // CV_16S, see DuoDisparity
+  cv::Mat      color;      // colorized disparity
+};
+
+#endif // DUO_DISPARITY_H
@@ -0,0 +1,140 @@
+#ifndef DUO_FRAME_SOURCE_H
+#define DUO_FRAME_SOURCE_H
+
+#include <cstdint>
+#include <string>
+
+#include <opencv2/core.hpp>
+
+#include "DuoRecording.h"
+#include "DuoUtility.h"
+
+
+//
+// Where stereo frames come from: the DUO camera, a recording, or a synthetic
+// rig. grab() hands out 8-bit gray images that stay valid, and must not be
+// written to, until the next grab().
+//
+class DuoFrameSource
+{
+public:
+
+  virtual ~DuoFrameSource() {}
+
+  virtual cv::Size getSize() const = 0;
+
+  //
+  // Returns false if no frame is available (yet)
+  //
+  virtual bool grab( cv::Mat& left,
+                     cv::Mat& right,
+                     uint64_t& seq,
+                     uint32_t& timeStamp ) = 0;
+
+  //
+  // True once a finite source has handed out its last frame
+  //
+  virtual bool isFinished() const { return false; }
+
+  //
+  // Start over from the first frame, where that makes sense
+  //
+  virtual void rewind() {}
+};
+
+
+//
+// Live DUO camera, see OpenDUOCamera/AcquireDUOFrame
+//
+class DuoCameraSource : public DuoFrameSource
+{
+public:
+
+  DuoCameraSource( const cv::Size& size ) : m_size( size ) {}
+
+  ~DuoCameraSource()
+  {
+    m_frame.release();
+    CloseDUOCamera();
+  }
+
+  bool open( const float fps )
+  {
+    return OpenDUOCamera( m_size.width, m_size.height, fps );
+  }
+
+  cv::Size getSize() const { return m_size; }
+
+  bool grab( cv::Mat& left, cv::Mat& right, uint64_t& seq, uint32_t& timeStamp )
+  {
+    //
+    // The frame stays ours, and untouched by the callback, until released
+    //
+    if( !AcquireDUOFrame( m_frame, m_consumer ) ) return false;
+
+    left  = cv::Mat( m_size, CV_8U, (void*) m_frame.left()  );
+    right = cv::Mat( m_size, CV_8U, (void*) m_frame.right() );
+
+    seq       = m_frame.seq();
+    timeStamp = m_frame.timeStamp();
+
+    return true;
+  }
+
+  std::string getSerial() const { return GetDUOSerial(); }
+
+  //
+  // Frames captured while we were busy with earlier ones
+  //
+  uint64_t getNumMissed() const { return m_consumer.skipped; }
+
+private:
+
+  const cv::Size   m_size;
+
+  DUOFrameRef      m_frame;
+  DUOFrameConsumer m_consumer;
+};
+
+
+//
+// Recorded .duorec session
+//
+class DuoReplaySource : public DuoFrameSource
+{
+public:
+
+  DuoReplaySource() : m_finished( false ) {}
+
+  bool open( const std::string& path, const bool realTime )
+  {
+    m_replay.setRealTime( realTime );
+    m_finished = false;
+    return m_replay.open( path );
+  }
+
+  size_t getNumFrames() const { return m_replay.getNumFrames(); }
+
+  cv::Size getSize() const { return m_replay.getSize(); }
+
+  bool grab( cv::Mat& left, cv::Mat& right, uint64_t& seq, uint32_t& timeStamp )
+  {
+    m_finished = !m_replay.next( left, right, &seq, &timeStamp );
+    return !m_finished;
+  }
+
+  bool isFinished() const { return m_finished; }
+
+  void rewind()
+  {
+    m_replay.rewind();
+    m_finished = false;
+  }
+
+private:
+
+  DuoReplay m_replay;
+  bool      m_finished;
+};
+
+#endif // DUO_FRAME_SOURCE_H
@@ -0,0 +1,192 @@
+#include <opencv2/calib3d.hpp>
+
+#include "DuoIncrementalCalibrator.h"
+#include "DuoUtility.h"
+
+
+//
+// Fewer views than this leave the rational model's 8 distortion
+// coefficients poorly constrained, and the early estimates jump around
+//
+static const size_t MIN_VIEWS = 5;
+
+
+DuoIncrementalCalibrator::DuoIncrementalCalibrator( const cv::Size& imageSize )
+  : m_shared( std::make_shared<Shared>() )
+{
+  m_worker = std::thread( &DuoIncrementalCalibrator::run, m_shared, imageSize );
+}
+
+
+DuoIncrementalCalibrator::~DuoIncrementalCalibrator()
+{
+  stop();
+}
+
+
+void DuoIncrementalCalibrator::addView( const std::vector<cv::Point3f>& objectPts,
+                                        const std::vector<cv::Point2f>& leftPts,
+                                        const std::vector<cv::Point2f>& rightPts )
+{
+  std::unique_lock<std::mutex> lk( m_shared->mutex );
+
+  DuoViewStore& views = m_shared->views;
+
+  //
+  // The board is the same for every view
+  //
+  if( views.getBoard().empty() )
+    views.setBoard( objectPts );
+
+  if( views.add( leftPts, rightPts ) )
+    m_shared->cv.notify_one();
+}
+
+
+bool DuoIncrementalCalibrator::latest( DuoCalibrationEstimate& out ) const
+{
+  std::unique_lock<std::mutex> lk( m_shared->mutex );
+
+  const DuoCalibrationEstimate& latest = m_shared->latest;
+
+  if( latest.numViews == 0 ) return false;
+
+  out.numViews = latest.numViews;
+  out.errorL   = latest.errorL;
+  out.errorR   = latest.errorR;
+  out.errorX   = latest.errorX;
+  out.solveMs  = latest.solveMs;
+
+  latest.M1.copyTo( out.M1 );
+  latest.D1.copyTo( out.D1 );
+  latest.M2.copyTo( out.M2 );
+  latest.D2.copyTo( out.D2 );
+  latest.R.copyTo( out.R );
+  latest.T.copyTo( out.T );
+
+  return true;
+}
+
+
+void DuoIncrementalCalibrator::stop()
+{
+  {
+    std::unique_lock<std::mutex> lk( m_shared->mutex );
+    m_shared->stop = true;
+    m_shared->cv.notify_one();
+  }
+
+  if( m_worker.joinable() )
+    m_worker.detach();
+}
+
+
+void DuoIncrementalCalibrator::run( const std::shared_ptr<Shared> shared,
+                                    const cv::Size imageSize )
+{
+  DuoViewStore views;
+
+  std::vector<cv::Mat> objectPts;
+  std::vector<cv::Mat> imagePtsL;
+  std::vector<cv::Mat> imagePtsR;
+
+  //
+  // Running estimate, the starting point of the next solve
+  //
+  cv::Mat M1, D1, M2, D2, R, T, E, F;
+  bool    hasGuess = false;
+
+  std::vector<cv::Mat> rvecs;
+  std::vector<cv::Mat> tvecs;
+
+  //
+  // Warm-started solves only have to follow the new views, so they get
+  // fewer iterations than the final one in DuoCalibrator::solve
+  //
+  const auto termCrit =
+      cv::TermCriteria( cv::TermCriteria::COUNT + cv::TermCriteria::EPS,
+                        15,      // iterations
+                        1e-5 );  // change epsilon
+
+  while( true )
+  {
+    {
+      std::unique_lock<std::mutex> lk( shared->mutex );
+      shared->cv.wait( lk, [&] {
+        return shared->stop || ( shared->views.size() >= MIN_VIEWS &&
+                                 shared->views.size() > views.size() );
+      } );
+
+      if( shared->stop ) return;
+
+      //
+      // Views are only ever appended, so only the new ones are copied
+      //
+      if( views.empty() )
+        views.setBoard( shared->views.getBoard() );
+
+      for( size_t i = views.size(); i < shared->views.size(); ++i )
+        views.add( shared->views.left( i ), shared->views.right( i ) );
+    }
+
+    views.getArrays( objectPts, imagePtsL, imagePtsR );
+
+    const int64 start = cv::getTickCount();
+
+    const int guessFlag = hasGuess ? CV_CALIB_USE_INTRINSIC_GUESS : 0;
+
+    //
+    // Each camera on its own first: this is where the intrinsics converge,
+    // and stereoCalibrate only has to polish them
+    //
+    const double errorL =
+        cv::calibrateCamera( objectPts, imagePtsL, imageSize, M1, D1,
+                             rvecs, tvecs,
+                             CV_CALIB_RATIONAL_MODEL | guessFlag, termCrit );
+
+    const double errorR =
+        cv::calibrateCamera( objectPts, imagePtsR, imageSize, M2, D2,
+                             rvecs, tvecs,
+                             CV_CALIB_RATIONAL_MODEL | guessFlag, termCrit );
+
+    //
+    // Same model as the final solve. stereoCalibrate has no extrinsic
+    // guess; it re-initialises R and T from the per-view poses, which is
+    // cheap next to the joint refinement.
+    //
+    const double errorX =
+        cv::stereoCalibrate( objectPts, imagePtsL, imagePtsR,
+                             M1, D1, M2, D2,
+                             imageSize,
+                             R, T, E, F,
+                             CV_CALIB_RATIONAL_MODEL | CV_CALIB_SAME_FOCAL_LENGTH |
+                             CV_CALIB_USE_INTRINSIC_GUESS,
+                             termCrit );
+
+    hasGuess = true;
+
+    const double ms = TicksToMs( cv::getTickCount() - start );
+
+    std::unique_lock<std::mutex> lk( shared->mutex );
+
+    //
+    // Stopped during the solve: nobody is waiting for this one
+    //
+    if( shared->stop ) return;
+
+    DuoCalibrationEstimate& latest = shared->latest;
+
+    latest.numViews = views.size();
+    latest.errorL   = errorL;
+    latest.errorR   = errorR;
+    latest.errorX   = errorX;
+    latest.solveMs  = ms;
+
+    M1.copyTo( latest.M1 );
+    D1.copyTo( latest.D1 );
+    M2.copyTo( latest.M2 );
+    D2.copyTo( latest.D2 );
+    R.copyTo( latest.R );
+    T.copyTo( latest.T );
+  }
+}
@@ -0,0 +1,98 @@
+#ifndef DUO_INCREMENTAL_CALIBRATOR_H
+#define DUO_INCREMENTAL_CALIBRATOR_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "DuoViewStore.h"
+
+
+//
+// Provisional calibration from the views kept so far
+//
+struct DuoCalibrationEstimate
+{
+  DuoCalibrationEstimate()
+    : numViews( 0 ), errorL( 0.0 ), errorR( 0.0 ), errorX( 0.0 ), solveMs( 0.0 )
+  {}
+
+  size_t  numViews;   // 0 until the first solve has finished
+  double  errorL;     // RMS reprojection error of each camera alone, px
+  double  errorR;
+  double  errorX;     // RMS reprojection error of the stereo solve, px
+  double  solveMs;    // wall time of the last solve
+
+  cv::Mat M1;
+  cv::Mat D1;
+  cv::Mat M2;
+  cv::Mat D2;
+  cv::Mat R;
+  cv::Mat T;
+};
+
+
+//
+// Refines the calibration on a worker thread while views are being kept.
+//
+// Every time views have been added, the worker calibrates each camera on its
+// own and then solves the stereo pair, with the same model as
+// DuoCalibrator::solve. Each solve starts from the previous one's intrinsics
+// (CV_CALIB_USE_INTRINSIC_GUESS), so a new view only costs a few
+// iterations. Views added during a solve are picked up by the next one.
+//
+class DuoIncrementalCalibrator
+{
+public:
+
+  DuoIncrementalCalibrator( const cv::Size& imageSize );
+
+  ~DuoIncrementalCalibrator();
+
+  void addView( const std::vector<cv::Point3f>& objectPts,
+                const std::vector<cv::Point2f>& leftPts,
+                const std::vector<cv::Point2f>& rightPts );
+
+  //
+  // Most recent finished solve; false if there has been none yet
+  //
+  bool latest( DuoCalibrationEstimate& out ) const;
+
+  //
+  // Stops the worker without waiting for it. A solve in progress cannot be
+  // interrupted inside OpenCV, so it is left to finish on its own thread and
+  // its result is discarded; latest() keeps returning the previous one.
+  //
+  void stop();
+
+private:
+
+  //
+  // Everything the worker touches. The worker holds its own reference, so
+  // an abandoned solve can outlive the calibrator.
+  //
+  struct Shared
+  {
+    Shared() : stop( false ) {}
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    bool                    stop;
+    DuoViewStore            views;
+    DuoCalibrationEstimate  latest;
+  };
+
+  static void run( const std::shared_ptr<Shared> shared,
+                   const cv::Size imageSize );
+
+private:
+
+  std::shared_ptr<Shared>               m_shared;
+  std::thread                           m_worker;
+};
+
+#endif // DUO_INCREMENTAL_CALIBRATOR_H
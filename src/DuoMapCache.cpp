@@ -0,0 +1,193 @@
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include "DuoMapCache.h"
+
+
+static_assert( sizeof( DuoMapCacheHeader ) == 96, "DuoMapCacheHeader layout" );
+
+static const char DUOMAP_MAGIC[8] = "DUOMAP1";
+
+static const uint8_t ZEROS[8] = { 0 };
+
+
+static uint64_t padTo8( const uint64_t size )
+{
+  return ( size + 7 ) & ~uint64_t( 7 );
+}
+
+
+static void copyKey( char* dst, const size_t size, const std::string& src )
+{
+  memset( dst, 0, size );
+  strncpy( dst, src.c_str(), size - 1 );
+}
+
+
+//
+// Size and type of map i for the given rectified and disparity sizes
+//
+static void mapLayout( const int i,
+                       const cv::Size& size,
+                       const cv::Size& dispSize,
+                       cv::Size& sizeOut,
+                       int& typeOut )
+{
+  sizeOut = ( i < DUO_MAP_DISP_L1 ) ? size : dispSize;
+  typeOut = ( i % 2 == 0 ) ? CV_16SC2 : CV_16UC1;
+}
+
+
+bool DuoMapCache::open( const std::string& path,
+                        const std::string& serial,
+                        const std::string& dateTime,
+                        const cv::Size& size,
+                        const cv::Size& dispSize )
+{
+  close();
+
+  if( !m_file.open( path ) ) return false;
+
+  DuoMapCacheHeader header;
+  if( m_file.size() < sizeof( header ) )
+  {
+    close();
+    return false;
+  }
+
+  memcpy( &header, m_file.data(), sizeof( header ) );
+
+  DuoMapCacheHeader expected;
+  copyKey( expected.serial,   sizeof( expected.serial ),   serial );
+  copyKey( expected.dateTime, sizeof( expected.dateTime ), dateTime );
+
+  if( memcmp( header.magic, DUOMAP_MAGIC, sizeof( header.magic ) ) != 0 ||
+      header.version    != DUOMAP_VERSION ||
+      header.width      != uint32_t( size.width ) ||
+      header.height     != uint32_t( size.height ) ||
+      header.dispWidth  != uint32_t( dispSize.width ) ||
+      header.dispHeight != uint32_t( dispSize.height ) ||
+      memcmp( header.serial, expected.serial, sizeof( header.serial ) ) != 0 ||
+      memcmp( header.dateTime, expected.dateTime, sizeof( header.dateTime ) ) != 0 )
+  {
+    std::cout << path << " is not a map cache for this calibration\n";
+    close();
+    return false;
+  }
+
+  uint64_t offset = sizeof( header );
+
+  for( int i = 0; i < DUO_NUM_MAPS; ++i )
+  {
+    cv::Size mapSize;
+    int      type;
+    mapLayout( i, size, dispSize, mapSize, type );
+
+    const uint64_t bytes = uint64_t( mapSize.area() )*CV_ELEM_SIZE( type );
+
+    if( offset + bytes > m_file.size() )
+    {
+      std::cout << path << " is truncated\n";
+      close();
+      return false;
+    }
+
+    m_maps[i] = cv::Mat( mapSize, type, (void*) ( m_file.data() + offset ) );
+
+    offset += padTo8( bytes );
+  }
+
+  return true;
+}
+
+
+void DuoMapCache::close()
+{
+  for( int i = 0; i < DUO_NUM_MAPS; ++i )
+    m_maps[i].release();
+
+  m_file.close();
+}
+
+
+bool DuoMapCache::write( const std::string& path,
+                         const std::string& serial,
+                         const std::string& dateTime,
+                         const cv::Mat* maps )
+{
+  const std::string tmpPath = path + ".tmp";
+
+  FILE* file = fopen( tmpPath.c_str(), "wb" );
+  if( file == nullptr ) return false;
+
+  DuoMapCacheHeader header;
+  memset( &header, 0, sizeof( header ) );
+  memcpy( header.magic, DUOMAP_MAGIC, sizeof( header.magic ) );
+  header.version    = DUOMAP_VERSION;
+  header.width      = maps[DUO_MAP_L1].cols;
+  header.height     = maps[DUO_MAP_L1].rows;
+  header.dispWidth  = maps[DUO_MAP_DISP_L1].cols;
+  header.dispHeight = maps[DUO_MAP_DISP_L1].rows;
+  copyKey( header.serial,   sizeof( header.serial ),   serial );
+  copyKey( header.dateTime, sizeof( header.dateTime ), dateTime );
+
+  bool ok = fwrite( &header, sizeof( header ), 1, file ) == 1;
+
+  const cv::Size size( header.width, header.height );
+  const cv::Size dispSize( header.dispWidth, header.dispHeight );
+
+  for( int i = 0; i < DUO_NUM_MAPS && ok; ++i )
+  {
+    cv::Size mapSize;
+    int      type;
+    mapLayout( i, size, dispSize, mapSize, type );
+
+    if( maps[i].size() != mapSize || maps[i].type() != type ||
+        !maps[i].isContinuous() )
+    {
+      ok = false;
+      break;
+    }
+
+    const size_t bytes = maps[i].total()*maps[i].elemSize();
+
+    ok = fwrite( maps[i].data, 1, bytes, file ) == bytes &&
+         fwrite( ZEROS, 1, padTo8( bytes ) - bytes, file ) == padTo8( bytes ) - bytes;
+  }
+
+  ok = ( fclose( file ) == 0 ) && ok;
+
+  //
+  // rename() does not replace an existing file everywhere
+  //
+  if( ok )
+  {
+    remove( path.c_str() );
+    ok = rename( tmpPath.c_str(), path.c_str() ) == 0;
+  }
+
+  if( !ok )
+  {
+    std::cout << "Could not write map cache " << path << "\n";
+    remove( tmpPath.c_str() );
+  }
+
+  return ok;
+}
+
+
+std::string DuoMapCache::makePath( const std::string& dir,
+                                   const std::string& serial,
+                                   const std::string& dateTime,
+                                   const cv::Size& size )
+{
+  std::stringstream ss;
+  ss << dir << "rectifyMaps-"
+     << ( serial.empty() ? "unknown" : serial ) << "-"
+     << size.width << "x" << size.height << "-"
+     << dateTime << ".bin";
+
+  return ss.str();
+}
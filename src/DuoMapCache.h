@@ -0,0 +1,100 @@
+#ifndef DUO_MAP_CACHE_H
+#define DUO_MAP_CACHE_H
+
+#include <cstdint>
+#include <string>
+
+#include <opencv2/core.hpp>
+
+#include "DuoMappedFile.h"
+
+
+//
+// Binary cache of the undistort/rectify maps of a calibration (.bin),
+// little-endian:
+//
+//   DuoMapCacheHeader
+//   { map bytes, padding to 8 bytes } * DUO_NUM_MAPS, in DuoMapIndex order
+//
+// Maps are stored exactly as initUndistortRectifyMap makes them for
+// CV_16SC2: a CV_16SC2 map of integer coordinates and a CV_16UC1 map of
+// interpolation table indices per view. The header carries the key the
+// cache was written for, so a stale or foreign cache is never used.
+//
+struct DuoMapCacheHeader
+{
+  char     magic[8];    // "DUOMAP1"
+  uint32_t version;
+  uint32_t width;       // rectified image size
+  uint32_t height;
+  uint32_t dispWidth;   // disparity image size
+  uint32_t dispHeight;
+  uint32_t reserved;
+  char     serial[32];  // DUO serial number
+  char     dateTime[32];// calibration timestamp, as in the .yml files
+};
+
+const uint32_t DUOMAP_VERSION = 1;
+
+enum DuoMapIndex
+{
+  DUO_MAP_L1,           // left, full resolution
+  DUO_MAP_L2,
+  DUO_MAP_R1,           // right, full resolution
+  DUO_MAP_R2,
+  DUO_MAP_DISP_L1,      // left, raw to disparity resolution
+  DUO_MAP_DISP_L2,
+  DUO_MAP_DISP_R1,      // right, raw to disparity resolution
+  DUO_MAP_DISP_R2,
+  DUO_NUM_MAPS
+};
+
+
+//
+// Memory-mapped map cache. The maps are cv::Mat headers onto the mapping,
+// valid while the cache is open, and must not be written to.
+//
+class DuoMapCache
+{
+public:
+
+  //
+  // Opens the cache if it exists and matches the key
+  //
+  bool open( const std::string& path,
+             const std::string& serial,
+             const std::string& dateTime,
+             const cv::Size& size,
+             const cv::Size& dispSize );
+
+  void close();
+
+  bool isOpen() const { return m_file.isOpen(); }
+
+  const cv::Mat& getMap( const DuoMapIndex i ) const { return m_maps[i]; }
+
+  //
+  // Write maps[DUO_NUM_MAPS] to path, through a temporary file so that a
+  // reader never sees a partial cache
+  //
+  static bool write( const std::string& path,
+                     const std::string& serial,
+                     const std::string& dateTime,
+                     const cv::Mat* maps );
+
+  //
+  // <dir>rectifyMaps-<serial>-<w>x<h>-<dateTime>.bin, dir being the
+  // directory the calibration's .yml files are in
+  //
+  static std::string makePath( const std::string& dir,
+                               const std::string& serial,
+                               const std::string& dateTime,
+                               const cv::Size& size );
+
+private:
+
+  DuoMappedFile m_file;
+  cv::Mat       m_maps[DUO_NUM_MAPS];
+};
+
+#endif // DUO_MAP_CACHE_H
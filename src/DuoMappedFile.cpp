@@ -0,0 +1,87 @@
+#include <fstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "DuoMappedFile.h"
+
+
+DuoMappedFile::DuoMappedFile()
+  : m_data( nullptr )
+  , m_size( 0 )
+  , m_fd( -1 )
+{}
+
+
+DuoMappedFile::~DuoMappedFile()
+{
+  close();
+}
+
+
+bool DuoMappedFile::open( const std::string& path )
+{
+  close();
+
+#ifndef _WIN32
+  m_fd = ::open( path.c_str(), O_RDONLY );
+  if( m_fd < 0 ) return false;
+
+  struct stat st;
+  if( fstat( m_fd, &st ) != 0 || st.st_size <= 0 )
+  {
+    close();
+    return false;
+  }
+
+  void* ptr = mmap( nullptr, st.st_size, PROT_READ, MAP_SHARED, m_fd, 0 );
+  if( ptr == MAP_FAILED )
+  {
+    close();
+    return false;
+  }
+
+  m_data = static_cast<const uint8_t*>( ptr );
+  m_size = st.st_size;
+#else
+  std::ifstream in( path.c_str(), std::ios::binary | std::ios::ate );
+  if( !in ) return false;
+
+  m_buffer.resize( size_t( in.tellg() ) );
+  in.seekg( 0 );
+  in.read( (char*) m_buffer.data(), m_buffer.size() );
+
+  if( !in || m_buffer.empty() )
+  {
+    m_buffer.clear();
+    return false;
+  }
+
+  m_data = m_buffer.data();
+  m_size = m_buffer.size();
+#endif
+
+  return true;
+}
+
+
+void DuoMappedFile::close()
+{
+#ifndef _WIN32
+  if( m_data != nullptr )
+    munmap( (void*) m_data, m_size );
+
+  if( m_fd >= 0 )
+    ::close( m_fd );
+#endif
+
+  m_buffer.clear();
+
+  m_data = nullptr;
+  m_size = 0;
+  m_fd   = -1;
+}
@@ -0,0 +1,46 @@
+#ifndef DUO_MAPPED_FILE_H
+#define DUO_MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+//
+// Read-only view of a whole file. On POSIX systems the file is memory-mapped,
+// so nothing is read until it is touched; elsewhere it is read into memory.
+//
+class DuoMappedFile
+{
+public:
+
+  DuoMappedFile();
+
+  ~DuoMappedFile();
+
+  bool open( const std::string& path );
+
+  void close();
+
+  bool isOpen() const { return m_data != nullptr; }
+
+  const uint8_t* data() const { return m_data; }
+
+  size_t size() const { return m_size; }
+
+private:
+
+  DuoMappedFile( const DuoMappedFile& );
+  DuoMappedFile& operator=( const DuoMappedFile& );
+
+private:
+
+  const uint8_t*       m_data;
+  size_t               m_size;
+
+  int                  m_fd;
+  std::vector<uint8_t> m_buffer;
+};
+
+#endif // DUO_MAPPED_FILE_H
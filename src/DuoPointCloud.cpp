@@ -0,0 +1,256 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include <opencv2/calib3d.hpp>
+
+#include "DuoPointCloud.h"
+#include "DuoProfiler.h"
+
+
+static_assert( sizeof( DuoCloudFileHeader )  == 32, "DuoCloudFileHeader layout" );
+static_assert( sizeof( DuoCloudFrameHeader ) == 24, "DuoCloudFrameHeader layout" );
+
+static const char DUOPTS_MAGIC[8] = "DUOPTS1";
+
+static const uint8_t ZEROS[8] = { 0 };
+
+
+static uint64_t padTo8( const uint64_t size )
+{
+  return ( size + 7 ) & ~uint64_t( 7 );
+}
+
+
+DuoPointCloud::DuoPointCloud()
+  : m_step( 1 )
+  , m_minDepth( 0.0 )
+  , m_maxDepth( 0.0 )
+  , m_numPoints( 0 )
+{
+}
+
+
+void DuoPointCloud::setDecimation( const int step )
+{
+  m_step = std::max( 1, step );
+}
+
+
+void DuoPointCloud::setDepthRange( const double minDepth, const double maxDepth )
+{
+  m_minDepth = minDepth;
+  m_maxDepth = maxDepth;
+}
+
+
+size_t DuoPointCloud::compute( const cv::Mat& disparity,
+                               const int minDisparity,
+                               const cv::Mat& Q,
+                               const cv::Mat& intensity )
+{
+  DUO_PROFILE_SCOPE( DUO_STAGE_CLOUD );
+
+  const cv::Size size( ( disparity.cols + m_step - 1 )/m_step,
+                       ( disparity.rows + m_step - 1 )/m_step );
+
+  const bool hasIntensity = intensity.size() == disparity.size();
+
+  //
+  // Nearest sampling: averaging disparities across an edge would make up
+  // points between the surfaces
+  //
+  m_decimated.create( size, CV_16S );
+  m_intensity.create( size, CV_8U );
+
+  for( int y = 0; y < size.height; ++y )
+  {
+    const short* src = disparity.ptr<short>( y*m_step );
+    short*       dst = m_decimated.ptr<short>( y );
+
+    const uchar* srcI = hasIntensity ? intensity.ptr<uchar>( y*m_step ) : nullptr;
+    uchar*       dstI = m_intensity.ptr<uchar>( y );
+
+    for( int x = 0; x < size.width; ++x )
+    {
+      dst[x]  = src[x*m_step];
+      dstI[x] = hasIntensity ? srcI[x*m_step] : 255;
+    }
+  }
+
+  //
+  // Q takes disparity-image pixels and disparities in px. Scaled by
+  // diag( s, s, 1/16, 1 ) it takes the decimated pixels and the raw 1/16 px
+  // disparities as they are.
+  //
+  const cv::Matx44d S( m_step, 0,      0,          0,
+                       0,      m_step, 0,          0,
+                       0,      0,      1.0/16.0,   0,
+                       0,      0,      0,          1 );
+
+  const cv::Matx44d Qs = cv::Matx44d( Q.ptr<double>() )*S;
+
+  cv::reprojectImageTo3D( m_decimated, m_xyz, Qs, false, CV_32F );
+
+  if( m_points.size() != size_t( size.area() ) )
+    m_points.resize( size.area() );
+
+  const short  first    = short( std::max( 1, 16*minDisparity ) );
+  const double maxDepth = ( m_maxDepth > 0.0 ) ? m_maxDepth : 1e30;
+
+  m_numPoints = 0;
+
+  for( int y = 0; y < size.height; ++y )
+  {
+    const short*     d   = m_decimated.ptr<short>( y );
+    const cv::Vec3f* xyz = m_xyz.ptr<cv::Vec3f>( y );
+    const uchar*     I   = m_intensity.ptr<uchar>( y );
+
+    for( int x = 0; x < size.width; ++x )
+    {
+      if( d[x] < first ) continue;
+
+      const float z = xyz[x][2];
+
+      if( z < m_minDepth || z > maxDepth ) continue;
+
+      DuoPoint& p = m_points[m_numPoints++];
+      p.x         = xyz[x][0];
+      p.y         = xyz[x][1];
+      p.z         = z;
+      p.intensity = I[x];
+    }
+  }
+
+  return m_numPoints;
+}
+
+
+void DuoPointCloud::getRecords( std::vector<uint8_t>& records ) const
+{
+  records.resize( getRecordsSize() );
+
+  uint8_t* record = records.data();
+
+  for( size_t i = 0; i < m_numPoints; ++i )
+  {
+    const DuoPoint& p = m_points[i];
+
+    memcpy( record,     &p.x, 4 );
+    memcpy( record + 4, &p.y, 4 );
+    memcpy( record + 8, &p.z, 4 );
+    record[12] = p.intensity;
+
+    record += DUOPTS_RECORD_SIZE;
+  }
+}
+
+
+bool DuoPointCloud::writePly( const std::string& path ) const
+{
+  FILE* file = fopen( path.c_str(), "wb" );
+  if( file == nullptr ) return false;
+
+  fprintf( file,
+           "ply\n"
+           "format binary_little_endian 1.0\n"
+           "comment calibDuo point cloud\n"
+           "element vertex %lu\n"
+           "property float x\n"
+           "property float y\n"
+           "property float z\n"
+           "property uchar intensity\n"
+           "end_header\n",
+           static_cast<unsigned long>( m_numPoints ) );
+
+  std::vector<uint8_t> records;
+  getRecords( records );
+
+  const bool ok = fwrite( records.data(), 1, records.size(), file ) == records.size();
+
+  fclose( file );
+
+  return ok;
+}
+
+
+DuoPointCloudWriter::DuoPointCloudWriter()
+  : m_file( nullptr )
+  , m_numFrames( 0 )
+{
+}
+
+
+DuoPointCloudWriter::~DuoPointCloudWriter()
+{
+  close();
+}
+
+
+bool DuoPointCloudWriter::open( const std::string& path )
+{
+  close();
+
+  m_file = fopen( path.c_str(), "wb" );
+  if( m_file == nullptr ) return false;
+
+  m_numFrames = 0;
+
+  DuoCloudFileHeader header;
+  memset( &header, 0, sizeof( header ) );
+  memcpy( header.magic, DUOPTS_MAGIC, sizeof( header.magic ) );
+  header.version    = DUOPTS_VERSION;
+  header.recordSize = DUOPTS_RECORD_SIZE;
+
+  return writeBytes( &header, sizeof( header ) );
+}
+
+
+bool DuoPointCloudWriter::write( const DuoPointCloud& cloud,
+                                 const uint64_t seq,
+                                 const uint32_t timeStamp )
+{
+  if( m_file == nullptr ) return false;
+
+  DuoCloudFrameHeader header;
+  memset( &header, 0, sizeof( header ) );
+  header.magic     = DUOPTS_FRAME_MAGIC;
+  header.numPoints = uint32_t( cloud.getNumPoints() );
+  header.seq       = seq;
+  header.timeStamp = timeStamp;
+
+  cloud.getRecords( m_records );
+
+  const uint64_t payload = m_records.size();
+
+  const bool ok = writeBytes( &header, sizeof( header ) ) &&
+                  writeBytes( m_records.data(), payload ) &&
+                  writeBytes( ZEROS, padTo8( payload ) - payload );
+
+  if( ok ) ++m_numFrames;
+
+  return ok;
+}
+
+
+void DuoPointCloudWriter::close()
+{
+  if( m_file == nullptr ) return;
+
+  fclose( m_file );
+  m_file = nullptr;
+}
+
+
+bool DuoPointCloudWriter::writeBytes( const void* data, size_t size )
+{
+  if( size == 0 ) return true;
+
+  if( fwrite( data, 1, size, m_file ) != size )
+  {
+    std::cout << "Point cloud write failed\n";
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,165 @@
+#ifndef DUO_POINT_CLOUD_H
+#define DUO_POINT_CLOUD_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+
+//
+// Point cloud stream (.duopts), little-endian, append-only:
+//
+//   DuoCloudFileHeader
+//   { DuoCloudFrameHeader, DuoPoint records, padding to 8 bytes } * N
+//
+// A DuoPoint record is DUOPTS_RECORD_SIZE bytes, packed: x, y, z as float in
+// the units of the calibration's square length, in the rectified left
+// camera's frame, then the left view's intensity as a byte. The PLY files
+// of DuoPointCloud::writePly hold the same records.
+//
+struct DuoCloudFileHeader
+{
+  char     magic[8];    // "DUOPTS1"
+  uint32_t version;
+  uint32_t recordSize;  // DUOPTS_RECORD_SIZE
+  uint32_t reserved[4];
+};
+
+struct DuoCloudFrameHeader
+{
+  uint32_t magic;       // DUOPTS_FRAME_MAGIC
+  uint32_t numPoints;
+  uint64_t seq;         // capture sequence number
+  uint32_t timeStamp;   // DUOFrame::timeStamp (100 us ticks)
+  uint32_t reserved;
+};
+
+const uint32_t DUOPTS_VERSION     = 1;
+const uint32_t DUOPTS_FRAME_MAGIC = 0x30535450; // "PTS0"
+const uint32_t DUOPTS_RECORD_SIZE = 13;
+
+
+struct DuoPoint
+{
+  float   x;
+  float   y;
+  float   z;
+  uint8_t intensity;
+};
+
+
+//
+// Metric points from a disparity image, for every decimation-th pixel in
+// each direction that has a match and lies within the depth range.
+//
+// Buffers are sized on the first compute() at a given disparity size and
+// reused after that, so a stream of frames allocates nothing.
+//
+class DuoPointCloud
+{
+public:
+
+  DuoPointCloud();
+
+  //
+  // Reproject every step-th pixel of every step-th row
+  //
+  void setDecimation( const int step );
+
+  int getDecimation() const { return m_step; }
+
+  //
+  // Depths kept, in the units of the square length; maxDepth <= 0 for no
+  // limit
+  //
+  void setDepthRange( const double minDepth, const double maxDepth );
+
+  //
+  // Points of a CV_16S disparity from DuoDisparity (1/16 px, below
+  // 16*minDisparity where there is no match) with the disparity-to-depth
+  // matrix in its pixels, DuoCalibrator::getDisparityQ(). intensity, if
+  // given, is the rectified left view at the disparity's size.
+  // Returns the number of points.
+  //
+  size_t compute( const cv::Mat& disparity,
+                  const int minDisparity,
+                  const cv::Mat& Q,
+                  const cv::Mat& intensity = cv::Mat() );
+
+  //
+  // Points of the last compute(), the first getNumPoints() of them valid
+  //
+  const std::vector<DuoPoint>& getPoints() const { return m_points; }
+
+  size_t getNumPoints() const { return m_numPoints; }
+
+  //
+  // The last compute() as packed DuoPoint records, into records, which is
+  // resized to getRecordsSize()
+  //
+  void getRecords( std::vector<uint8_t>& records ) const;
+
+  size_t getRecordsSize() const { return m_numPoints*DUOPTS_RECORD_SIZE; }
+
+  //
+  // The last compute() as a binary PLY file
+  //
+  bool writePly( const std::string& path ) const;
+
+private:
+
+  int                   m_step;
+  double                m_minDepth;
+  double                m_maxDepth;
+
+  cv::Mat               m_decimated;  // disparity, every m_step-th pixel
+  cv::Mat               m_intensity;  // the same of the intensity image
+  cv::Mat               m_xyz;        // CV_32FC3 reprojection of m_decimated
+
+  std::vector<DuoPoint> m_points;
+  size_t                m_numPoints;
+};
+
+
+//
+// Appends point clouds to a .duopts file
+//
+class DuoPointCloudWriter
+{
+public:
+
+  DuoPointCloudWriter();
+
+  ~DuoPointCloudWriter();
+
+  bool open( const std::string& path );
+
+  bool write( const DuoPointCloud& cloud,
+              const uint64_t seq,
+              const uint32_t timeStamp );
+
+  void close();
+
+  bool isOpen() const { return m_file != nullptr; }
+
+  size_t getNumFrames() const { return m_numFrames; }
+
+private:
+
+  bool writeBytes( const void* data, size_t size );
+
+private:
+
+  FILE*                m_file;
+  size_t               m_numFrames;
+
+  //
+  // Packed records of the frame being written, reused from frame to frame
+  //
+  std::vector<uint8_t> m_records;
+};
+
+#endif // DUO_POINT_CLOUD_H
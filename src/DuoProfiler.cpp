@@ -0,0 +1,257 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+#include "DuoProfiler.h"
+#include "DuoUtility.h"
+
+
+//
+// Histograms of one thread, one per stage
+//
+struct DuoThreadProfile
+{
+  DuoHistogram histograms[DUO_NUM_STAGES];
+};
+
+
+//
+// Every thread that ever recorded a sample. Profiles are never freed, as
+// OpenCV's worker threads live as long as the process anyway; the mutex is
+// only taken when a thread records its first sample and when reading.
+//
+struct DuoProfileRegistry
+{
+  std::mutex                                    mutex;
+  std::deque<std::unique_ptr<DuoThreadProfile>> profiles;
+};
+
+static DuoProfileRegistry& getRegistry()
+{
+  static DuoProfileRegistry registry;
+  return registry;
+}
+
+static thread_local DuoThreadProfile* t_profile = nullptr;
+
+
+static const char* STAGE_NAMES[DUO_NUM_STAGES] =
+{
+  "frame",
+  "capture",
+  "detect",
+  "subpix",
+  "cvtColor",
+  "draw",
+  "rectify",
+  "sgbm",
+  "cloud",
+  "imshow"
+};
+
+
+void DuoHistogram::add( const int64 ticks )
+{
+  static const double usPerTick = 1e6/cv::getTickFrequency();
+
+  const double us = ticks*usPerTick;
+
+  int i = 0;
+  if( us >= 1.0 )
+    i = std::min( int( 4.0*std::log2( us ) ) + 1, NUM_BUCKETS - 1 );
+
+  buckets[i].store( buckets[i].load( std::memory_order_relaxed ) + 1,
+                    std::memory_order_relaxed );
+
+  sumTicks.store( sumTicks.load( std::memory_order_relaxed ) + ticks,
+                  std::memory_order_relaxed );
+
+  if( ticks > maxTicks.load( std::memory_order_relaxed ) )
+    maxTicks.store( ticks, std::memory_order_relaxed );
+
+  //
+  // Count last, so a reader never sees more samples than bucket entries
+  //
+  count.store( count.load( std::memory_order_relaxed ) + 1,
+               std::memory_order_release );
+}
+
+
+double DuoHistogram::bucketLowerMs( const int i )
+{
+  return ( i == 0 ) ? 0.0 : 1e-3*std::pow( 2.0, ( i - 1 )/4.0 );
+}
+
+
+double DuoHistogram::bucketUpperMs( const int i )
+{
+  return 1e-3*std::pow( 2.0, i/4.0 );
+}
+
+
+const char* DuoProfiler::stageName( const DuoStage stage )
+{
+  return STAGE_NAMES[stage];
+}
+
+
+void DuoProfiler::record( const DuoStage stage, const int64 ticks )
+{
+  if( t_profile == nullptr )
+  {
+    DuoProfileRegistry& registry = getRegistry();
+
+    std::lock_guard<std::mutex> lk( registry.mutex );
+    registry.profiles.emplace_back( new DuoThreadProfile() );
+    t_profile = registry.profiles.back().get();
+  }
+
+  t_profile->histograms[stage].add( ticks );
+}
+
+
+DuoStageStats DuoProfiler::getStats( const DuoStage stage )
+{
+  uint64_t buckets[DuoHistogram::NUM_BUCKETS] = { 0 };
+
+  DuoStageStats stats;
+  int64         sumTicks = 0;
+  int64         maxTicks = 0;
+
+  {
+    DuoProfileRegistry& registry = getRegistry();
+
+    std::lock_guard<std::mutex> lk( registry.mutex );
+
+    for( const auto& profile : registry.profiles )
+    {
+      const DuoHistogram& h = profile->histograms[stage];
+
+      stats.count += h.count.load( std::memory_order_acquire );
+      sumTicks    += h.sumTicks.load( std::memory_order_relaxed );
+      maxTicks     = std::max( maxTicks,
+                               int64( h.maxTicks.load( std::memory_order_relaxed ) ) );
+
+      for( int i = 0; i < DuoHistogram::NUM_BUCKETS; ++i )
+        buckets[i] += h.buckets[i].load( std::memory_order_relaxed );
+    }
+  }
+
+  if( stats.count == 0 ) return stats;
+
+  stats.meanMs = TicksToMs( sumTicks )/stats.count;
+  stats.maxMs  = TicksToMs( maxTicks );
+
+  //
+  // Percentiles to the upper bound of their bucket, about 19% resolution
+  //
+  const double targets[3] = { 0.50, 0.90, 0.99 };
+  double*      results[3] = { &stats.p50Ms, &stats.p90Ms, &stats.p99Ms };
+
+  for( int p = 0; p < 3; ++p )
+  {
+    const uint64_t rank = uint64_t( std::ceil( targets[p]*stats.count ) );
+
+    uint64_t seen = 0;
+    for( int i = 0; i < DuoHistogram::NUM_BUCKETS; ++i )
+    {
+      seen += buckets[i];
+      if( seen >= rank )
+      {
+        *results[p] = std::min( DuoHistogram::bucketUpperMs( i ), stats.maxMs );
+        break;
+      }
+    }
+  }
+
+  return stats;
+}
+
+
+std::string DuoProfiler::summary( const DuoStage* stages, const int numStages )
+{
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision( 1 );
+
+  for( int i = 0; i < numStages; ++i )
+  {
+    const DuoStageStats stats = getStats( stages[i] );
+
+    if( i > 0 ) ss << "  ";
+    ss << stageName( stages[i] ) << " "
+       << stats.p50Ms << "/" << stats.p99Ms;
+  }
+
+  return ss.str();
+}
+
+
+bool DuoProfiler::writeCsv( const std::string& path )
+{
+  FILE* file = fopen( path.c_str(), "w" );
+  if( file == nullptr ) return false;
+
+  fprintf( file, "stage,thread,lower_ms,upper_ms,count\n" );
+
+  DuoProfileRegistry& registry = getRegistry();
+
+  std::lock_guard<std::mutex> lk( registry.mutex );
+
+  for( int s = 0; s < DUO_NUM_STAGES; ++s )
+  {
+    for( size_t t = 0; t < registry.profiles.size(); ++t )
+    {
+      const DuoHistogram& h = registry.profiles[t]->histograms[s];
+
+      for( int i = 0; i < DuoHistogram::NUM_BUCKETS; ++i )
+      {
+        const uint64_t n = h.buckets[i].load( std::memory_order_relaxed );
+        if( n == 0 ) continue;
+
+        fprintf( file, "%s,%d,%.6f,%.6f,%llu\n",
+                 STAGE_NAMES[s], int( t ),
+                 DuoHistogram::bucketLowerMs( i ),
+                 DuoHistogram::bucketUpperMs( i ),
+                 (unsigned long long) n );
+      }
+    }
+  }
+
+  fclose( file );
+
+  return true;
+}
+
+
+void DuoProfiler::print()
+{
+  std::cout << std::left  << std::setw( 10 ) << "stage"
+            << std::right << std::setw( 10 ) << "count"
+            << std::setw( 10 ) << "mean ms"
+            << std::setw( 10 ) << "p50 ms"
+            << std::setw( 10 ) << "p90 ms"
+            << std::setw( 10 ) << "p99 ms"
+            << std::setw( 10 ) << "max ms" << "\n";
+
+  std::cout << std::fixed << std::setprecision( 2 );
+
+  for( int s = 0; s < DUO_NUM_STAGES; ++s )
+  {
+    const DuoStageStats stats = getStats( DuoStage( s ) );
+    if( stats.count == 0 ) continue;
+
+    std::cout << std::left  << std::setw( 10 ) << STAGE_NAMES[s]
+              << std::right << std::setw( 10 ) << stats.count
+              << std::setw( 10 ) << stats.meanMs
+              << std::setw( 10 ) << stats.p50Ms
+              << std::setw( 10 ) << stats.p90Ms
+              << std::setw( 10 ) << stats.p99Ms
+              << std::setw( 10 ) << stats.maxMs << "\n";
+  }
+}
@@ -0,0 +1,189 @@
+#ifndef DUO_PROFILER_H
+#define DUO_PROFILER_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include <opencv2/core.hpp>
+
+
+//
+// Hot-path instrumentation.
+//
+// DUO_PROFILE_SCOPE( stage ) times the rest of the enclosing scope into a
+// latency histogram for that stage. Every thread records into histograms of
+// its own, so recording takes no lock and never contends; the histograms of
+// all threads are merged only when statistics are read.
+//
+// Without DUO_PROFILE defined (see calibDuo.pro) the macro expands to
+// nothing and none of this is compiled in.
+//
+enum DuoStage
+{
+  DUO_STAGE_FRAME,         // one iteration of a main loop
+  DUO_STAGE_CAPTURE_WAIT,  // waiting for the next frame from the source
+  DUO_STAGE_DETECT,        // board detection, both views
+  DUO_STAGE_SUBPIX,        // sub-pixel corner refinement, both views
+  DUO_STAGE_CVT_COLOR,     // gray to BGR for display
+  DUO_STAGE_DRAW,          // corners, lines and text overlays
+  DUO_STAGE_RECTIFY,       // undistortAndRectify, both views
+  DUO_STAGE_SGBM,          // StereoSGBM::compute
+  DUO_STAGE_CLOUD,         // reprojection to a point cloud
+  DUO_STAGE_IMSHOW,        // imshow and waitKey
+  DUO_NUM_STAGES
+};
+
+
+//
+// Log-scaled histogram with 4 buckets per octave from 1 us to about 14 s.
+// Only its owning thread writes to it; other threads may read it at any
+// time, which is why the counters are atomics.
+//
+struct DuoHistogram
+{
+  static const int NUM_BUCKETS = 96;
+
+  DuoHistogram()
+  {
+    for( int i = 0; i < NUM_BUCKETS; ++i ) buckets[i] = 0;
+    count    = 0;
+    sumTicks = 0;
+    maxTicks = 0;
+  }
+
+  //
+  // Owner thread only: plain load/store, no read-modify-write
+  //
+  void add( const int64 ticks );
+
+  //
+  // Bucket bounds in ms
+  //
+  static double bucketLowerMs( const int i );
+  static double bucketUpperMs( const int i );
+
+  std::atomic<uint64_t> buckets[NUM_BUCKETS];
+  std::atomic<uint64_t> count;
+  std::atomic<int64_t>  sumTicks;
+  std::atomic<int64_t>  maxTicks;
+};
+
+
+//
+// Summary of a stage over all threads, in ms
+//
+struct DuoStageStats
+{
+  DuoStageStats()
+    : count( 0 ), meanMs( 0.0 ), p50Ms( 0.0 ), p90Ms( 0.0 ), p99Ms( 0.0 )
+    , maxMs( 0.0 )
+  {}
+
+  uint64_t count;
+  double   meanMs;
+  double   p50Ms;
+  double   p90Ms;
+  double   p99Ms;
+  double   maxMs;
+};
+
+
+class DuoProfiler
+{
+public:
+
+  static const char* stageName( const DuoStage stage );
+
+  //
+  // Record one sample for the calling thread
+  //
+  static void record( const DuoStage stage, const int64 ticks );
+
+  static DuoStageStats getStats( const DuoStage stage );
+
+  //
+  // "name p50/p99" for each of the given stages, for the display overlay
+  //
+  static std::string summary( const DuoStage* stages, const int numStages );
+
+  //
+  // Histograms of every thread, one row per non-empty bucket:
+  //   stage,thread,lower_ms,upper_ms,count
+  //
+  static bool writeCsv( const std::string& path );
+
+  //
+  // Per-stage summary table on stdout
+  //
+  static void print();
+};
+
+
+class DuoScopedTimer
+{
+public:
+
+  explicit DuoScopedTimer( const DuoStage stage )
+    : m_stage( stage )
+    , m_start( cv::getTickCount() )
+  {}
+
+  ~DuoScopedTimer()
+  {
+    DuoProfiler::record( m_stage, cv::getTickCount() - m_start );
+  }
+
+private:
+
+  const DuoStage m_stage;
+  const int64    m_start;
+};
+
+
+//
+// Loop rate over the last second
+//
+class DuoRateMeter
+{
+public:
+
+  DuoRateMeter() : m_count( 0 ), m_start( cv::getTickCount() ), m_rate( 0.0 )
+  {}
+
+  void tick()
+  {
+    ++m_count;
+
+    const double seconds =
+        double( cv::getTickCount() - m_start )/cv::getTickFrequency();
+
+    if( seconds >= 1.0 )
+    {
+      m_rate  = m_count/seconds;
+      m_count = 0;
+      m_start = cv::getTickCount();
+    }
+  }
+
+  double rate() const { return m_rate; }
+
+private:
+
+  int    m_count;
+  int64  m_start;
+  double m_rate;
+};
+
+
+#define DUO_PROFILE_CONCAT_( a, b ) a##b
+#define DUO_PROFILE_CONCAT( a, b )  DUO_PROFILE_CONCAT_( a, b )
+
+#ifdef DUO_PROFILE
+#define DUO_PROFILE_SCOPE( stage ) \
+  DuoScopedTimer DUO_PROFILE_CONCAT( duoScopedTimer, __LINE__ )( stage )
+#else
+#define DUO_PROFILE_SCOPE( stage )
+#endif
+
+#endif // DUO_PROFILER_H
@@ -0,0 +1,397 @@
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include <opencv2/imgcodecs.hpp>
+
+#include "DuoRecording.h"
+
+
+static_assert( sizeof( DuoRecFileHeader )  == 32, "DuoRecFileHeader layout" );
+static_assert( sizeof( DuoRecFrameHeader ) == 32, "DuoRecFrameHeader layout" );
+static_assert( sizeof( DuoRecFooter )      == 24, "DuoRecFooter layout" );
+
+static const char DUOREC_MAGIC[8] = "DUOREC1";
+
+static const uint8_t ZEROS[8] = { 0 };
+
+
+static uint64_t padTo8( const uint64_t size )
+{
+  return ( size + 7 ) & ~uint64_t( 7 );
+}
+
+
+DuoRecorder::DuoRecorder()
+  : m_file( nullptr )
+  , m_offset( 0 )
+  , m_compress( false )
+{
+  m_pngParams.push_back( cv::IMWRITE_PNG_COMPRESSION );
+  m_pngParams.push_back( 1 );
+  m_pngParams.push_back( cv::IMWRITE_PNG_STRATEGY );
+  m_pngParams.push_back( cv::IMWRITE_PNG_STRATEGY_RLE );
+}
+
+
+DuoRecorder::~DuoRecorder()
+{
+  close();
+}
+
+
+bool DuoRecorder::open( const std::string& path,
+                        const cv::Size& size,
+                        bool compress )
+{
+  close();
+
+  m_file = fopen( path.c_str(), "wb" );
+  if( m_file == nullptr ) return false;
+
+  m_offset   = 0;
+  m_compress = compress;
+  m_size     = size;
+  m_index.clear();
+
+  DuoRecFileHeader header;
+  memset( &header, 0, sizeof( header ) );
+  memcpy( header.magic, DUOREC_MAGIC, sizeof( header.magic ) );
+  header.version = DUOREC_VERSION;
+  header.width   = size.width;
+  header.height  = size.height;
+
+  return writeBytes( &header, sizeof( header ) );
+}
+
+
+bool DuoRecorder::write( const cv::Mat& left,
+                         const cv::Mat& right,
+                         const uint64_t seq,
+                         const uint32_t timeStamp )
+{
+  if( m_file == nullptr ) return false;
+
+  if( left.size() != m_size || right.size() != m_size ||
+      left.type() != CV_8U  || right.type() != CV_8U )
+    return false;
+
+  DuoRecFrameHeader header;
+  memset( &header, 0, sizeof( header ) );
+  header.magic     = DUOREC_FRAME_MAGIC;
+  header.seq       = seq;
+  header.timeStamp = timeStamp;
+
+  const uint8_t* dataL = left.data;
+  const uint8_t* dataR = right.data;
+
+  if( m_compress )
+  {
+    cv::imencode( ".png", left,  m_bufL, m_pngParams );
+    cv::imencode( ".png", right, m_bufR, m_pngParams );
+
+    header.codec = DUOREC_PNG;
+    header.sizeL = m_bufL.size();
+    header.sizeR = m_bufR.size();
+
+    dataL = m_bufL.data();
+    dataR = m_bufR.data();
+  }
+  else
+  {
+    header.codec = DUOREC_RAW;
+    header.sizeL = m_size.area();
+    header.sizeR = m_size.area();
+
+    if( !left.isContinuous() || !right.isContinuous() )
+    {
+      m_bufL.assign( left.begin<uchar>(),  left.end<uchar>()  );
+      m_bufR.assign( right.begin<uchar>(), right.end<uchar>() );
+
+      dataL = m_bufL.data();
+      dataR = m_bufR.data();
+    }
+  }
+
+  const uint64_t start   = m_offset;
+  const uint64_t payload = uint64_t( header.sizeL ) + header.sizeR;
+
+  const bool ok = writeBytes( &header, sizeof( header ) ) &&
+                  writeBytes( dataL, header.sizeL ) &&
+                  writeBytes( dataR, header.sizeR ) &&
+                  writeBytes( ZEROS, padTo8( payload ) - payload );
+
+  if( ok )
+    m_index.push_back( start );
+
+  return ok;
+}
+
+
+void DuoRecorder::close()
+{
+  if( m_file == nullptr ) return;
+
+  DuoRecFooter footer;
+  memset( &footer, 0, sizeof( footer ) );
+  footer.magic       = DUOREC_INDEX_MAGIC;
+  footer.numFrames   = m_index.size();
+  footer.indexOffset = m_offset;
+
+  writeBytes( m_index.data(), m_index.size()*sizeof( uint64_t ) );
+  writeBytes( &footer, sizeof( footer ) );
+
+  fclose( m_file );
+  m_file = nullptr;
+}
+
+
+bool DuoRecorder::writeBytes( const void* data, size_t size )
+{
+  if( size == 0 ) return true;
+
+  if( fwrite( data, 1, size, m_file ) != size )
+  {
+    std::cout << "Recording write failed\n";
+    return false;
+  }
+
+  m_offset += size;
+  return true;
+}
+
+
+DuoReplay::DuoReplay()
+  : m_next( 0 )
+  , m_realTime( true )
+  , m_startStamp( 0 )
+{}
+
+
+bool DuoReplay::open( const std::string& path )
+{
+  close();
+
+  if( !m_file.open( path ) ) return false;
+
+  DuoRecFileHeader header;
+  if( m_file.size() < sizeof( header ) )
+  {
+    close();
+    return false;
+  }
+
+  memcpy( &header, m_file.data(), sizeof( header ) );
+
+  if( memcmp( header.magic, DUOREC_MAGIC, sizeof( header.magic ) ) != 0 ||
+      header.version != DUOREC_VERSION )
+  {
+    std::cout << path << " is not a DUO recording\n";
+    close();
+    return false;
+  }
+
+  m_size = cv::Size( header.width, header.height );
+
+  //
+  // Use the index if the recorder got to close the file
+  //
+  DuoRecFooter footer;
+  memset( &footer, 0, sizeof( footer ) );
+
+  if( m_file.size() >= sizeof( header ) + sizeof( footer ) )
+  {
+    memcpy( &footer,
+            m_file.data() + m_file.size() - sizeof( footer ),
+            sizeof( footer ) );
+  }
+
+  //
+  // The footer and every entry of the index are checked against the file's
+  // size, so that a damaged index cannot point past the end of the mapping.
+  // numFrames is bounded before it is multiplied, so the sum cannot wrap.
+  //
+  const uint64_t size = m_file.size();
+
+  bool indexOk =
+      footer.magic == DUOREC_INDEX_MAGIC &&
+      footer.indexOffset >= sizeof( header ) &&
+      footer.indexOffset <= size - sizeof( footer ) &&
+      footer.numFrames <= ( size - sizeof( footer ) - footer.indexOffset )/sizeof( uint64_t ) &&
+      footer.indexOffset + footer.numFrames*sizeof( uint64_t ) +
+      sizeof( footer ) == size;
+
+  if( indexOk )
+  {
+    m_index.resize( footer.numFrames );
+    memcpy( m_index.data(),
+            m_file.data() + footer.indexOffset,
+            footer.numFrames*sizeof( uint64_t ) );
+
+    for( const uint64_t offset : m_index )
+    {
+      if( !frameFits( offset ) )
+      {
+        std::cout << "Ignoring the damaged index of " << path << "\n";
+        indexOk = false;
+        break;
+      }
+    }
+  }
+
+  if( !indexOk && !rebuildIndex() )
+  {
+    close();
+    return false;
+  }
+
+  m_next = 0;
+
+  return true;
+}
+
+
+void DuoReplay::close()
+{
+  m_file.close();
+  m_index.clear();
+  m_next = 0;
+}
+
+
+//
+// Walk the frame records of a recording that was not closed properly. A
+// truncated last frame is dropped.
+//
+bool DuoReplay::rebuildIndex()
+{
+  m_index.clear();
+
+  uint64_t offset = sizeof( DuoRecFileHeader );
+
+  while( offset + sizeof( DuoRecFrameHeader ) <= m_file.size() )
+  {
+    DuoRecFrameHeader header;
+    memcpy( &header, m_file.data() + offset, sizeof( header ) );
+
+    if( header.magic != DUOREC_FRAME_MAGIC ) break;
+
+    const uint64_t next =
+        offset + sizeof( header ) + padTo8( uint64_t( header.sizeL ) +
+                                            header.sizeR );
+    if( next > m_file.size() ) break;
+
+    m_index.push_back( offset );
+    offset = next;
+  }
+
+  std::cout << "Recording has no index, recovered "
+            << m_index.size() << " frames\n";
+
+  return !m_index.empty();
+}
+
+
+bool DuoReplay::frameFits( const uint64_t offset ) const
+{
+  const uint64_t size = m_file.size();
+
+  if( offset < sizeof( DuoRecFileHeader ) ||
+      size < sizeof( DuoRecFrameHeader ) ||
+      offset > size - sizeof( DuoRecFrameHeader ) )
+    return false;
+
+  DuoRecFrameHeader header;
+  memcpy( &header, m_file.data() + offset, sizeof( header ) );
+
+  return header.magic == DUOREC_FRAME_MAGIC &&
+         uint64_t( header.sizeL ) + header.sizeR <=
+           size - offset - sizeof( header );
+}
+
+
+bool DuoReplay::decode( const uint32_t codec,
+                        const uint8_t* data,
+                        const uint32_t size,
+                        cv::Mat& buffer,
+                        cv::Mat& out )
+{
+  if( codec == DUOREC_RAW )
+  {
+    if( size != uint32_t( m_size.area() ) ) return false;
+
+    out = cv::Mat( m_size, CV_8U, (void*) data );
+    return true;
+  }
+
+  if( codec == DUOREC_PNG )
+  {
+    const cv::Mat encoded( 1, size, CV_8U, (void*) data );
+    cv::imdecode( encoded, cv::IMREAD_GRAYSCALE, &buffer );
+
+    out = buffer;
+    return buffer.size() == m_size;
+  }
+
+  return false;
+}
+
+
+bool DuoReplay::getFrame( const size_t i,
+                          cv::Mat& left,
+                          cv::Mat& right,
+                          uint64_t* seq,
+                          uint32_t* timeStamp )
+{
+  if( i >= m_index.size() || !frameFits( m_index[i] ) ) return false;
+
+  DuoRecFrameHeader header;
+  memcpy( &header, m_file.data() + m_index[i], sizeof( header ) );
+
+  if( header.magic != DUOREC_FRAME_MAGIC ) return false;
+
+  const uint8_t* dataL = m_file.data() + m_index[i] + sizeof( header );
+  const uint8_t* dataR = dataL + header.sizeL;
+
+  if( !decode( header.codec, dataL, header.sizeL, m_decodedL, left ) ||
+      !decode( header.codec, dataR, header.sizeR, m_decodedR, right ) )
+    return false;
+
+  if( seq )       *seq       = header.seq;
+  if( timeStamp ) *timeStamp = header.timeStamp;
+
+  return true;
+}
+
+
+bool DuoReplay::next( cv::Mat& left,
+                      cv::Mat& right,
+                      uint64_t* seq,
+                      uint32_t* timeStamp )
+{
+  uint32_t stamp = 0;
+
+  if( !getFrame( m_next, left, right, seq, &stamp ) ) return false;
+
+  if( timeStamp ) *timeStamp = stamp;
+
+  if( m_next == 0 )
+  {
+    m_startTime  = std::chrono::steady_clock::now();
+    m_startStamp = stamp;
+  }
+  else if( m_realTime )
+  {
+    //
+    // Unsigned difference copes with the timestamp wrapping around
+    //
+    const double seconds = uint32_t( stamp - m_startStamp )/DUO_TIMESTAMP_HZ;
+
+    std::this_thread::sleep_until(
+        m_startTime + std::chrono::microseconds( int64_t( seconds*1e6 ) ) );
+  }
+
+  ++m_next;
+
+  return true;
+}
@@ -0,0 +1,188 @@
+#ifndef DUO_RECORDING_H
+#define DUO_RECORDING_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "DuoMappedFile.h"
+
+
+//
+// Stereo recording container (.duorec), little-endian, append-only:
+//
+//   DuoRecFileHeader
+//   { DuoRecFrameHeader, left bytes, right bytes, padding to 8 bytes } * N
+//   uint64_t frame offsets * N              (written on close)
+//   DuoRecFooter                            (written on close)
+//
+// A recording that was never closed has no index; it is rebuilt by walking
+// the frame headers when the file is opened for replay.
+//
+struct DuoRecFileHeader
+{
+  char     magic[8];    // "DUOREC1"
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t reserved[3];
+};
+
+struct DuoRecFrameHeader
+{
+  uint32_t magic;       // DUOREC_FRAME_MAGIC
+  uint32_t codec;       // DUOREC_RAW or DUOREC_PNG
+  uint64_t seq;         // capture sequence number
+  uint32_t timeStamp;   // DUOFrame::timeStamp (100 us ticks)
+  uint32_t sizeL;       // bytes of left image data
+  uint32_t sizeR;       // bytes of right image data
+  uint32_t reserved;
+};
+
+struct DuoRecFooter
+{
+  uint32_t magic;       // DUOREC_INDEX_MAGIC
+  uint32_t reserved;
+  uint64_t numFrames;
+  uint64_t indexOffset;
+};
+
+const uint32_t DUOREC_VERSION     = 1;
+const uint32_t DUOREC_FRAME_MAGIC = 0x304d5246; // "FRM0"
+const uint32_t DUOREC_INDEX_MAGIC = 0x30584449; // "IDX0"
+const uint32_t DUOREC_RAW         = 0;          // 8-bit gray, row-major
+const uint32_t DUOREC_PNG         = 1;          // lossless, RLE strategy
+
+const double DUO_TIMESTAMP_HZ = 10000.0;        // DUOFrame::timeStamp rate
+
+
+//
+// Appends stereo frames to a .duorec file
+//
+class DuoRecorder
+{
+public:
+
+  DuoRecorder();
+
+  ~DuoRecorder();
+
+  //
+  // compress: store frames as PNG (fast RLE deflate) instead of raw bytes
+  //
+  bool open( const std::string& path, const cv::Size& size, bool compress );
+
+  bool write( const cv::Mat& left,
+              const cv::Mat& right,
+              const uint64_t seq,
+              const uint32_t timeStamp );
+
+  //
+  // Writes the index and footer
+  //
+  void close();
+
+  bool isOpen() const { return m_file != nullptr; }
+
+  size_t getNumFrames() const { return m_index.size(); }
+
+private:
+
+  bool writeBytes( const void* data, size_t size );
+
+private:
+
+  FILE*                 m_file;
+  uint64_t              m_offset;
+  bool                  m_compress;
+  cv::Size              m_size;
+
+  std::vector<uint64_t> m_index;
+
+  std::vector<uchar>    m_bufL;
+  std::vector<uchar>    m_bufR;
+  std::vector<int>      m_pngParams;
+};
+
+
+//
+// Plays a .duorec file back from a memory map. Raw frames are handed out
+// without a copy, as cv::Mat headers onto the mapping; they must be treated
+// as read-only and are valid until the replay is closed. Compressed frames
+// are decoded into buffers that are reused from frame to frame.
+//
+class DuoReplay
+{
+public:
+
+  DuoReplay();
+
+  bool open( const std::string& path );
+
+  void close();
+
+  bool isOpen() const { return m_file.isOpen(); }
+
+  size_t getNumFrames() const { return m_index.size(); }
+
+  cv::Size getSize() const { return m_size; }
+
+  //
+  // Random access
+  //
+  bool getFrame( const size_t i,
+                 cv::Mat& left,
+                 cv::Mat& right,
+                 uint64_t* seq = nullptr,
+                 uint32_t* timeStamp = nullptr );
+
+  //
+  // Sequential playback. In real time mode next() sleeps so that frames are
+  // returned at the pace they were recorded at; otherwise as fast as
+  // possible. Returns false at the end of the recording.
+  //
+  void setRealTime( bool realTime ) { m_realTime = realTime; }
+
+  bool next( cv::Mat& left,
+             cv::Mat& right,
+             uint64_t* seq = nullptr,
+             uint32_t* timeStamp = nullptr );
+
+  void rewind() { m_next = 0; }
+
+private:
+
+  bool rebuildIndex();
+
+  //
+  // Whether a frame record at offset, with its images, lies in the file
+  //
+  bool frameFits( const uint64_t offset ) const;
+
+  bool decode( const uint32_t codec,
+               const uint8_t* data,
+               const uint32_t size,
+               cv::Mat& buffer,
+               cv::Mat& out );
+
+private:
+
+  DuoMappedFile         m_file;
+  cv::Size              m_size;
+  std::vector<uint64_t> m_index;
+
+  size_t                m_next;
+  bool                  m_realTime;
+
+  std::chrono::steady_clock::time_point m_startTime;
+  uint32_t                              m_startStamp;
+
+  cv::Mat               m_decodedL;
+  cv::Mat               m_decodedR;
+};
+
+#endif // DUO_RECORDING_H
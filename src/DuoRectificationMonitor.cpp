@@ -0,0 +1,312 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include <opencv2/features2d.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "DuoRectificationMonitor.h"
+
+
+//
+// Weight of a new measurement in driftPx, i.e. it follows over about ten
+// samples, so a single bad one does not raise the alert
+//
+static const double DRIFT_SMOOTHING = 0.1;
+
+//
+// The alert is cleared below this fraction of the threshold
+//
+static const double ALERT_HYSTERESIS = 0.8;
+
+//
+// Offsets within this of their median are inliers; a mismatched pair is
+// almost always further off
+//
+static const double INLIER_PX = 1.5;
+
+
+//
+// CPU time of the calling thread, in ms. The budget is a share of a core,
+// which wall time overstates whenever the thread is preempted. Work that
+// OpenCV hands to its own threads is not included.
+//
+static double threadCpuMs()
+{
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if( !GetThreadTimes( GetCurrentThread(), &creation, &exit, &kernel, &user ) )
+    return 0.0;
+
+  const uint64_t ticks =
+      ( ( uint64_t( kernel.dwHighDateTime ) << 32 ) | kernel.dwLowDateTime ) +
+      ( ( uint64_t( user.dwHighDateTime )   << 32 ) | user.dwLowDateTime );
+
+  return 1e-4*ticks; // 100 ns ticks
+#else
+  timespec ts;
+  if( clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts ) != 0 ) return 0.0;
+
+  return 1e3*ts.tv_sec + 1e-6*ts.tv_nsec;
+#endif
+}
+
+
+static double median( std::vector<double> values )
+{
+  std::nth_element( values.begin(),
+                    values.begin() + values.size()/2,
+                    values.end() );
+
+  return values[values.size()/2];
+}
+
+
+//
+// Vertical offsets of the features matched between a rectified pair.
+// FAST corners are at whole pixels, so the matched ones are refined to
+// sub-pixel before the offsets are taken.
+//
+struct DuoMonitorMatcher
+{
+  DuoMonitorMatcher()
+    : orb( cv::ORB::create( DuoRectificationMonitor::MAX_FEATURES,
+                            1.2f,
+                            1 ) ) // one level: rectified views share a scale
+    , matcher( cv::NORM_HAMMING, true )
+  {}
+
+  void match( const cv::Mat& left, const cv::Mat& right )
+  {
+    orb->detectAndCompute( left,  cv::noArray(), keysL, descL );
+    orb->detectAndCompute( right, cv::noArray(), keysR, descR );
+
+    ptsL.clear();
+    ptsR.clear();
+    offsets.clear();
+
+    if( descL.empty() || descR.empty() ) return;
+
+    matcher.match( descL, descR, matches );
+
+    //
+    // Cross-checked matches in front of the rig, within the searched band
+    //
+    for( const cv::DMatch& m : matches )
+    {
+      const cv::Point2f& pL = keysL[m.queryIdx].pt;
+      const cv::Point2f& pR = keysR[m.trainIdx].pt;
+
+      if( m.distance > DuoRectificationMonitor::MAX_HAMMING ||
+          pL.x < pR.x ||
+          std::abs( pR.y - pL.y ) > DuoRectificationMonitor::MAX_VERTICAL_PX )
+        continue;
+
+      ptsL.push_back( pL );
+      ptsR.push_back( pR );
+    }
+
+    if( ptsL.empty() ) return;
+
+    const auto termCrit =
+        cv::TermCriteria( cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS,
+                          10, 0.01 );
+
+    cv::cornerSubPix( left,  ptsL, cv::Size( 3, 3 ), cv::Size( -1, -1 ), termCrit );
+    cv::cornerSubPix( right, ptsR, cv::Size( 3, 3 ), cv::Size( -1, -1 ), termCrit );
+
+    for( size_t i = 0; i < ptsL.size(); ++i )
+      offsets.push_back( ptsR[i].y - ptsL[i].y );
+  }
+
+  cv::Ptr<cv::ORB>          orb;
+  cv::BFMatcher             matcher;
+
+  std::vector<cv::KeyPoint> keysL;
+  std::vector<cv::KeyPoint> keysR;
+  cv::Mat                   descL;
+  cv::Mat                   descR;
+  std::vector<cv::DMatch>   matches;
+
+  std::vector<cv::Point2f>  ptsL;
+  std::vector<cv::Point2f>  ptsR;
+  std::vector<double>       offsets;
+};
+
+
+DuoRectificationMonitor::DuoRectificationMonitor( const double thresholdPx,
+                                                  const double cpuBudget,
+                                                  const int interval )
+  : m_thresholdPx( thresholdPx )
+  , m_cpuBudget( std::min( std::max( cpuBudget, 0.001 ), 1.0 ) )
+  , m_interval( std::max( interval, 1 ) )
+  , m_stop( false )
+  , m_hasPending( false )
+  , m_busy( false )
+  , m_framesSinceSample( 0 )
+  , m_nextSample( Clock::now() )
+  , m_firstSample( Clock::now() )
+  , m_busyMs( 0.0 )
+{
+  m_worker = std::thread( &DuoRectificationMonitor::run, this );
+}
+
+
+DuoRectificationMonitor::~DuoRectificationMonitor()
+{
+  stop();
+}
+
+
+bool DuoRectificationMonitor::submit( const cv::Mat& left,
+                                      const cv::Mat& right )
+{
+  if( ++m_framesSinceSample < m_interval ) return false;
+
+  std::unique_lock<std::mutex> lk( m_mutex );
+
+  if( m_busy || m_hasPending || Clock::now() < m_nextSample ) return false;
+
+  if( m_busyMs == 0.0 )
+    m_firstSample = Clock::now();
+
+  //
+  // copyTo reuses the pending buffers once they have the right size. The
+  // copies are part of the monitor's cost, though the caller's thread pays.
+  //
+  const double start = threadCpuMs();
+
+  left.copyTo( m_pendingL );
+  right.copyTo( m_pendingR );
+
+  m_busyMs += threadCpuMs() - start;
+
+  m_framesSinceSample = 0;
+  m_hasPending        = true;
+
+  m_cv.notify_one();
+
+  return true;
+}
+
+
+bool DuoRectificationMonitor::latest( DuoRectificationQuality& out ) const
+{
+  std::unique_lock<std::mutex> lk( m_mutex );
+
+  if( m_latest.numSamples == 0 ) return false;
+
+  out = m_latest;
+
+  return true;
+}
+
+
+void DuoRectificationMonitor::stop()
+{
+  {
+    std::unique_lock<std::mutex> lk( m_mutex );
+    m_stop = true;
+    m_cv.notify_one();
+  }
+
+  if( m_worker.joinable() )
+    m_worker.join();
+}
+
+
+void DuoRectificationMonitor::run()
+{
+  DuoMonitorMatcher matcher;
+
+  std::vector<double> inliers;
+
+  while( true )
+  {
+    {
+      std::unique_lock<std::mutex> lk( m_mutex );
+      m_cv.wait( lk, [this] { return m_stop || m_hasPending; } );
+
+      if( m_stop ) return;
+
+      cv::swap( m_pendingL, m_workL );
+      cv::swap( m_pendingR, m_workR );
+      m_hasPending = false;
+      m_busy       = true;
+    }
+
+    const double start = threadCpuMs();
+
+    matcher.match( m_workL, m_workR );
+
+    //
+    // Mean and RMS of the offsets near their median
+    //
+    inliers.clear();
+
+    if( !matcher.offsets.empty() )
+    {
+      const double med = median( matcher.offsets );
+
+      for( const double dy : matcher.offsets )
+        if( std::abs( dy - med ) <= INLIER_PX ) inliers.push_back( dy );
+    }
+
+    double sum   = 0.0;
+    double sumSq = 0.0;
+
+    for( const double dy : inliers )
+    {
+      sum   += dy;
+      sumSq += dy*dy;
+    }
+
+    const double ms = threadCpuMs() - start;
+
+    std::unique_lock<std::mutex> lk( m_mutex );
+
+    m_busy    = false;
+    m_busyMs += ms;
+
+    //
+    // Stay within the budget: idle for the measurement's time over the
+    // budget before sampling again
+    //
+    m_nextSample = Clock::now() +
+                   std::chrono::microseconds(
+                     int64_t( 1000.0*ms*( 1.0/m_cpuBudget - 1.0 ) ) );
+
+    if( int( inliers.size() ) < MIN_MATCHES ) continue;
+
+    const double n = double( inliers.size() );
+
+    m_latest.numMatches = int( inliers.size() );
+    m_latest.offsetPx   = sum/n;
+    m_latest.residualPx = std::sqrt( sumSq/n );
+    m_latest.sampleMs   = ms;
+
+    if( m_latest.numSamples == 0 )
+      m_latest.driftPx = m_latest.residualPx;
+    else
+      m_latest.driftPx += DRIFT_SMOOTHING*( m_latest.residualPx - m_latest.driftPx );
+
+    ++m_latest.numSamples;
+
+    if( m_latest.driftPx > m_thresholdPx )
+      m_latest.alert = true;
+    else if( m_latest.driftPx < ALERT_HYSTERESIS*m_thresholdPx )
+      m_latest.alert = false;
+
+    const double elapsedMs =
+        std::chrono::duration<double, std::milli>( Clock::now() - m_firstSample ).count();
+
+    m_latest.cpuFraction = ( elapsedMs > 0.0 ) ? m_busyMs/elapsedMs : 0.0;
+  }
+}
@@ -0,0 +1,124 @@
+#ifndef DUO_RECTIFICATION_MONITOR_H
+#define DUO_RECTIFICATION_MONITOR_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include <opencv2/core.hpp>
+
+
+//
+// Rectification quality from the vertical offsets of features matched
+// between the rectified views, which are zero for a rig that still matches
+// its calibration
+//
+struct DuoRectificationQuality
+{
+  DuoRectificationQuality()
+    : numSamples( 0 ), numMatches( 0 ), offsetPx( 0.0 ), residualPx( 0.0 ),
+      driftPx( 0.0 ), sampleMs( 0.0 ), cpuFraction( 0.0 ), alert( false )
+  {}
+
+  uint64_t numSamples;  // frame pairs measured so far
+  int      numMatches;  // matches the last measurement used
+  double   offsetPx;    // mean vertical offset, right minus left, px
+  double   residualPx;  // RMS vertical offset, px
+  double   driftPx;     // residualPx smoothed over the measurements
+  double   sampleMs;    // CPU time the last measurement took
+  double   cpuFraction; // share of one core used since the first sample,
+                        // by the measurements and submit()'s copies
+  bool     alert;       // driftPx went past the threshold
+};
+
+const double DUO_MONITOR_THRESHOLD_PX = 0.5;
+const double DUO_MONITOR_CPU_BUDGET   = 0.05;
+const int    DUO_MONITOR_INTERVAL     = 30;
+
+
+//
+// Watches the rectification of a calibrated stream on a worker thread, so
+// that a mount that has shifted is noticed without stopping the stream.
+//
+// The rectify loop submit()s every frame pair, which costs nothing unless a
+// sample is due: at most every interval frames, and only once the worker
+// has been idle long enough to stay within its budget of one core. Features
+// are matched between the sampled views and the RMS of their vertical
+// offsets is smoothed over the samples; the alert is raised when it passes
+// the threshold, and cleared again below 80% of it.
+//
+class DuoRectificationMonitor
+{
+public:
+
+  DuoRectificationMonitor( const double thresholdPx = DUO_MONITOR_THRESHOLD_PX,
+                           const double cpuBudget   = DUO_MONITOR_CPU_BUDGET,
+                           const int    interval    = DUO_MONITOR_INTERVAL );
+
+  ~DuoRectificationMonitor();
+
+  //
+  // A rectified CV_8UC1 pair. Copied for the worker when a sample is due;
+  // returns whether it was.
+  //
+  bool submit( const cv::Mat& left, const cv::Mat& right );
+
+  //
+  // Quality as of the latest measurement; false if there has been none yet
+  //
+  bool latest( DuoRectificationQuality& out ) const;
+
+  void stop();
+
+  //
+  // Measurement parameters
+  //
+  static const int MAX_FEATURES    = 400;  // ORB features per view
+  static const int MAX_HAMMING     = 64;   // between a match's descriptors
+  static const int MAX_VERTICAL_PX = 10;   // offsets searched
+  static const int MIN_MATCHES     = 20;   // for a measurement to count
+
+private:
+
+  void run();
+
+private:
+
+  typedef std::chrono::steady_clock Clock;
+
+  const double            m_thresholdPx;
+  const double            m_cpuBudget;
+  const int               m_interval;
+
+  mutable std::mutex      m_mutex;
+  std::condition_variable m_cv;
+  std::thread             m_worker;
+
+  bool                    m_stop;
+  bool                    m_hasPending;
+  bool                    m_busy;
+
+  //
+  // Sampling: frames since the last sample and the earliest time of the
+  // next, which the budget pushes out after each measurement
+  //
+  int                     m_framesSinceSample;
+  Clock::time_point       m_nextSample;
+  Clock::time_point       m_firstSample;
+  double                  m_busyMs;
+
+  //
+  // Pair handed over by submit(), and the one being measured. Their buffers
+  // are swapped rather than copied.
+  //
+  cv::Mat                 m_pendingL;
+  cv::Mat                 m_pendingR;
+  cv::Mat                 m_workL;
+  cv::Mat                 m_workR;
+
+  DuoRectificationQuality m_latest;
+};
+
+#endif // DUO_RECTIFICATION_MONITOR_H
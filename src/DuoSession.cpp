@@ -0,0 +1,251 @@
+#include <cstring>
+#include <iostream>
+
+#include "DuoSession.h"
+
+
+static_assert( sizeof( DuoSessionFileHeader ) == 48, "DuoSessionFileHeader layout" );
+static_assert( sizeof( DuoSessionViewHeader ) == 8,  "DuoSessionViewHeader layout" );
+static_assert( sizeof( cv::Point2f ) == 8,  "cv::Point2f layout" );
+static_assert( sizeof( cv::Point3f ) == 12, "cv::Point3f layout" );
+
+static const char DUOSES_MAGIC[8] = "DUOSES1";
+
+static const uint8_t ZEROS[8] = { 0 };
+
+
+static uint64_t padTo8( const uint64_t size )
+{
+  return ( size + 7 ) & ~uint64_t( 7 );
+}
+
+
+static uint64_t viewSize( const size_t pointsPerView )
+{
+  return sizeof( DuoSessionViewHeader ) + 2*pointsPerView*sizeof( cv::Point2f );
+}
+
+
+DuoSessionWriter::DuoSessionWriter()
+  : m_file( nullptr )
+  , m_pointsPerView( 0 )
+  , m_numViews( 0 )
+{
+}
+
+
+DuoSessionWriter::~DuoSessionWriter()
+{
+  close();
+}
+
+
+bool DuoSessionWriter::open( const std::string& path,
+                             const DuoSessionInfo& info,
+                             const DuoViewStore& views )
+{
+  close();
+
+  const std::string tmpPath = path + ".tmp";
+
+  FILE* file = fopen( tmpPath.c_str(), "wb" );
+  if( file == nullptr ) return false;
+
+  const std::vector<cv::Point3f>& board = views.getBoard();
+
+  DuoSessionFileHeader header;
+  memset( &header, 0, sizeof( header ) );
+  memcpy( header.magic, DUOSES_MAGIC, sizeof( header.magic ) );
+  header.version       = DUOSES_VERSION;
+  header.pattern       = uint32_t( info.pattern );
+  header.boardWidth    = uint32_t( info.boardSize.width );
+  header.boardHeight   = uint32_t( info.boardSize.height );
+  header.squareLength  = info.squareLength;
+  header.imageWidth    = uint32_t( info.imageSize.width );
+  header.imageHeight   = uint32_t( info.imageSize.height );
+  header.pointsPerView = uint32_t( board.size() );
+
+  const uint64_t boardBytes = board.size()*sizeof( cv::Point3f );
+
+  bool ok = fwrite( &header, sizeof( header ), 1, file ) == 1 &&
+            fwrite( board.data(), 1, boardBytes, file ) == boardBytes &&
+            fwrite( ZEROS, 1, padTo8( boardBytes ) - boardBytes, file ) ==
+              padTo8( boardBytes ) - boardBytes;
+
+  m_pointsPerView = board.size();
+
+  for( size_t i = 0; i < views.size() && ok; ++i )
+    ok = writeView( file, views.left( i ), views.right( i ) );
+
+  ok = ( fclose( file ) == 0 ) && ok;
+
+  //
+  // rename() does not replace an existing file everywhere
+  //
+  if( ok )
+  {
+    remove( path.c_str() );
+    ok = rename( tmpPath.c_str(), path.c_str() ) == 0;
+  }
+
+  if( ok )
+  {
+    m_file = fopen( path.c_str(), "ab" );
+    ok     = m_file != nullptr;
+  }
+
+  if( !ok )
+  {
+    std::cout << "Could not write session " << path << "\n";
+    remove( tmpPath.c_str() );
+    return false;
+  }
+
+  m_path     = path;
+  m_numViews = views.size();
+
+  return true;
+}
+
+
+bool DuoSessionWriter::append( const cv::Point2f* left, const cv::Point2f* right )
+{
+  if( m_file == nullptr ) return false;
+
+  //
+  // Flushed view by view: what has been kept survives a crash
+  //
+  const bool ok = writeView( m_file, left, right ) && fflush( m_file ) == 0;
+
+  if( ok )
+    ++m_numViews;
+  else
+    std::cout << "Session write failed\n";
+
+  return ok;
+}
+
+
+void DuoSessionWriter::close()
+{
+  if( m_file == nullptr ) return;
+
+  fclose( m_file );
+  m_file = nullptr;
+}
+
+
+bool DuoSessionWriter::writeView( FILE* file,
+                                  const cv::Point2f* left,
+                                  const cv::Point2f* right )
+{
+  DuoSessionViewHeader header;
+  header.magic     = DUOSES_VIEW_MAGIC;
+  header.numPoints = uint32_t( m_pointsPerView );
+
+  return fwrite( &header, sizeof( header ), 1, file ) == 1 &&
+         fwrite( left,  sizeof( cv::Point2f ), m_pointsPerView, file ) == m_pointsPerView &&
+         fwrite( right, sizeof( cv::Point2f ), m_pointsPerView, file ) == m_pointsPerView;
+}
+
+
+DuoSessionReader::DuoSessionReader()
+  : m_pointsPerView( 0 )
+  , m_numViews( 0 )
+  , m_viewsOffset( 0 )
+{
+}
+
+
+bool DuoSessionReader::open( const std::string& path )
+{
+  close();
+
+  if( !m_file.open( path ) ) return false;
+
+  DuoSessionFileHeader header;
+  if( m_file.size() < sizeof( header ) )
+  {
+    close();
+    return false;
+  }
+
+  memcpy( &header, m_file.data(), sizeof( header ) );
+
+  m_pointsPerView = header.pointsPerView;
+  m_viewsOffset   = sizeof( header ) +
+                    padTo8( m_pointsPerView*sizeof( cv::Point3f ) );
+
+  if( memcmp( header.magic, DUOSES_MAGIC, sizeof( header.magic ) ) != 0 ||
+      header.version != DUOSES_VERSION ||
+      m_pointsPerView == 0 ||
+      m_file.size() < m_viewsOffset )
+  {
+    std::cout << path << " is not a calibration session\n";
+    close();
+    return false;
+  }
+
+  m_info.pattern      = int( header.pattern );
+  m_info.boardSize    = cv::Size( header.boardWidth, header.boardHeight );
+  m_info.squareLength = header.squareLength;
+  m_info.imageSize    = cv::Size( header.imageWidth, header.imageHeight );
+
+  //
+  // Complete views up to the first damaged or cut short one
+  //
+  const uint64_t stride = viewSize( m_pointsPerView );
+
+  m_numViews = 0;
+
+  for( uint64_t offset = m_viewsOffset;
+       offset + stride <= m_file.size();
+       offset += stride )
+  {
+    DuoSessionViewHeader view;
+    memcpy( &view, m_file.data() + offset, sizeof( view ) );
+
+    if( view.magic != DUOSES_VIEW_MAGIC || view.numPoints != m_pointsPerView )
+      break;
+
+    ++m_numViews;
+  }
+
+  return true;
+}
+
+
+void DuoSessionReader::close()
+{
+  m_file.close();
+  m_info          = DuoSessionInfo();
+  m_pointsPerView = 0;
+  m_numViews      = 0;
+  m_viewsOffset   = 0;
+}
+
+
+void DuoSessionReader::read( DuoViewStore& views ) const
+{
+  std::vector<cv::Point3f> board( m_pointsPerView );
+  memcpy( board.data(),
+          m_file.data() + sizeof( DuoSessionFileHeader ),
+          m_pointsPerView*sizeof( cv::Point3f ) );
+
+  views.setBoard( board );
+  views.reserve( views.size() + m_numViews );
+
+  //
+  // Views are at multiples of 8 bytes from the start of the mapping, so the
+  // corners can be copied straight out of it
+  //
+  const uint64_t stride = viewSize( m_pointsPerView );
+
+  for( size_t i = 0; i < m_numViews; ++i )
+  {
+    const cv::Point2f* left = reinterpret_cast<const cv::Point2f*>(
+        m_file.data() + m_viewsOffset + i*stride + sizeof( DuoSessionViewHeader ) );
+
+    views.add( left, left + m_pointsPerView );
+  }
+}
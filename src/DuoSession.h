@@ -0,0 +1,144 @@
+#ifndef DUO_SESSION_H
+#define DUO_SESSION_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include <opencv2/core.hpp>
+
+#include "DuoMappedFile.h"
+#include "DuoViewStore.h"
+
+
+//
+// Calibration session (.duoses), little-endian, append-only: the corners of
+// every kept image set, so that a session can be resumed after the process
+// ended before calibrating, and sessions merged.
+//
+//   DuoSessionFileHeader
+//   board points: pointsPerView x, y, z floats, padding to 8 bytes
+//   { DuoSessionViewHeader, left x, y floats, right x, y floats } * N
+//
+// Every view has pointsPerView corners in each eye, so views are a fixed
+// size. A view cut short by a crash is ignored on reading.
+//
+struct DuoSessionFileHeader
+{
+  char     magic[8];       // "DUOSES1"
+  uint32_t version;
+  uint32_t pattern;        // DuoCalibrator::Pattern
+  uint32_t boardWidth;
+  uint32_t boardHeight;
+  float    squareLength;
+  uint32_t imageWidth;     // pixels the corners are in
+  uint32_t imageHeight;
+  uint32_t pointsPerView;
+  uint32_t reserved[2];
+};
+
+struct DuoSessionViewHeader
+{
+  uint32_t magic;          // DUOSES_VIEW_MAGIC
+  uint32_t numPoints;      // pointsPerView
+};
+
+const uint32_t DUOSES_VERSION    = 1;
+const uint32_t DUOSES_VIEW_MAGIC = 0x30574556; // "VEW0"
+
+
+//
+// What the corners of a session were taken of and in
+//
+struct DuoSessionInfo
+{
+  DuoSessionInfo() : pattern( 0 ), squareLength( 0.0f ) {}
+
+  int      pattern;
+  cv::Size boardSize;
+  float    squareLength;
+  cv::Size imageSize;
+};
+
+
+//
+// Writes a session file and appends views to it
+//
+class DuoSessionWriter
+{
+public:
+
+  DuoSessionWriter();
+
+  ~DuoSessionWriter();
+
+  //
+  // (Re)writes path with the views in the store, through a temporary file
+  // so that the previous contents survive a failure, then keeps it open for
+  // append()
+  //
+  bool open( const std::string& path,
+             const DuoSessionInfo& info,
+             const DuoViewStore& views );
+
+  bool append( const cv::Point2f* left, const cv::Point2f* right );
+
+  void close();
+
+  bool isOpen() const { return m_file != nullptr; }
+
+  const std::string& getPath() const { return m_path; }
+
+  size_t getNumViews() const { return m_numViews; }
+
+private:
+
+  bool writeView( FILE* file, const cv::Point2f* left, const cv::Point2f* right );
+
+private:
+
+  FILE*       m_file;
+  std::string m_path;
+  size_t      m_pointsPerView;
+  size_t      m_numViews;
+};
+
+
+//
+// Reads a session file from a memory map
+//
+class DuoSessionReader
+{
+public:
+
+  DuoSessionReader();
+
+  bool open( const std::string& path );
+
+  void close();
+
+  bool isOpen() const { return m_file.isOpen(); }
+
+  const DuoSessionInfo& getInfo() const { return m_info; }
+
+  //
+  // Complete views in the file
+  //
+  size_t getNumViews() const { return m_numViews; }
+
+  //
+  // Sets the store's board to the session's and appends every view
+  //
+  void read( DuoViewStore& views ) const;
+
+private:
+
+  DuoMappedFile  m_file;
+  DuoSessionInfo m_info;
+
+  size_t         m_pointsPerView;
+  size_t         m_numViews;
+  size_t         m_viewsOffset;
+};
+
+#endif // DUO_SESSION_H
@@ -0,0 +1,343 @@
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "DuoSyntheticSource.h"
+
+
+std::string GetTargetImagePath( const bool circles )
+{
+  const char* root = getenv( "CALIBDUO_ROOT" );
+
+  const std::string dir = ( root != NULL ) ? std::string( root ) + "/resources/"
+                                           : std::string( "resources/" );
+
+  return dir + ( circles ? "DuoCalibrationCircles.png"
+                         : "DuoCalibrationGrid.png" );
+}
+
+
+DuoStereoRig DuoStereoRig::makeDefault( const cv::Size& imageSize )
+{
+  const double s = imageSize.width/double( WIDTH_VGA );
+  const double f = 380.0*s;
+  const double cx = 0.5*imageSize.width;
+  const double cy = 0.5*imageSize.height;
+
+  DuoStereoRig rig;
+
+  rig.imageSize = imageSize;
+
+  rig.M1 = ( cv::Mat_<double>( 3, 3 ) << f,   0, cx + 3.5*s,
+                                         0,   f, cy - 2.0*s,
+                                         0,   0,          1 );
+
+  rig.M2 = ( cv::Mat_<double>( 3, 3 ) << f,   0, cx - 4.0*s,
+                                         0,   f, cy + 1.5*s,
+                                         0,   0,          1 );
+
+  rig.D1 = ( cv::Mat_<double>( 1, 8 ) << -0.28,  0.09,  0.0006, -0.0004,
+                                         -0.012, 0.02, -0.004,   0.001 );
+
+  rig.D2 = ( cv::Mat_<double>( 1, 8 ) << -0.27,  0.08, -0.0003,  0.0005,
+                                         -0.010, 0.03, -0.006,   0.002 );
+
+  cv::Rodrigues( ( cv::Mat_<double>( 3, 1 ) << 0.004, -0.008, 0.003 ), rig.R );
+
+  rig.T = ( cv::Mat_<double>( 3, 1 ) << -3.0, 0.02, -0.01 );
+
+  rig.noiseSigma = 2.0;
+  rig.blurSigma  = 0.6;
+
+  return rig;
+}
+
+
+//
+// Normalized, undistorted coordinates of every pixel of a camera, found by
+// inverting the rational distortion model with fixed point iterations
+//
+static void undistortPixelGrid( const cv::Mat& M,
+                                const cv::Mat& D,
+                                const cv::Size& size,
+                                cv::Mat& rays )
+{
+  rays.create( size, CV_32FC2 );
+
+  const double fx = M.at<double>( 0, 0 );
+  const double fy = M.at<double>( 1, 1 );
+  const double cx = M.at<double>( 0, 2 );
+  const double cy = M.at<double>( 1, 2 );
+
+  double k[8];
+  for( int i = 0; i < 8; ++i ) k[i] = D.at<double>( i );
+
+  cv::parallel_for_( cv::Range( 0, size.height ), [&]( const cv::Range& range )
+  {
+    for( int v = range.start; v < range.end; ++v )
+    {
+      cv::Vec2f* row = rays.ptr<cv::Vec2f>( v );
+
+      for( int u = 0; u < size.width; ++u )
+      {
+        const double xd = ( u - cx )/fx;
+        const double yd = ( v - cy )/fy;
+
+        double x = xd;
+        double y = yd;
+
+        for( int it = 0; it < 20; ++it )
+        {
+          const double r2 = x*x + y*y;
+          const double r4 = r2*r2;
+          const double r6 = r4*r2;
+
+          const double radial = ( 1.0 + k[0]*r2 + k[1]*r4 + k[4]*r6 )/
+                                ( 1.0 + k[5]*r2 + k[6]*r4 + k[7]*r6 );
+
+          const double dx = 2.0*k[2]*x*y + k[3]*( r2 + 2.0*x*x );
+          const double dy = k[2]*( r2 + 2.0*y*y ) + 2.0*k[3]*x*y;
+
+          x = ( xd - dx )/radial;
+          y = ( yd - dy )/radial;
+        }
+
+        row[u] = cv::Vec2f( float( x ), float( y ) );
+      }
+    }
+  } );
+}
+
+
+DuoSyntheticSource::DuoSyntheticSource( const DuoStereoRig& rig,
+                                        const cv::Size& boardSize,
+                                        const bool circles,
+                                        const std::vector<cv::Point3f>& objectPts,
+                                        const std::string& targetImagePath,
+                                        const int numFrames,
+                                        const unsigned seed )
+  : m_rig( rig )
+  , m_valid( false )
+  , m_next( 0 )
+{
+  if( !loadTarget( targetImagePath, boardSize, circles, objectPts ) )
+    return;
+
+  undistortPixelGrid( m_rig.M1, m_rig.D1, m_rig.imageSize, m_rays[0] );
+  undistortPixelGrid( m_rig.M2, m_rig.D2, m_rig.imageSize, m_rays[1] );
+
+  generatePoses( objectPts, numFrames, seed );
+
+  m_valid = true;
+}
+
+
+bool DuoSyntheticSource::loadTarget( const std::string& path,
+                                     const cv::Size& boardSize,
+                                     const bool circles,
+                                     const std::vector<cv::Point3f>& objectPts )
+{
+  cv::Mat target = cv::imread( path, cv::IMREAD_GRAYSCALE );
+  if( target.empty() )
+  {
+    std::cout << "Could not load calibration target " << path << "\n";
+    return false;
+  }
+
+  //
+  // Bring the print-resolution image down to a size that is not badly
+  // aliased when remapped to a few hundred pixels
+  //
+  const double scale = 1200.0/target.cols;
+  cv::resize( target, m_target, cv::Size(), scale, scale, cv::INTER_AREA );
+
+  std::vector<cv::Point2f> targetPts;
+
+  bool found = false;
+  if( circles )
+  {
+    found = cv::findCirclesGrid( m_target, boardSize, targetPts,
+                                 cv::CALIB_CB_ASYMMETRIC_GRID );
+  }
+  else
+  {
+    found = cv::findChessboardCorners( m_target, boardSize, targetPts );
+
+    if( found )
+    {
+      cv::cornerSubPix( m_target, targetPts,
+                        cv::Size( 11, 11 ), cv::Size( -1, -1 ),
+                        cv::TermCriteria( cv::TermCriteria::MAX_ITER |
+                                          cv::TermCriteria::EPS, 50, 0.001 ) );
+    }
+  }
+
+  if( !found || targetPts.size() != objectPts.size() )
+  {
+    std::cout << "Could not locate the pattern in " << path << "\n";
+    return false;
+  }
+
+  std::vector<cv::Point2f> boardPts;
+  for( const auto& p : objectPts )
+    boardPts.push_back( cv::Point2f( p.x, p.y ) );
+
+  m_boardToTarget = cv::findHomography( boardPts, targetPts );
+
+  return !m_boardToTarget.empty();
+}
+
+
+//
+// Random but repeatable board poses, each one fully visible in both cameras
+//
+void DuoSyntheticSource::generatePoses( const std::vector<cv::Point3f>& objectPts,
+                                        const int numFrames,
+                                        const unsigned seed )
+{
+  cv::RNG rng( seed );
+
+  cv::Point3f centroid( 0, 0, 0 );
+  for( const auto& p : objectPts )
+  {
+    centroid.x += p.x/objectPts.size();
+    centroid.y += p.y/objectPts.size();
+  }
+
+  //
+  // Keep the outer row of squares/circles in the image as well
+  //
+  const float margin = 0.06f*m_rig.imageSize.width;
+
+  const cv::Rect2f inside( margin,
+                           margin,
+                           m_rig.imageSize.width  - 2*margin,
+                           m_rig.imageSize.height - 2*margin );
+
+  cv::Mat rigRvec;
+  cv::Rodrigues( m_rig.R, rigRvec );
+
+  std::vector<cv::Point2f> ptsL;
+  std::vector<cv::Point2f> ptsR;
+
+  int attempts = 0;
+
+  while( int( m_rvecs.size() ) < numFrames && attempts < 1000*numFrames )
+  {
+    ++attempts;
+
+    const double z  = rng.uniform( 22.0, 50.0 );
+    const double u  = rng.uniform( 0.0, double( m_rig.imageSize.width ) );
+    const double v  = rng.uniform( 0.0, double( m_rig.imageSize.height ) );
+
+    cv::Mat rvec = ( cv::Mat_<double>( 3, 1 )
+                     << rng.uniform( -0.6, 0.6 ),
+                        rng.uniform( -0.6, 0.6 ),
+                        rng.uniform( -0.35, 0.35 ) );
+
+    cv::Mat Rb;
+    cv::Rodrigues( rvec, Rb );
+
+    //
+    // Put the board's centroid on the ray through (u, v)
+    //
+    const cv::Mat center = ( cv::Mat_<double>( 3, 1 )
+        << ( u - m_rig.M1.at<double>( 0, 2 ) )/m_rig.M1.at<double>( 0, 0 )*z,
+           ( v - m_rig.M1.at<double>( 1, 2 ) )/m_rig.M1.at<double>( 1, 1 )*z,
+           z );
+
+    const cv::Mat c = ( cv::Mat_<double>( 3, 1 ) << centroid.x, centroid.y, 0 );
+    cv::Mat tvec = center - Rb*c;
+
+    cv::Mat rvecR;
+    cv::Mat tvecR;
+    cv::composeRT( rvec, tvec, rigRvec, m_rig.T, rvecR, tvecR );
+
+    cv::projectPoints( objectPts, rvec,  tvec,  m_rig.M1, m_rig.D1, ptsL );
+    cv::projectPoints( objectPts, rvecR, tvecR, m_rig.M2, m_rig.D2, ptsR );
+
+    bool visible = true;
+    for( size_t i = 0; i < objectPts.size() && visible; ++i )
+      visible = inside.contains( ptsL[i] ) && inside.contains( ptsR[i] );
+
+    if( !visible ) continue;
+
+    m_rvecs.push_back( rvec );
+    m_tvecs.push_back( tvec );
+  }
+}
+
+
+void DuoSyntheticSource::getBoardPose( const size_t i,
+                                       cv::Mat& rvec,
+                                       cv::Mat& tvec ) const
+{
+  rvec = m_rvecs[i].clone();
+  tvec = m_tvecs[i].clone();
+}
+
+
+//
+// Render the target seen by one camera with the board at (R, t)
+//
+void DuoSyntheticSource::render( const int view,
+                                 const cv::Mat& R,
+                                 const cv::Mat& t,
+                                 cv::Mat& out )
+{
+  //
+  // Board plane z = 0 to normalized camera coordinates: [r1 r2 t]
+  //
+  cv::Mat H( 3, 3, CV_64F );
+  R.col( 0 ).copyTo( H.col( 0 ) );
+  R.col( 1 ).copyTo( H.col( 1 ) );
+  t.copyTo( H.col( 2 ) );
+
+  const cv::Mat rayToTarget = m_boardToTarget*H.inv();
+
+  cv::perspectiveTransform( m_rays[view], m_map, rayToTarget );
+
+  cv::remap( m_target, out, m_map, cv::Mat(),
+             cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar( 96 ) );
+
+  if( m_rig.blurSigma > 0.0 )
+    cv::GaussianBlur( out, out, cv::Size( 0, 0 ), m_rig.blurSigma );
+
+  if( m_rig.noiseSigma > 0.0 )
+  {
+    m_noise.create( out.size(), CV_16S );
+    cv::randn( m_noise, 0.0, m_rig.noiseSigma );
+    cv::add( out, m_noise, out, cv::noArray(), CV_8U );
+  }
+}
+
+
+bool DuoSyntheticSource::grab( cv::Mat& left,
+                               cv::Mat& right,
+                               uint64_t& seq,
+                               uint32_t& timeStamp )
+{
+  if( !m_valid || isFinished() ) return false;
+
+  cv::Mat Rb;
+  cv::Rodrigues( m_rvecs[m_next], Rb );
+
+  const cv::Mat& tb = m_tvecs[m_next];
+
+  render( 0, Rb, tb, m_images[0] );
+  render( 1, m_rig.R*Rb, m_rig.R*tb + m_rig.T, m_images[1] );
+
+  left  = m_images[0];
+  right = m_images[1];
+
+  seq       = m_next + 1;
+  timeStamp = uint32_t( m_next*DUO_TIMESTAMP_HZ/FPS );
+
+  ++m_next;
+
+  return true;
+}
@@ -0,0 +1,132 @@
+#ifndef DUO_SYNTHETIC_SOURCE_H
+#define DUO_SYNTHETIC_SOURCE_H
+
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "DuoFrameSource.h"
+
+
+//
+// Ground truth stereo rig, in the conventions of cv::stereoCalibrate:
+// a point X in left camera coordinates is R*X + T in right camera coordinates
+//
+struct DuoStereoRig
+{
+  cv::Size imageSize;
+
+  cv::Mat  M1;          // 3x3 camera matrices
+  cv::Mat  M2;
+  cv::Mat  D1;          // 1x8 rational model (k1 k2 p1 p2 k3 k4 k5 k6)
+  cv::Mat  D2;
+  cv::Mat  R;           // 3x3
+  cv::Mat  T;           // 3x1, same units as the board (cm)
+
+  double   noiseSigma;  // gray levels of additive Gaussian noise
+  double   blurSigma;   // px of Gaussian blur, 0 for none
+
+  //
+  // Roughly a DUO MLX: ~3 cm baseline, moderate barrel distortion, both
+  // cameras sharing a focal length (the calibration uses
+  // CV_CALIB_SAME_FOCAL_LENGTH)
+  //
+  static DuoStereoRig makeDefault( const cv::Size& imageSize );
+};
+
+
+//
+// Printable calibration target for the given pattern, under
+// ${CALIBDUO_ROOT}/resources when that is set, else ./resources
+//
+std::string GetTargetImagePath( const bool circles );
+
+
+//
+// Renders a calibration target through a DuoStereoRig at a deterministic
+// sequence of board poses.
+//
+// The target image (resources/DuoCalibrationGrid.png or
+// resources/DuoCalibrationCircles.png) is located on itself with the same
+// detector the calibrator uses, which ties its pixels to the board
+// coordinates given as objectPts. Each camera's distorted pixel grid is
+// undistorted once; a frame is then one homography per camera plus a remap.
+//
+class DuoSyntheticSource : public DuoFrameSource
+{
+public:
+
+  DuoSyntheticSource( const DuoStereoRig& rig,
+                      const cv::Size& boardSize,
+                      const bool circles,
+                      const std::vector<cv::Point3f>& objectPts,
+                      const std::string& targetImagePath,
+                      const int numFrames,
+                      const unsigned seed = 1 );
+
+  //
+  // False if the target image could not be loaded or located
+  //
+  bool isValid() const { return m_valid; }
+
+  cv::Size getSize() const { return m_rig.imageSize; }
+
+  bool grab( cv::Mat& left, cv::Mat& right, uint64_t& seq, uint32_t& timeStamp );
+
+  bool isFinished() const { return m_next >= m_rvecs.size(); }
+
+  void rewind() { m_next = 0; }
+
+  const DuoStereoRig& getRig() const { return m_rig; }
+
+  //
+  // Board pose in the left camera for frame i
+  //
+  void getBoardPose( const size_t i, cv::Mat& rvec, cv::Mat& tvec ) const;
+
+private:
+
+  bool loadTarget( const std::string& path,
+                   const cv::Size& boardSize,
+                   const bool circles,
+                   const std::vector<cv::Point3f>& objectPts );
+
+  void generatePoses( const std::vector<cv::Point3f>& objectPts,
+                      const int numFrames,
+                      const unsigned seed );
+
+  void render( const int view,
+               const cv::Mat& R,
+               const cv::Mat& t,
+               cv::Mat& out );
+
+private:
+
+  DuoStereoRig         m_rig;
+  bool                 m_valid;
+
+  //
+  // Target image and the homography from board coordinates to its pixels
+  //
+  cv::Mat              m_target;
+  cv::Mat              m_boardToTarget;
+
+  //
+  // Undistorted normalized coordinates of every pixel, per camera (CV_32FC2)
+  //
+  cv::Mat              m_rays[2];
+
+  std::vector<cv::Mat> m_rvecs;
+  std::vector<cv::Mat> m_tvecs;
+  size_t               m_next;
+
+  //
+  // Per-frame buffers
+  //
+  cv::Mat              m_map;
+  cv::Mat              m_noise;
+  cv::Mat              m_images[2];
+};
+
+#endif // DUO_SYNTHETIC_SOURCE_H
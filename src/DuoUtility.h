@@ -1,10 +1,18 @@
 #ifndef DUO_UTILITY_H
 #define DUO_UTILITY_H
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <mutex>
 #include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
 
 #include "DUOLib.h"
 
@@ -17,26 +25,258 @@ const int32_t WIDTH_QVGA  = 320;
 const int32_t HEIGHT_QVGA = 240;
 
 
-static DUOInstance _duo        = nullptr;
-static PDUOFrame   _pFrameData = nullptr;
+static DUOInstance _duo = nullptr;
+
+
+//
+// Milliseconds in a difference of cv::getTickCount() values
+//
+inline double TicksToMs( const int64 ticks )
+{
+  return 1000.0*ticks/cv::getTickFrequency();
+}
+
+
+//
+// Captured frames are copied into a small ring of preallocated stereo slots.
+// The DUO callback is the only producer and never locks or allocates; any
+// number of consumers can hold on to slots through DUOFrameRef. A slot is
+// only rewritten once every reference to it has been released, and the slot
+// holding the newest frame is never the next one written.
+//
+const int DUO_RING_SIZE = 8;
+
+struct DUOFrameSlot
+{
+  DUOFrameSlot() : state( 0 ), seq( 0 ), timeStamp( 0 ), width( 0 ), height( 0 )
+  {}
+
+  std::atomic<int32_t>  state;     // -1 being written, 0 idle, >0 # of readers
+  std::atomic<uint64_t> seq;       // 1, 2, 3, ... in capture order
+  uint32_t              timeStamp; // DUOFrame::timeStamp
+  uint32_t              width;
+  uint32_t              height;
+  std::vector<uint8_t>  left;
+  std::vector<uint8_t>  right;
+};
+
+struct DUOFrameRing
+{
+  DUOFrameRing() : latestSlot( -1 ), latestSeq( 0 ), dropped( 0 ), nextSlot( 0 )
+  {}
+
+  DUOFrameSlot          slots[DUO_RING_SIZE];
+  std::atomic<int>      latestSlot;
+  std::atomic<uint64_t> latestSeq;
+  std::atomic<uint64_t> dropped;   // frames lost because every slot was held
+  int                   nextSlot;  // only touched by the callback thread
+
+  //
+  // Consumers only wait on these; the callback notifies without locking and
+  // waiters re-check every few ms, so a missed notification costs little
+  //
+  std::mutex              mutex;
+  std::condition_variable cv;
+};
+
+//
+// The ring is shared by every translation unit that includes this header
+//
+inline DUOFrameRing& GetDUOFrameRing()
+{
+  static DUOFrameRing ring;
+  return ring;
+}
+
 
-static std::mutex              _frameMutex;
-static std::condition_variable _frameCV;
+class  DUOFrameRef;
+struct DUOFrameConsumer;
+
+inline bool AcquireDUOFrame( DUOFrameRef& frame,
+                             DUOFrameConsumer& consumer,
+                             const int timeoutMs = 1000 );
+
+
+//
+// Shared ownership of one ring slot, released on destruction
+//
+class DUOFrameRef
+{
+public:
+
+  DUOFrameRef() : m_slot( -1 ) {}
+
+  DUOFrameRef( const DUOFrameRef& other ) : m_slot( -1 ) { *this = other; }
+
+  DUOFrameRef& operator=( const DUOFrameRef& other )
+  {
+    if( this == &other ) return *this;
+
+    release();
+
+    if( other.m_slot >= 0 )
+      slot( other.m_slot ).state.fetch_add( 1, std::memory_order_acq_rel );
+
+    m_slot = other.m_slot;
+    return *this;
+  }
+
+  ~DUOFrameRef() { release(); }
+
+  void release()
+  {
+    if( m_slot >= 0 )
+      slot( m_slot ).state.fetch_sub( 1, std::memory_order_acq_rel );
+    m_slot = -1;
+  }
+
+  bool valid() const { return m_slot >= 0; }
+
+  uint64_t seq()       const { return slot( m_slot ).seq.load(); }
+  uint32_t timeStamp() const { return slot( m_slot ).timeStamp; }
+  uint32_t width()     const { return slot( m_slot ).width; }
+  uint32_t height()    const { return slot( m_slot ).height; }
+
+  const uint8_t* left()  const { return slot( m_slot ).left.data(); }
+  const uint8_t* right() const { return slot( m_slot ).right.data(); }
+
+private:
+
+  friend bool AcquireDUOFrame( DUOFrameRef&, DUOFrameConsumer&, const int );
+
+  static DUOFrameSlot& slot( int i ) { return GetDUOFrameRing().slots[i]; }
+
+  int m_slot;
+};
+
+
+//
+// Per-consumer position in the frame sequence
+//
+struct DUOFrameConsumer
+{
+  DUOFrameConsumer() : lastSeq( 0 ), skipped( 0 ) {}
+
+  uint64_t lastSeq; // sequence number of the last frame acquired
+  uint64_t skipped; // frames that were captured but never seen by us
+};
 
-static bool _ready = false;
 
 //
 // One and only duo callback function
-// It sets the current frame data and signals that the new frame data is ready
+// It copies the frame into a free slot and publishes it as the newest frame
 //
 static void CALLBACK DUOCallback( const PDUOFrame pFrameData, void* pUserData )
 {
-  std::unique_lock<std::mutex> lk( _frameMutex );
-  _pFrameData = pFrameData;
-  _ready = true;
-  _frameCV.notify_one();
+  DUOFrameRing& ring = GetDUOFrameRing();
+
+  const size_t size   = size_t( pFrameData->width )*pFrameData->height;
+  const int    latest = ring.latestSlot.load( std::memory_order_acquire );
+
+  for( int k = 0; k < DUO_RING_SIZE; ++k )
+  {
+    const int i = ( ring.nextSlot + k ) % DUO_RING_SIZE;
+    if( i == latest ) continue;
+
+    DUOFrameSlot& slot = ring.slots[i];
+
+    int32_t idle = 0;
+    if( !slot.state.compare_exchange_strong( idle, -1,
+                                             std::memory_order_acquire ) )
+      continue;
+
+    if( size > slot.left.size() )
+    {
+      slot.state.store( 0, std::memory_order_release );
+      break;
+    }
+
+    memcpy( slot.left.data(),  pFrameData->leftData,  size );
+    memcpy( slot.right.data(), pFrameData->rightData, size );
+
+    const uint64_t seq = ring.latestSeq.load( std::memory_order_relaxed ) + 1;
+
+    slot.timeStamp = pFrameData->timeStamp;
+    slot.width     = pFrameData->width;
+    slot.height    = pFrameData->height;
+    slot.seq.store( seq, std::memory_order_relaxed );
+    slot.state.store( 0, std::memory_order_release );
+
+    ring.latestSlot.store( i, std::memory_order_release );
+    ring.latestSeq.store( seq, std::memory_order_release );
+    ring.nextSlot = ( i + 1 ) % DUO_RING_SIZE;
+
+    ring.cv.notify_all();
+    return;
+  }
+
+  //
+  // Every slot is held by a consumer (or the frame does not fit)
+  //
+  ring.dropped.fetch_add( 1, std::memory_order_relaxed );
+}
+
+
+//
+// Allocates the ring for frames of the given size; capture must be stopped
+// and no DUOFrameRef may be held
+//
+static void ResetDUOFrameRing( const int width, const int height )
+{
+  DUOFrameRing& ring = GetDUOFrameRing();
+
+  for( int i = 0; i < DUO_RING_SIZE; ++i )
+  {
+    ring.slots[i].state.store( 0 );
+    ring.slots[i].seq.store( 0 );
+    ring.slots[i].left.assign( size_t( width )*height, 0 );
+    ring.slots[i].right.assign( size_t( width )*height, 0 );
+  }
+
+  ring.latestSlot.store( -1 );
+  ring.latestSeq.store( 0 );
+  ring.dropped.store( 0 );
+  ring.nextSlot = 0;
+}
+
+
+//
+// Find optimal binning parameters for given (width, height)
+// This maximizes sensor imaging area for given resolution: each image pixel
+// spans binX x binY sensor pixels
+//
+inline void GetDUOBinningFactors( const int width, const int height,
+                                  int& binX, int& binY )
+{
+  binX = ( width <= WIDTH_FULL/2 ) ? 2 : 1;
+
+  binY = ( height <= HEIGHT_FULL/4 ) ? 4
+       : ( height <= HEIGHT_FULL/2 ) ? 2
+                                     : 1;
 }
 
+
+//
+// The same as DUO_BIN_* flags for SetDUOResolutionInfo
+//
+inline int GetDUOBinning( const int width, const int height )
+{
+  int binX = 1;
+  int binY = 1;
+  GetDUOBinningFactors( width, height, binX, binY );
+
+  int binning = DUO_BIN_NONE;
+  if( binX == 2 )
+    binning += DUO_BIN_HORIZONTAL2;
+  if( binY == 4 )
+    binning += DUO_BIN_VERTICAL4;
+  else if( binY == 2 )
+    binning += DUO_BIN_VERTICAL2;
+
+  return binning;
+}
+
+
 //
 // Opens, sets current image format and fps and starts capturing
 //
@@ -49,17 +289,7 @@ static bool OpenDUOCamera( const int width, const int height, const float fps )
     _duo = nullptr;
   }
 
-  //
-  // Find optimal binning parameters for given (width, height)
-  // This maximizes sensor imaging area for given resolution
-  //
-  int binning = DUO_BIN_NONE;
-  if( width <= 752/2 )
-    binning += DUO_BIN_HORIZONTAL2;
-  if( height <= 480/4 )
-    binning += DUO_BIN_VERTICAL4;
-  else if( height <= 480/2 )
-    binning += DUO_BIN_VERTICAL2;
+  const int binning = GetDUOBinning( width, height );
 
   //
   // Check if we support given resolution (width, height, binning, fps)
@@ -87,6 +317,8 @@ static bool OpenDUOCamera( const int width, const int height, const float fps )
 
   SetDUOResolutionInfo( _duo, ri );
 
+  ResetDUOFrameRing( width, height );
+
   if( !StartDUO( _duo, DUOCallback, nullptr ) )
     return false;
 
@@ -98,19 +330,77 @@ static bool OpenDUOCamera( const int width, const int height, const float fps )
 }
 
 //
-// Waits until the new DUO frame is ready and returns it
+// Waits for a frame newer than the consumer's last one and takes a reference
+// to it. Frames the consumer was too slow to see are added to its skipped
+// count. Returns false if no frame arrives within the timeout.
 //
-static PDUOFrame GetDUOFrame()
+inline bool AcquireDUOFrame( DUOFrameRef& frame,
+                             DUOFrameConsumer& consumer,
+                             const int timeoutMs )
 {
-  if( _duo == nullptr ) return nullptr;
+  DUOFrameRing& ring = GetDUOFrameRing();
 
-  std::unique_lock<std::mutex> lk( _frameMutex );
-  _frameCV.wait( lk, [] { return _ready; } );
-  _ready = false;
+  frame.release();
 
-  return _pFrameData;
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds( timeoutMs );
+
+  while( true )
+  {
+    if( ring.latestSeq.load( std::memory_order_acquire ) <= consumer.lastSeq )
+    {
+      if( std::chrono::steady_clock::now() >= deadline ) return false;
+
+      std::unique_lock<std::mutex> lk( ring.mutex );
+      ring.cv.wait_for( lk, std::chrono::milliseconds( 2 ), [&] {
+        return ring.latestSeq.load( std::memory_order_acquire ) >
+               consumer.lastSeq;
+      } );
+      continue;
+    }
+
+    const int i = ring.latestSlot.load( std::memory_order_acquire );
+    if( i < 0 ) continue;
+
+    //
+    // Take a reader reference unless the producer got to the slot first
+    //
+    DUOFrameSlot& slot = ring.slots[i];
+
+    int32_t state = slot.state.load( std::memory_order_acquire );
+    while( state >= 0 &&
+           !slot.state.compare_exchange_weak( state, state + 1,
+                                              std::memory_order_acq_rel ) )
+    {}
+
+    if( state < 0 ) continue;
+
+    frame.m_slot = i;
+
+    const uint64_t seq = slot.seq.load( std::memory_order_relaxed );
+    if( seq <= consumer.lastSeq )
+    {
+      frame.release();
+      continue;
+    }
+
+    consumer.skipped += seq - consumer.lastSeq - 1;
+    consumer.lastSeq  = seq;
+
+    return true;
+  }
 }
 
+
+//
+// Frames the callback had to drop because every slot was held by a consumer
+//
+inline uint64_t GetDUODroppedFrames()
+{
+  return GetDUOFrameRing().dropped.load( std::memory_order_relaxed );
+}
+
+
 //
 // Stop capture and close the camera
 //
@@ -124,6 +414,20 @@ static void CloseDUOCamera()
 }
 
 
+//
+// Serial number of the open camera, empty if none is open
+//
+static std::string GetDUOSerial()
+{
+  if( _duo == nullptr ) return std::string();
+
+  char tmp[260];
+  if( !GetDUOSerialNumber( _duo, tmp ) ) return std::string();
+
+  return std::string( tmp );
+}
+
+
 static void SetExposure( const float value )
 {
   if( _duo == nullptr ) return;
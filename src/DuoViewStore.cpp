@@ -0,0 +1,143 @@
+#include <algorithm>
+
+#include "DuoViewStore.h"
+
+
+DuoViewStore::DuoViewStore()
+  : m_numViews( 0 )
+{
+}
+
+
+void DuoViewStore::setBoard( const std::vector<cv::Point3f>& objectPts )
+{
+  if( objectPts.size() != m_board.size() ) clear();
+
+  m_board = objectPts;
+}
+
+
+void DuoViewStore::reserve( const size_t numViews )
+{
+  m_left.reserve( numViews*m_board.size() );
+  m_right.reserve( numViews*m_board.size() );
+}
+
+
+bool DuoViewStore::add( const std::vector<cv::Point2f>& left,
+                        const std::vector<cv::Point2f>& right )
+{
+  if( m_board.empty() ||
+      left.size()  != m_board.size() ||
+      right.size() != m_board.size() )
+    return false;
+
+  add( left.data(), right.data() );
+
+  return true;
+}
+
+
+void DuoViewStore::add( const cv::Point2f* left, const cv::Point2f* right )
+{
+  const size_t n = m_board.size();
+
+  m_left.insert( m_left.end(), left, left + n );
+  m_right.insert( m_right.end(), right, right + n );
+
+  ++m_numViews;
+}
+
+
+//
+// The Mat constructors take non-const data; the headers are only read
+//
+cv::Mat DuoViewStore::getBoardMat() const
+{
+  return cv::Mat( int( m_board.size() ), 1, CV_32FC3,
+                  const_cast<cv::Point3f*>( m_board.data() ) );
+}
+
+
+cv::Mat DuoViewStore::getLeftMat( const size_t i ) const
+{
+  return cv::Mat( int( m_board.size() ), 1, CV_32FC2,
+                  const_cast<cv::Point2f*>( left( i ) ) );
+}
+
+
+cv::Mat DuoViewStore::getRightMat( const size_t i ) const
+{
+  return cv::Mat( int( m_board.size() ), 1, CV_32FC2,
+                  const_cast<cv::Point2f*>( right( i ) ) );
+}
+
+
+void DuoViewStore::getArrays( std::vector<cv::Mat>& objectPts,
+                              std::vector<cv::Mat>& leftPts,
+                              std::vector<cv::Mat>& rightPts,
+                              const size_t first,
+                              const size_t last ) const
+{
+  const size_t end = std::min( last, m_numViews );
+  const size_t n   = ( end > first ) ? end - first : 0;
+
+  objectPts.assign( n, getBoardMat() );
+  leftPts.resize( n );
+  rightPts.resize( n );
+
+  for( size_t i = 0; i < n; ++i )
+  {
+    leftPts[i]  = getLeftMat( first + i );
+    rightPts[i] = getRightMat( first + i );
+  }
+}
+
+
+void DuoViewStore::keep( const std::vector<char>& keepView )
+{
+  const size_t n = m_board.size();
+
+  size_t kept = 0;
+
+  for( size_t i = 0; i < m_numViews; ++i )
+  {
+    if( !keepView[i] ) continue;
+
+    if( kept != i )
+    {
+      std::copy( m_left.begin()  + i*n, m_left.begin()  + ( i + 1 )*n,
+                 m_left.begin()  + kept*n );
+      std::copy( m_right.begin() + i*n, m_right.begin() + ( i + 1 )*n,
+                 m_right.begin() + kept*n );
+    }
+
+    ++kept;
+  }
+
+  m_numViews = kept;
+  m_left.resize( kept*n );
+  m_right.resize( kept*n );
+}
+
+
+void DuoViewStore::transform( const double sx, const double sy,
+                              const double tx, const double ty )
+{
+  for( std::vector<cv::Point2f>* pts : { &m_left, &m_right } )
+  {
+    for( cv::Point2f& pt : *pts )
+    {
+      pt.x = float( sx*pt.x + tx );
+      pt.y = float( sy*pt.y + ty );
+    }
+  }
+}
+
+
+void DuoViewStore::clear()
+{
+  m_left.clear();
+  m_right.clear();
+  m_numViews = 0;
+}
@@ -0,0 +1,109 @@
+#ifndef DUO_VIEW_STORE_H
+#define DUO_VIEW_STORE_H
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+
+//
+// Corners of the kept image sets, as a structure of arrays: the board's
+// object points once for all views, and the left and the right corners of
+// every view each in one contiguous array, view after view.
+//
+// Views are handed out as pointers or cv::Mat headers onto these arrays,
+// without a copy. They stay valid until the next add(), keep() or clear().
+//
+class DuoViewStore
+{
+public:
+
+  DuoViewStore();
+
+  //
+  // Board corners in board coordinates, shared by every view. A board with
+  // another number of corners drops the views.
+  //
+  void setBoard( const std::vector<cv::Point3f>& objectPts );
+
+  const std::vector<cv::Point3f>& getBoard() const { return m_board; }
+
+  size_t getPointsPerView() const { return m_board.size(); }
+
+  size_t size() const { return m_numViews; }
+
+  bool empty() const { return m_numViews == 0; }
+
+  void reserve( const size_t numViews );
+
+  //
+  // Appends a view of getPointsPerView() corners in each eye. Returns false,
+  // keeping nothing, for any other number.
+  //
+  bool add( const std::vector<cv::Point2f>& left,
+            const std::vector<cv::Point2f>& right );
+
+  void add( const cv::Point2f* left, const cv::Point2f* right );
+
+  const cv::Point2f* left( const size_t i ) const
+  {
+    return m_left.data() + i*m_board.size();
+  }
+
+  const cv::Point2f* right( const size_t i ) const
+  {
+    return m_right.data() + i*m_board.size();
+  }
+
+  //
+  // The board and a view as CV_32FC3 and CV_32FC2 columns, for the OpenCV
+  // calibration functions
+  //
+  cv::Mat getBoardMat() const;
+
+  cv::Mat getLeftMat( const size_t i ) const;
+
+  cv::Mat getRightMat( const size_t i ) const;
+
+  //
+  // Headers of views first to last, e.g. for cv::stereoCalibrate. Every
+  // object point header is the same board.
+  //
+  void getArrays( std::vector<cv::Mat>& objectPts,
+                  std::vector<cv::Mat>& leftPts,
+                  std::vector<cv::Mat>& rightPts,
+                  const size_t first,
+                  const size_t last ) const;
+
+  void getArrays( std::vector<cv::Mat>& objectPts,
+                  std::vector<cv::Mat>& leftPts,
+                  std::vector<cv::Mat>& rightPts ) const
+  {
+    getArrays( objectPts, leftPts, rightPts, 0, m_numViews );
+  }
+
+  //
+  // Drops the views whose entry is zero, in place, keeping the order of the
+  // rest
+  //
+  void keep( const std::vector<char>& keepView );
+
+  //
+  // Maps every corner of every view by x' = sx*x + tx, y' = sy*y + ty
+  //
+  void transform( const double sx, const double sy,
+                  const double tx, const double ty );
+
+  void clear();
+
+private:
+
+  std::vector<cv::Point3f> m_board;
+
+  std::vector<cv::Point2f> m_left;   // m_numViews*m_board.size()
+  std::vector<cv::Point2f> m_right;
+
+  size_t                   m_numViews;
+};
+
+#endif // DUO_VIEW_STORE_H
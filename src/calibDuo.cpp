@@ -1,10 +1,27 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <sstream>
 
 #include <opencv2/calib3d.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 
+#include "DuoBatchCalibration.h"
 #include "DuoCalibrator.h"
+#include "DuoCoverage.h"
+#include "DuoDetectionPipeline.h"
+#include "DuoDisparity.h"
+#include "DuoFrameSource.h"
+#include "DuoIncrementalCalibrator.h"
+#include "DuoPointCloud.h"
+#include "DuoProfiler.h"
+#include "DuoRectificationMonitor.h"
+#include "DuoRecording.h"
+#include "DuoSyntheticSource.h"
 #include "DuoUtility.h"
 
 
@@ -15,6 +32,12 @@ const cv::Scalar RED  (   0,   0, 255 );
 
 const std::string WINDOW_NAME = "Duo Calibration";
 
+//
+// --auto only keeps a pair when the corners moved less than this since the
+// previous detection, in px
+//
+const double MAX_AUTO_MOTION_PX = 1.5;
+
 //
 // Gain, Exposure, and LED valid 0-100
 //
@@ -66,97 +89,722 @@ static void drawLines( cv::Mat& display )
 }
 
 
-int main()
+//
+// Mean distance between corresponding corners of two detections
+//
+static double meanMotion( const std::vector<cv::Point2f>& a,
+                          const std::vector<cv::Point2f>& b )
+{
+  if( a.size() != b.size() || a.empty() ) return HUGE_VAL;
+
+  double sum = 0.0;
+  for( size_t i = 0; i < a.size(); ++i )
+    sum += cv::norm( a[i] - b[i] );
+
+  return sum/a.size();
+}
+
+
+#ifdef DUO_PROFILE
+//
+// Frame rate and p50/p99 ms of the given stages, one text line per group of
+// four stages, starting at y
+//
+static void drawProfile( cv::Mat& display,
+                         const DuoRateMeter& rate,
+                         const DuoStage* stages,
+                         const int numStages,
+                         int y )
+{
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision( 1 ) << "FPS " << rate.rate()
+     << "  (p50/p99 ms)";
+
+  cv::putText( display, ss.str(), cv::Point( 10, y ),
+               cv::FONT_HERSHEY_SIMPLEX, 0.75, WHITE );
+
+  for( int i = 0; i < numStages; i += 4 )
+  {
+    y += 30;
+
+    cv::putText( display,
+                 DuoProfiler::summary( stages + i, std::min( 4, numStages - i ) ),
+                 cv::Point( 10, y ),
+                 cv::FONT_HERSHEY_SIMPLEX,
+                 0.75,
+                 WHITE );
+  }
+}
+#endif
+
+
+//
+// Command line options
+//
+struct Options
+{
+  Options()
+    : pyramid( false )
+    , tracking( true )
+    , circles( false )
+    , compress( false )
+    , realTime( true )
+    , synthetic( false )
+    , profile( false )
+    , autoCapture( false )
+    , autoScore( 0.6 )
+    , bundleAdjust( false )
+    , squareLength( 0.0f )
+    , batchThreads( 0 )
+    , disparity( DuoDisparity::ALGO_SGBM_STRIPS )
+    , disparityScale( 0.0 )
+    , minDepth( 0.0 )
+    , maxDepth( 0.0 )
+    , temporal( false )
+    , cloudStep( 2 )
+    , cloudMinDepth( 0.0 )
+    , cloudMaxDepth( 0.0 )
+    , monitor( false )
+    , monitorThreshold( DUO_MONITOR_THRESHOLD_PX )
+  {}
+
+  bool        pyramid;    // --pyramid: coarse-to-fine chessboard detection
+  bool        tracking;   // --no-tracking: always search the whole frame
+  bool        circles;    // --circles: asymmetric circle grid
+  std::string recordPath; // --record <file>: save frames to a .duorec file
+  bool        compress;   // --compress: PNG-compress recorded frames
+  std::string replayPath; // --replay <file>: play a .duorec file, no camera
+  bool        realTime;   // --fast: replay as fast as possible
+  bool        synthetic;  // --synthetic: simulated stereo rig, no camera
+  bool        profile;    // --profile: stage timings overlay, CSV at exit
+  std::string intrinsicsPath; // --rectify <intrinsics> <extrinsics>: load a
+  std::string extrinsicsPath; // calibration and go straight to rectification
+  bool        autoCapture;    // --auto [score]: keep image sets that add
+  double      autoScore;      // coverage or a new pose, see DuoCoverage
+  bool        bundleAdjust;   // --bundle-adjust: DuoBundleAdjuster instead
+                              // of stereoCalibrate, for many views
+  cv::Size    boardSize;      // --board <w>x<h>: default 9x6, 4x11 circles
+  float       squareLength;   // --square <length>: default the printed target's
+  std::string batchInputDir;  // --batch <input> <output>: headless
+  std::string batchOutputDir; // calibration of every unit under input
+  cv::Size    imageSize;      // --resolution FULL|VGA|QVGA|<w>x<h>: camera
+                              // and calibration resolution, default VGA
+  int         batchThreads;   // --threads <n>: batch worker threads
+  DuoDisparity::Algorithm disparity; // --disparity bm|sgbm|3way|hh|strips
+  double      disparityScale; // --disparity-scale <s>: 1 for full resolution
+  double      minDepth;       // --depth <min> <max>: depths the disparity
+  double      maxDepth;       // range covers, in square length units
+  bool        temporal;       // --temporal: narrow each strip's disparity
+                              // search to the previous frame's band
+  std::string cloudPath;      // --cloud <file>: stream .duopts point clouds
+  int         cloudStep;      // --cloud-step <n>: every n-th disparity pixel
+  double      cloudMinDepth;  // --cloud-depth <min> <max>: depths kept, in
+  double      cloudMaxDepth;  // square length units
+  std::string sessionPath;    // --session <file>: keep image sets in a
+                              // .duoses file, resuming it if it exists
+  std::vector<std::string> mergePaths; // --merge <file>: add the image sets
+                                       // of another session, repeatable
+  bool        monitor;        // --monitor [px]: watch the rectification's
+  double      monitorThreshold; // vertical residual, alert above px
+};
+
+
+//
+// "<w>x<h>", or an empty size if it does not parse
+//
+static cv::Size parseSize( const std::string& text )
+{
+  int w = 0;
+  int h = 0;
+
+  if( sscanf( text.c_str(), "%dx%d", &w, &h ) != 2 || w <= 0 || h <= 0 )
+  {
+    std::cout << "Ignoring size " << text << ", expected <width>x<height>\n";
+    return cv::Size();
+  }
+
+  return cv::Size( w, h );
+}
+
+
+//
+// FULL (752x480), VGA, QVGA (binned), or "<w>x<h>"
+//
+static cv::Size parseResolution( const std::string& text )
+{
+  if( text == "FULL" ) return DUO_FULL;
+  if( text == "VGA" )  return VGA;
+  if( text == "QVGA" ) return QVGA;
+
+  return parseSize( text );
+}
+
+
+static DuoDisparity::Algorithm parseDisparityAlgorithm( const std::string& text )
+{
+  if( text == "bm" )     return DuoDisparity::ALGO_BM;
+  if( text == "sgbm" )   return DuoDisparity::ALGO_SGBM;
+  if( text == "3way" )   return DuoDisparity::ALGO_SGBM_3WAY;
+  if( text == "hh" )     return DuoDisparity::ALGO_HH;
+  if( text != "strips" )
+    std::cout << "Unknown disparity algorithm " << text << ", using strips\n";
+
+  return DuoDisparity::ALGO_SGBM_STRIPS;
+}
+
+
+static Options parseOptions( int argc, char** argv )
+{
+  Options options;
+
+  for( int i = 1; i < argc; ++i )
+  {
+    const std::string arg( argv[i] );
+
+    if( arg == "--pyramid" )
+    {
+      options.pyramid = true;
+    }
+    else if( arg == "--no-tracking" )
+    {
+      options.tracking = false;
+    }
+    else if( arg == "--circles" )
+    {
+      options.circles = true;
+    }
+    else if( arg == "--record" && i + 1 < argc )
+    {
+      options.recordPath = argv[++i];
+    }
+    else if( arg == "--compress" )
+    {
+      options.compress = true;
+    }
+    else if( arg == "--replay" && i + 1 < argc )
+    {
+      options.replayPath = argv[++i];
+    }
+    else if( arg == "--fast" )
+    {
+      options.realTime = false;
+    }
+    else if( arg == "--synthetic" )
+    {
+      options.synthetic = true;
+    }
+    else if( arg == "--rectify" && i + 2 < argc )
+    {
+      options.intrinsicsPath = argv[++i];
+      options.extrinsicsPath = argv[++i];
+    }
+    else if( arg == "--profile" )
+    {
+#ifdef DUO_PROFILE
+      options.profile = true;
+#else
+      std::cout << "Built without DUO_PROFILE, ignoring --profile\n";
+#endif
+    }
+    else if( arg == "--auto" )
+    {
+      options.autoCapture = true;
+
+      if( i + 1 < argc && atof( argv[i+1] ) > 0.0 )
+        options.autoScore = atof( argv[++i] );
+    }
+    else if( arg == "--bundle-adjust" )
+    {
+      options.bundleAdjust = true;
+    }
+    else if( arg == "--board" && i + 1 < argc )
+    {
+      options.boardSize = parseSize( argv[++i] );
+    }
+    else if( arg == "--square" && i + 1 < argc )
+    {
+      options.squareLength = float( atof( argv[++i] ) );
+    }
+    else if( arg == "--batch" && i + 2 < argc )
+    {
+      options.batchInputDir  = argv[++i];
+      options.batchOutputDir = argv[++i];
+    }
+    else if( ( arg == "--resolution" || arg == "--size" ) && i + 1 < argc )
+    {
+      options.imageSize = parseResolution( argv[++i] );
+    }
+    else if( arg == "--threads" && i + 1 < argc )
+    {
+      options.batchThreads = atoi( argv[++i] );
+    }
+    else if( arg == "--disparity" && i + 1 < argc )
+    {
+      options.disparity = parseDisparityAlgorithm( argv[++i] );
+    }
+    else if( arg == "--disparity-scale" && i + 1 < argc )
+    {
+      options.disparityScale = atof( argv[++i] );
+    }
+    else if( arg == "--temporal" )
+    {
+      options.temporal = true;
+    }
+    else if( arg == "--cloud" && i + 1 < argc )
+    {
+      options.cloudPath = argv[++i];
+    }
+    else if( arg == "--cloud-step" && i + 1 < argc )
+    {
+      options.cloudStep = atoi( argv[++i] );
+    }
+    else if( arg == "--cloud-depth" && i + 2 < argc )
+    {
+      options.cloudMinDepth = atof( argv[++i] );
+      options.cloudMaxDepth = atof( argv[++i] );
+    }
+    else if( arg == "--depth" && i + 2 < argc )
+    {
+      options.minDepth = atof( argv[++i] );
+      options.maxDepth = atof( argv[++i] );
+    }
+    else if( arg == "--session" && i + 1 < argc )
+    {
+      options.sessionPath = argv[++i];
+    }
+    else if( arg == "--merge" && i + 1 < argc )
+    {
+      options.mergePaths.push_back( argv[++i] );
+    }
+    else if( arg == "--monitor" )
+    {
+      options.monitor = true;
+
+      if( i + 1 < argc && atof( argv[i+1] ) > 0.0 )
+        options.monitorThreshold = atof( argv[++i] );
+    }
+    else
+    {
+      std::cout << "Ignoring unknown option " << arg << "\n";
+    }
+  }
+
+  return options;
+}
+
+
+int main( int argc, char** argv )
 {
+  const Options options = parseOptions( argc, argv );
+
+  const cv::Size imageSize =
+      options.imageSize.area() > 0 ? options.imageSize : VGA;
+
+  //
+  // The printed chessboard has 9x6 inner corners, the circle grid 4x11 circles
+  //
+  const cv::Size boardSize =
+      options.boardSize.area() > 0 ? options.boardSize
+                                 : options.circles ? cv::Size( 4, 11 )
+                                                   : cv::Size( 9, 6 );
+
+  if( !options.batchInputDir.empty() )
+  {
+    DuoBatchOptions batch;
+    batch.inputDir     = options.batchInputDir;
+    batch.outputDir    = options.batchOutputDir;
+    batch.boardSize    = boardSize;
+    batch.squareLength = options.squareLength;
+    batch.circles      = options.circles;
+    batch.pyramid      = options.pyramid;
+    batch.bundleAdjust = options.bundleAdjust;
+    batch.numThreads   = options.batchThreads;
+    batch.imageSize    = imageSize;
+
+    return RunBatchCalibration( batch );
+  }
+
   printf( "DUOLib Version:       v%s\n", GetLibVersion() );
 
+  DuoCalibrator calibDuo( boardSize,
+                          options.circles
+                            ? DuoCalibrator::PATTERN_ASYMMETRIC_CIRCLES
+                            : DuoCalibrator::PATTERN_CHESSBOARD,
+                          imageSize,
+                          options.squareLength );
+
+  if( options.pyramid )
+    calibDuo.setDetectionMode( DuoCalibrator::DETECT_PYRAMID );
+
+  calibDuo.setTracking( options.tracking );
+
+  if( options.bundleAdjust )
+    calibDuo.setSolver( DuoCalibrator::SOLVER_BUNDLE_ADJUST );
+
+  calibDuo.getDisparityEngine().setAlgorithm( options.disparity );
+  calibDuo.getDisparityEngine().setTemporal( options.temporal );
+  calibDuo.setDisparityScale( options.disparityScale );
+  calibDuo.setDepthRange( options.minDepth, options.maxDepth );
+
+  std::unique_ptr<DuoFrameSource> source;
+
+  DuoCameraSource* camera = nullptr;
+
+  if( !options.replayPath.empty() )
+  {
+    //
+    // Play back a recorded session instead of using the camera
+    //
+    DuoReplaySource* replay = new DuoReplaySource();
+    source.reset( replay );
+
+    if( !replay->open( options.replayPath, options.realTime ) ||
+        replay->getSize() != imageSize )
+    {
+      printf( "Could not open %dx%d recording %s\n",
+              imageSize.width, imageSize.height, options.replayPath.c_str() );
+      return 0;
+    }
+
+    printf( "Replaying %d frames from %s\n",
+            (int) replay->getNumFrames(), options.replayPath.c_str() );
+  }
+  else if( options.synthetic )
+  {
+    //
+    // Render the target through a simulated DUO
+    //
+    DuoSyntheticSource* synthetic =
+        new DuoSyntheticSource( DuoStereoRig::makeDefault( imageSize ),
+                                boardSize,
+                                options.circles,
+                                calibDuo.getObjectPoints(),
+                                GetTargetImagePath( options.circles ),
+                                300 );
+    source.reset( synthetic );
+
+    if( !synthetic->isValid() ) return 0;
+  }
+  else
+  {
+    //
+    // Open DUO camera and start capturing
+    //
+    camera = new DuoCameraSource( imageSize );
+    source.reset( camera );
+
+    if( !camera->open( FPS ) )
+    {
+      printf( "Could not open DUO camera\n" );
+      return 0;
+    }
+
+    //
+    // Set initial exposure, gain, and LED power
+    //
+    SetExposure( EXPOSURE );
+    SetGain( GAIN );
+    SetLED( LED );
+  }
+
+  if( camera != nullptr )
+    calibDuo.setSerialNumber( camera->getSerial() );
+
   //
-  // Open DUO camera and start capturing
+  // Fast start: skip capture and calibration
   //
-  if( !OpenDUOCamera( WIDTH_VGA, HEIGHT_VGA, FPS ) )
+  const bool rectifyOnly = !options.intrinsicsPath.empty();
+
+  if( rectifyOnly &&
+      !calibDuo.load( options.intrinsicsPath, options.extrinsicsPath ) )
+    return 0;
+
+  DuoRecorder recorder;
+
+  if( !options.recordPath.empty() &&
+      !recorder.open( options.recordPath, imageSize, options.compress ) )
   {
-    printf( "Could not open DUO camera\n" );
+    printf( "Could not create recording %s\n", options.recordPath.c_str() );
     return 0;
   }
 
   //
-  // Set initial exposure, gain, and LED power
+  // Image sets of earlier sessions: those of --session, then of each --merge
   //
-  SetExposure( EXPOSURE );
-  SetGain( GAIN );
-  SetLED( LED );
+  if( !rectifyOnly )
+  {
+    if( !options.sessionPath.empty() &&
+        !calibDuo.openSession( options.sessionPath ) )
+    {
+      printf( "Could not open session %s\n", options.sessionPath.c_str() );
+      return 0;
+    }
+
+    for( const std::string& path : options.mergePaths )
+    {
+      const int numMerged = calibDuo.mergeSession( path );
+
+      if( numMerged >= 0 )
+        std::cout << "Merged " << numMerged << " image sets from " << path << "\n";
+    }
+  }
 
   cv::namedWindow( WINDOW_NAME, CV_GUI_NORMAL | CV_WINDOW_NORMAL );
 
   createTrackbars();
 
-  cv::Mat left  = cv::Mat( VGA, CV_8U );
-  cv::Mat right = cv::Mat( VGA, CV_8U );
+  cv::Mat display = cv::Mat::zeros( imageSize.height, 2*imageSize.width, CV_8UC3 );
+
+  cv::Mat leftDisplay  = display.colRange( 0, imageSize.width );
+  cv::Mat rightDisplay = display.colRange( imageSize.width, 2*imageSize.width );
+
+  cv::Mat left;
+  cv::Mat right;
+
+  uint64_t seq       = 0;
+  uint32_t timeStamp = 0;
+
+  //
+  // Next stereo frame from the source, recorded if asked.
+  // Returns false when no frame is available (yet).
+  //
+  auto grabFrame = [&]() -> bool
+  {
+    {
+      DUO_PROFILE_SCOPE( DUO_STAGE_CAPTURE_WAIT );
+
+      if( !source->grab( left, right, seq, timeStamp ) ) return false;
+    }
+
+    if( recorder.isOpen() )
+      recorder.write( left, right, seq, timeStamp );
+
+    return true;
+  };
+
+  if( !rectifyOnly )
+    std::cout << "Press a key to begin taking calibration images.\n";
+
+  //
+  // Capture -> detection (worker thread) -> display
+  // Detection runs on its own thread so a slow or failed board search never
+  // holds back the preview; the preview shows the newest detection result.
+  //
+  // Kept pairs are also solved for in the background, so the running
+  // reprojection error is known during capture and the final solve starts
+  // from a near-converged estimate.
+  //
+  // Neither worker is started when only rectifying.
+  //
+  std::unique_ptr<DuoDetectionPipeline>     pipeline;
+  std::unique_ptr<DuoIncrementalCalibrator> incremental;
+
+  if( !rectifyOnly )
+  {
+    pipeline.reset( new DuoDetectionPipeline( calibDuo ) );
+    incremental.reset( new DuoIncrementalCalibrator( calibDuo.getImageSize() ) );
+  }
+
+  DuoCalibrationEstimate estimate;
+
+  //
+  // What the kept image sets cover; with --auto, a pair is kept without a
+  // key press when it adds enough of it
+  //
+  DuoCoverage coverage( calibDuo.getImageSize(), boardSize );
+
+  //
+  // Resumed and merged image sets count from the start
+  //
+  if( !rectifyOnly )
+  {
+    const DuoViewStore& imageSets = calibDuo.getImageSets();
+    const size_t        n         = imageSets.getPointsPerView();
+
+    for( size_t i = 0; i < imageSets.size(); ++i )
+    {
+      const std::vector<cv::Point2f> leftPts( imageSets.left( i ),
+                                              imageSets.left( i ) + n );
+      const std::vector<cv::Point2f> rightPts( imageSets.right( i ),
+                                               imageSets.right( i ) + n );
+
+      incremental->addView( calibDuo.getObjectPoints(), leftPts, rightPts );
+      coverage.add( leftPts, rightPts );
+    }
+  }
+
+  DuoDetection detection;
+  DuoDetection keeper;
+
+  uint64_t lastKeptId   = 0;
+  uint64_t lastScoredId = 0;
 
-  cv::Mat display = cv::Mat::zeros( VGA.height, 2*VGA.width, CV_8UC3 );
+  std::vector<cv::Point2f> previousPts;
 
-  cv::Mat leftDisplay  = display.colRange( 0, VGA.width );
-  cv::Mat rightDisplay = display.colRange( VGA.width, 2*VGA.width );
+  auto keepImageSet = [&]( const DuoDetection& pair )
+  {
+    const size_t numKept = calibDuo.getNumImageSets();
+
+    calibDuo.keepImageSet( pair.leftPts, pair.rightPts );
+
+    if( calibDuo.getNumImageSets() > numKept )
+    {
+      incremental->addView( calibDuo.getObjectPoints(),
+                           pair.leftPts, pair.rightPts );
+      coverage.add( pair.leftPts, pair.rightPts );
+    }
 
-  const cv::Size boardSize( 9, 6 );
+    lastKeptId = pair.frameId;
+  };
 
-  DuoCalibrator calibDuo( boardSize );
+#ifdef DUO_PROFILE
+  DuoRateMeter rate;
 
-  std::cout << "Press a key to begin taking calibration images.\n";
+  const DuoStage captureStages[] =
+  {
+    DUO_STAGE_CAPTURE_WAIT, DUO_STAGE_DETECT, DUO_STAGE_SUBPIX,
+    DUO_STAGE_CVT_COLOR, DUO_STAGE_DRAW, DUO_STAGE_IMSHOW
+  };
+#endif
 
-  bool isActive = true;
+  bool isActive = !rectifyOnly;
 
   while( isActive )
   {
+    DUO_PROFILE_SCOPE( DUO_STAGE_FRAME );
+
     //
     // Capture DUO frame
     //
-    PDUOFrame pFrameData = GetDUOFrame();
-    if( pFrameData == nullptr ) continue;
+    if( !grabFrame() )
+    {
+      if( source->isFinished() ) break;
+      continue;
+    }
 
-    //
-    // Set the image data
-    //
-    left.data  = (uint8_t*) pFrameData->leftData;
-    right.data = (uint8_t*) pFrameData->rightData;
+    const uint64_t frameId = pipeline->submit( left, right );
 
-    static std::vector<cv::Point2f> leftPts;
-    static std::vector<cv::Point2f> rightPts;
+    {
+      DUO_PROFILE_SCOPE( DUO_STAGE_CVT_COLOR );
 
-    calibDuo.processFrame( left, right, leftPts, rightPts );
+      cv::cvtColor( left,  leftDisplay,  cv::COLOR_GRAY2BGR );
+      cv::cvtColor( right, rightDisplay, cv::COLOR_GRAY2BGR );
+    }
 
-    cv::cvtColor( left,  leftDisplay,  cv::COLOR_GRAY2BGR );
-    cv::cvtColor( right, rightDisplay, cv::COLOR_GRAY2BGR );
+    {
+      DUO_PROFILE_SCOPE( DUO_STAGE_DRAW );
 
-    const bool foundL = leftPts.size()  == boardSize.area();
-    const bool foundR = rightPts.size() == boardSize.area();
+      coverage.drawHeatmap( 0, leftDisplay );
+      coverage.drawHeatmap( 1, rightDisplay );
 
-    cv::drawChessboardCorners( leftDisplay,  boardSize, leftPts,  foundL );
-    cv::drawChessboardCorners( rightDisplay, boardSize, rightPts, foundR );
+      if( pipeline->latest( detection ) )
+      {
+        const bool foundL = detection.leftPts.size()  == boardSize.area();
+        const bool foundR = detection.rightPts.size() == boardSize.area();
 
-    std::stringstream ss;
-    ss << "Press any key to capture a frame, ESC to begin calibration";
+        cv::drawChessboardCorners( leftDisplay,  boardSize,
+                                   detection.leftPts,  foundL );
+        cv::drawChessboardCorners( rightDisplay, boardSize,
+                                   detection.rightPts, foundR );
+      }
 
-    cv::putText( display,
-                 ss.str(),
-                 cv::Point( 10, 30 ),
-                 cv::FONT_HERSHEY_SIMPLEX,
-                 0.75,
-                 WHITE );
+      std::stringstream ss;
+      ss << "Press any key to capture a frame, ESC to begin calibration";
 
-    ss.str("");
-    ss << "# Image Sets = " << calibDuo.getNumImageSets();
+      cv::putText( display,
+                   ss.str(),
+                   cv::Point( 10, 30 ),
+                   cv::FONT_HERSHEY_SIMPLEX,
+                   0.75,
+                   WHITE );
 
-    cv::putText( display,
-                 ss.str(),
-                 cv::Point( 10, 60 ),
-                 cv::FONT_HERSHEY_SIMPLEX,
-                 0.75,
-                 WHITE );
+      ss.str("");
+      ss << "# Image Sets = " << calibDuo.getNumImageSets()
+         << std::fixed << std::setprecision( 0 )
+         << ", coverage L " << 100.0*coverage.getCoverage( 0 )
+         << "% R " << 100.0*coverage.getCoverage( 1 )
+         << "%, poses " << coverage.getNumPosesSeen()
+         << "/" << DuoCoverage::getNumPoseBins()
+         << ( options.autoCapture ? " (auto)" : "" );
+
+      cv::putText( display,
+                   ss.str(),
+                   cv::Point( 10, 60 ),
+                   cv::FONT_HERSHEY_SIMPLEX,
+                   0.75,
+                   WHITE );
+
+      ss.str("");
+      ss << std::fixed << std::setprecision( 1 )
+         << "Detect " << detection.detectMs << " ms"
+         << " (find L " << detection.timings.findMs[0]
+         << " / R " << detection.timings.findMs[1]
+         << ", refine " << detection.timings.refineMs
+         << "), "
+         << "lag " << ( detection.frameId > 0 ? frameId - detection.frameId : 0 )
+         << " frames, skipped " << pipeline->getNumSkipped()
+         << ", missed " << ( camera ? camera->getNumMissed() : 0 )
+         << ", dropped " << GetDUODroppedFrames();
+
+      cv::putText( display,
+                   ss.str(),
+                   cv::Point( 10, 90 ),
+                   cv::FONT_HERSHEY_SIMPLEX,
+                   0.75,
+                   WHITE );
 
-    cv::imshow( WINDOW_NAME, display );
+      if( incremental->latest( estimate ) )
+      {
+        ss.str("");
+        ss << std::fixed << std::setprecision( 3 )
+           << "Calibration: " << estimate.numViews << " views, RMS "
+           << estimate.errorX << " px (L " << estimate.errorL
+           << " / R " << estimate.errorR << ")";
+
+        cv::putText( display,
+                     ss.str(),
+                     cv::Point( 10, 120 ),
+                     cv::FONT_HERSHEY_SIMPLEX,
+                     0.75,
+                     WHITE );
+      }
+
+#ifdef DUO_PROFILE
+      if( options.profile )
+        drawProfile( display, rate, captureStages, 6, 150 );
+#endif
+    }
+
+    //
+    // Auto capture. The board must be held still, within MAX_AUTO_MOTION_PX
+    // of the previous detection, so that a kept pair is sharp.
+    //
+    if( options.autoCapture && detection.valid &&
+        detection.frameId != lastScoredId )
+    {
+      lastScoredId = detection.frameId;
+
+      if( meanMotion( detection.leftPts, previousPts ) < MAX_AUTO_MOTION_PX &&
+          coverage.score( detection.leftPts,
+                          detection.rightPts ) >= options.autoScore )
+        keepImageSet( detection );
+
+      previousPts.assign( detection.leftPts.begin(), detection.leftPts.end() );
+    }
+
+    int key = -1;
+
+    {
+      DUO_PROFILE_SCOPE( DUO_STAGE_IMSHOW );
 
-    const int key = cv::waitKey(10);
+      cv::imshow( WINDOW_NAME, display );
+
+      key = cv::waitKey(10);
+    }
+
+#ifdef DUO_PROFILE
+    rate.tick();
+#endif
 
     if( key >= 0 )
     {
@@ -169,67 +817,249 @@ int main()
       }
 
       //
-      // Any key press is a command to keep a calibration pair
+      // Any key press is a command to keep a calibration pair: the newest
+      // frame that had a full board in both views
       //
-      calibDuo.keepMostRecent();
+      if( pipeline->newestValid( keeper ) && keeper.frameId != lastKeptId )
+        keepImageSet( keeper );
     }
   }
 
-  std::cout << "Finished taking calibration images.\n";
+  if( !rectifyOnly )
+  {
+    pipeline->stop();
+    incremental->stop();
+
+    std::cout << "Finished taking calibration images.\n";
 
-  calibDuo.calibrate();
+    if( incremental->latest( estimate ) )
+    {
+      std::cout << "Starting from the estimate of " << estimate.numViews
+                << " views (RMS " << estimate.errorX << " px)\n";
+
+      calibDuo.setInitialGuess( estimate.M1, estimate.D1,
+                                estimate.M2, estimate.D2 );
+    }
+
+    //
+    // Show the rectification on a recorded or synthetic session from the start
+    //
+    source->rewind();
 
-  std::cout << "Stereo calibration completed.\n";
+    calibDuo.calibrate();
+
+    std::cout << "Stereo calibration completed.\n";
+  }
 
   const std::string DISP_WINDOW_NAME( "Disparity" );
 
+  //
+  // Metric points of every frame's disparity, streamed with --cloud; 'p'
+  // saves the current one as a PLY file
+  //
+  DuoPointCloud cloud;
+  cloud.setDecimation( options.cloudStep );
+  cloud.setDepthRange( options.cloudMinDepth, options.cloudMaxDepth );
+
+  DuoPointCloudWriter cloudWriter;
+
+  if( !options.cloudPath.empty() && !cloudWriter.open( options.cloudPath ) )
+  {
+    printf( "Could not create point cloud stream %s\n", options.cloudPath.c_str() );
+    return 0;
+  }
+
+  int numSnapshots = 0;
+
+  //
+  // Reused from frame to frame
+  //
+  cv::Mat newLeft;
+  cv::Mat newRight;
+  cv::Mat disp;
+
+  DuoDisparity& engine = calibDuo.getDisparityEngine();
+
+  //
+  // --monitor: sampled check of the rectification on a worker thread, within
+  // a fixed share of one core; warns when the mount seems to have shifted
+  //
+  std::unique_ptr<DuoRectificationMonitor> monitor;
+
+  if( options.monitor )
+    monitor.reset( new DuoRectificationMonitor( options.monitorThreshold ) );
+
+  DuoRectificationQuality quality;
+  bool                    alerted = false;
+
   cv::namedWindow( DISP_WINDOW_NAME, CV_GUI_NORMAL | CV_WINDOW_NORMAL );
 
+#ifdef DUO_PROFILE
+  const DuoStage rectifyStages[] =
+  {
+    DUO_STAGE_CAPTURE_WAIT, DUO_STAGE_RECTIFY, DUO_STAGE_SGBM,
+    DUO_STAGE_CLOUD, DUO_STAGE_CVT_COLOR, DUO_STAGE_DRAW, DUO_STAGE_IMSHOW
+  };
+#endif
+
   isActive = true;
 
   while( isActive )
   {
+    DUO_PROFILE_SCOPE( DUO_STAGE_FRAME );
+
     //
     // Capture DUO frame
     //
-    PDUOFrame pFrameData = GetDUOFrame();
-    if( pFrameData == nullptr ) continue;
+    if( !grabFrame() )
+    {
+      if( source->isFinished() ) break;
+      continue;
+    }
 
-    //
-    // Set the image data
-    //
-    left.data  = (uint8_t*) pFrameData->leftData;
-    right.data = (uint8_t*) pFrameData->rightData;
+    {
+      DUO_PROFILE_SCOPE( DUO_STAGE_RECTIFY );
 
-    const cv::Mat& newLeft  = calibDuo.undistortAndRectifyLeft( left );
-    const cv::Mat& newRight = calibDuo.undistortAndRectifyRight( right );
+      calibDuo.undistortAndRectify( left, right, newLeft, newRight );
+    }
 
-    cv::cvtColor( newLeft,  leftDisplay,  cv::COLOR_GRAY2BGR );
-    cv::cvtColor( newRight, rightDisplay, cv::COLOR_GRAY2BGR );
+    if( monitor && monitor->submit( newLeft, newRight ) &&
+        monitor->latest( quality ) && quality.alert != alerted )
+    {
+      alerted = quality.alert;
 
-    drawLines( display );
+      if( alerted )
+        std::cout << "Rectification residual " << quality.driftPx
+                  << " px is above " << options.monitorThreshold
+                  << " px: the rig may have moved, recalibrate\n";
+      else
+        std::cout << "Rectification residual back to " << quality.driftPx
+                  << " px\n";
+    }
 
-    cv::putText( display,
-                 "Press ESC to terminate",
-                 cv::Point( 10, 30 ),
-                 cv::FONT_HERSHEY_SIMPLEX,
-                 0.75,
-                 WHITE );
+    {
+      DUO_PROFILE_SCOPE( DUO_STAGE_CVT_COLOR );
 
-    cv::imshow( WINDOW_NAME, display );
+      cv::cvtColor( newLeft,  leftDisplay,  cv::COLOR_GRAY2BGR );
+      cv::cvtColor( newRight, rightDisplay, cv::COLOR_GRAY2BGR );
+    }
 
-    const cv::Mat& disp = calibDuo.getDisparity( newLeft, newRight );
+    {
+      DUO_PROFILE_SCOPE( DUO_STAGE_DRAW );
+
+      drawLines( display );
+
+      cv::putText( display,
+                   "Press ESC to terminate",
+                   cv::Point( 10, 30 ),
+                   cv::FONT_HERSHEY_SIMPLEX,
+                   0.75,
+                   WHITE );
 
-    cv::imshow( DISP_WINDOW_NAME, disp );
+      //
+      // The previous frame's search, this one's is still to come
+      //
+      std::stringstream ss;
+      ss << std::fixed << std::setprecision( 0 )
+         << "Disparity " << engine.getMinDisparity() << "-"
+         << engine.getMinDisparity() + engine.getNumDisparities()
+         << " px, searched " << 100.0*engine.getSearchFraction() << "%";
 
-    if( cv::waitKey( 5 ) == 27 )
+      if( engine.getTemporal() )
+        ss << ", re-matched " << engine.getNumRematched() << "/"
+           << engine.getNumStrips() << " strips";
+
+      cv::putText( display,
+                   ss.str(),
+                   cv::Point( 10, 60 ),
+                   cv::FONT_HERSHEY_SIMPLEX,
+                   0.75,
+                   WHITE );
+
+      if( monitor && quality.numSamples > 0 )
+      {
+        std::stringstream mm;
+        mm << std::fixed << std::setprecision( 2 )
+           << "Epipolar residual " << quality.driftPx << " px ("
+           << quality.numMatches << " matches, "
+           << std::setprecision( 1 ) << 100.0*quality.cpuFraction << "% CPU)";
+
+        cv::putText( display,
+                     mm.str(),
+                     cv::Point( 10, 90 ),
+                     cv::FONT_HERSHEY_SIMPLEX,
+                     0.75,
+                     quality.alert ? RED : WHITE );
+      }
+
+#ifdef DUO_PROFILE
+      if( options.profile )
+        drawProfile( display, rate, rectifyStages, 7, 120 );
+#endif
+    }
+
+    const cv::Mat& rawDisp = calibDuo.computeDisparity( left, right );
+
+    if( cloudWriter.isOpen() )
+    {
+      cloud.compute( rawDisp, engine.getMinDisparity(),
+                     calibDuo.getDisparityQ(), calibDuo.getDisparityLeft() );
+
+      cloudWriter.write( cloud, seq, timeStamp );
+    }
+
+    engine.colorize( rawDisp, disp );
+
+    int key = -1;
+
+    {
+      DUO_PROFILE_SCOPE( DUO_STAGE_IMSHOW );
+
+      cv::imshow( WINDOW_NAME, display );
+      cv::imshow( DISP_WINDOW_NAME, disp );
+
+      key = cv::waitKey( 5 );
+    }
+
+#ifdef DUO_PROFILE
+    rate.tick();
+#endif
+
+    if( key == 27 )
     {
       //
       // Terminate the program with ESC
       //
       isActive = false;
     }
+    else if( key == 'p' )
+    {
+      if( !cloudWriter.isOpen() )
+        cloud.compute( rawDisp, engine.getMinDisparity(),
+                       calibDuo.getDisparityQ(), calibDuo.getDisparityLeft() );
+
+      std::stringstream path;
+      path << "cloud" << numSnapshots++ << ".ply";
+
+      if( cloud.writePly( path.str() ) )
+        std::cout << cloud.getNumPoints() << " points written to "
+                  << path.str() << "\n";
+    }
+  }
+
+  if( cloudWriter.isOpen() )
+    std::cout << cloudWriter.getNumFrames() << " point clouds written to "
+              << options.cloudPath << "\n";
+
+#ifdef DUO_PROFILE
+  if( options.profile )
+  {
+    DuoProfiler::print();
+
+    if( DuoProfiler::writeCsv( "calibDuoProfile.csv" ) )
+      std::cout << "Stage histograms written to calibDuoProfile.csv\n";
   }
+#endif
 
   return 0;
 }
@@ -0,0 +1,460 @@
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+
+#include <opencv2/calib3d.hpp>
+
+#include "DuoCalibrator.h"
+#include "DuoSelfCheck.h"
+#include "DuoSyntheticSource.h"
+
+
+//
+// Tolerances for the default synthetic rig: 2 gray levels of noise and 0.6 px
+// of blur at VGA. Well calibrated views land far inside these.
+//
+const double MAX_REPROJECTION_PX = 0.5;   // stereoCalibrate RMS
+const double MAX_FOCAL_PX        = 1.0;   // fx, fy
+const double MAX_CENTER_PX       = 2.0;   // cx, cy
+const double MAX_MAPPING_PX      = 0.5;   // RMS, see mappingError()
+const double MAX_ROTATION_DEG    = 0.1;   // R
+const double MAX_TRANSLATION_CM  = 0.05;  // T
+
+
+//
+// Distortion coefficients of the rational model are strongly correlated, so
+// they are not compared one by one. Instead a grid of viewing rays is
+// projected through the true and the recovered intrinsics, and the pixel
+// distance between the two is measured wherever the true projection lies in
+// the central 80% of the image, which is the part the board poses cover.
+//
+static void mappingError( const cv::Mat& trueM,
+                          const cv::Mat& trueD,
+                          const cv::Mat& M,
+                          const cv::Mat& D,
+                          const cv::Size& imageSize,
+                          double& rmsOut,
+                          double& maxOut )
+{
+  std::vector<cv::Point3f> rays;
+  for( float y = -1.0f; y <= 1.0f; y += 0.02f )
+    for( float x = -1.2f; x <= 1.2f; x += 0.02f )
+      rays.push_back( cv::Point3f( x, y, 1.0f ) );
+
+  const cv::Mat zero = cv::Mat::zeros( 3, 1, CV_64F );
+
+  std::vector<cv::Point2f> truePts;
+  std::vector<cv::Point2f> pts;
+  cv::projectPoints( rays, zero, zero, trueM, trueD, truePts );
+  cv::projectPoints( rays, zero, zero, M,     D,     pts );
+
+  const cv::Rect2f central( 0.1f*imageSize.width,
+                            0.1f*imageSize.height,
+                            0.8f*imageSize.width,
+                            0.8f*imageSize.height );
+
+  double sum = 0.0;
+  size_t n   = 0;
+
+  maxOut = 0.0;
+
+  for( size_t i = 0; i < rays.size(); ++i )
+  {
+    if( !central.contains( truePts[i] ) ) continue;
+
+    const double d = cv::norm( truePts[i] - pts[i] );
+
+    sum += d*d;
+    maxOut = std::max( maxOut, d );
+    ++n;
+  }
+
+  rmsOut = ( n > 0 ) ? std::sqrt( sum/n ) : 0.0;
+}
+
+
+static bool check( const std::string& name,
+                   const double value,
+                   const double tolerance )
+{
+  const bool ok = value <= tolerance;
+
+  std::cout << "  " << std::left << std::setw( 28 ) << name
+            << std::right << std::fixed << std::setprecision( 4 )
+            << std::setw( 10 ) << value << "  <= "
+            << std::setw( 8 ) << tolerance
+            << ( ok ? "  ok\n" : "  FAILED\n" );
+
+  return ok;
+}
+
+
+static void printStage( const std::string& name,
+                        const double totalMs,
+                        const size_t count )
+{
+  std::cout << "  " << std::left << std::setw( 28 ) << name
+            << std::right << std::fixed << std::setprecision( 2 )
+            << std::setw( 10 ) << totalMs/std::max( count, size_t( 1 ) )
+            << " ms x " << count << "\n";
+}
+
+
+int RunSelfCheck( const int numViews,
+                  const bool circles,
+                  const bool pyramid,
+                  const bool bundleAdjust )
+{
+  const cv::Size boardSize = circles ? cv::Size( 4, 11 ) : cv::Size( 9, 6 );
+
+  DuoCalibrator calibDuo( boardSize,
+                          circles ? DuoCalibrator::PATTERN_ASYMMETRIC_CIRCLES
+                                  : DuoCalibrator::PATTERN_CHESSBOARD );
+
+  if( pyramid )
+    calibDuo.setDetectionMode( DuoCalibrator::DETECT_PYRAMID );
+
+  if( bundleAdjust )
+    calibDuo.setSolver( DuoCalibrator::SOLVER_BUNDLE_ADJUST );
+
+  //
+  // Views are independent poses, a track from the previous one is no help
+  //
+  calibDuo.setTracking( false );
+
+  const DuoStereoRig rig = DuoStereoRig::makeDefault( VGA );
+
+  int64 t = cv::getTickCount();
+
+  DuoSyntheticSource source( rig,
+                             boardSize,
+                             circles,
+                             calibDuo.getObjectPoints(),
+                             GetTargetImagePath( circles ),
+                             numViews );
+
+  const double setupMs = TicksToMs( cv::getTickCount() - t );
+
+  if( !source.isValid() ) return 1;
+
+  cv::Mat  left;
+  cv::Mat  right;
+  uint64_t seq       = 0;
+  uint32_t timeStamp = 0;
+
+  std::vector<cv::Point2f> leftPts;
+  std::vector<cv::Point2f> rightPts;
+
+  double renderMs = 0.0;
+  double detectMs = 0.0;
+  size_t frames   = 0;
+
+  while( true )
+  {
+    t = cv::getTickCount();
+
+    if( !source.grab( left, right, seq, timeStamp ) ) break;
+
+    renderMs += TicksToMs( cv::getTickCount() - t );
+
+    t = cv::getTickCount();
+
+    calibDuo.processFrame( left, right, leftPts, rightPts );
+
+    detectMs += TicksToMs( cv::getTickCount() - t );
+
+    calibDuo.keepImageSet( leftPts, rightPts );
+
+    ++frames;
+  }
+
+  std::cout << "Detected the board in " << calibDuo.getNumImageSets()
+            << " of " << frames << " synthetic views\n";
+
+  if( calibDuo.solve() < 0.0 )
+  {
+    std::cout << "Too few frames, unable to continue with calibration\n";
+    return 1;
+  }
+
+  //
+  // Rectification and disparity on the same views
+  //
+  double undistortMs = 0.0;
+  double disparityMs = 0.0;
+
+  cv::Mat rectLeft;
+  cv::Mat rectRight;
+
+  source.rewind();
+
+  while( source.grab( left, right, seq, timeStamp ) )
+  {
+    t = cv::getTickCount();
+
+    calibDuo.undistortAndRectify( left, right, rectLeft, rectRight );
+
+    undistortMs += TicksToMs( cv::getTickCount() - t );
+
+    t = cv::getTickCount();
+
+    calibDuo.getDisparity( left, right );
+
+    disparityMs += TicksToMs( cv::getTickCount() - t );
+  }
+
+  const DuoCalibrationTimings& timings = calibDuo.getCalibrationTimings();
+
+  std::cout << "\nStage timings\n";
+  printStage( "synthetic setup",         setupMs,             1 );
+  printStage( "render",                  renderMs,            frames );
+  printStage( "detect",                  detectMs,            frames );
+  printStage( bundleAdjust ? "bundle adjustment" : "stereoCalibrate",
+              timings.calibrateMs, 1 );
+  printStage( "stereoRectify",           timings.rectifyMs,   1 );
+  printStage( "initUndistortRectifyMap", timings.mapsMs,      1 );
+  printStage( "undistortAndRectify",     undistortMs,         frames );
+  printStage( "getDisparity",            disparityMs,         frames );
+
+  //
+  // Accuracy against the ground truth rig
+  //
+  const cv::Mat& M1 = calibDuo.getM1();
+  const cv::Mat& M2 = calibDuo.getM2();
+
+  double mapRms[2];
+  double mapMax[2];
+  mappingError( rig.M1, rig.D1, M1, calibDuo.getD1(), rig.imageSize,
+                mapRms[0], mapMax[0] );
+  mappingError( rig.M2, rig.D2, M2, calibDuo.getD2(), rig.imageSize,
+                mapRms[1], mapMax[1] );
+
+  cv::Mat dr;
+  cv::Rodrigues( calibDuo.getR()*rig.R.t(), dr );
+
+  const double rotationDeg    = cv::norm( dr )*180.0/CV_PI;
+  const double translationCm  = cv::norm( calibDuo.getT() - rig.T );
+
+  std::cout << "\nAccuracy\n";
+
+  bool ok = true;
+
+  ok &= check( "reprojection RMS (px)", calibDuo.getReprojectionError(),
+               MAX_REPROJECTION_PX );
+
+  const cv::Mat* M[2]     = { &M1, &M2 };
+  const cv::Mat* trueM[2] = { &rig.M1, &rig.M2 };
+  const char*    side[2]  = { "left", "right" };
+
+  for( int i = 0; i < 2; ++i )
+  {
+    const std::string s( side[i] );
+
+    ok &= check( s + " fx (px)",
+                 std::abs( M[i]->at<double>( 0, 0 ) - trueM[i]->at<double>( 0, 0 ) ),
+                 MAX_FOCAL_PX );
+    ok &= check( s + " fy (px)",
+                 std::abs( M[i]->at<double>( 1, 1 ) - trueM[i]->at<double>( 1, 1 ) ),
+                 MAX_FOCAL_PX );
+    ok &= check( s + " cx (px)",
+                 std::abs( M[i]->at<double>( 0, 2 ) - trueM[i]->at<double>( 0, 2 ) ),
+                 MAX_CENTER_PX );
+    ok &= check( s + " cy (px)",
+                 std::abs( M[i]->at<double>( 1, 2 ) - trueM[i]->at<double>( 1, 2 ) ),
+                 MAX_CENTER_PX );
+    ok &= check( s + " distortion RMS (px)", mapRms[i], MAX_MAPPING_PX );
+
+    std::cout << "  " << std::left << std::setw( 28 )
+              << ( s + " distortion max (px)" )
+              << std::right << std::setw( 10 ) << mapMax[i] << "\n";
+  }
+
+  ok &= check( "R (deg)",  rotationDeg,   MAX_ROTATION_DEG );
+  ok &= check( "T (cm)",   translationCm, MAX_TRANSLATION_CM );
+
+  std::cout << ( ok ? "\nSelf-check passed\n" : "\nSelf-check FAILED\n" );
+
+  return ok ? 0 : 1;
+}
+
+
+//
+// One pattern's calibration of the default rig, and its errors against the
+// rig's ground truth
+//
+struct DuoPatternResult
+{
+  DuoPatternResult()
+    : numFrames( 0 )
+    , numImageSets( 0 )
+    , detectionMeanMs( 0.0 )
+    , detectionRate( 0.0 )
+    , reprojectionPx( -1.0 )
+    , focalPx( 0.0 )
+    , centerPx( 0.0 )
+    , mappingPx( 0.0 )
+    , rotationDeg( 0.0 )
+    , translationCm( 0.0 )
+  {}
+
+  size_t numFrames;
+  size_t numImageSets;
+  double detectionMeanMs;
+  double detectionRate;
+  double reprojectionPx;  // negative if the calibration failed
+  double focalPx;         // largest fx, fy error of either camera
+  double centerPx;        // largest cx, cy error of either camera
+  double mappingPx;       // larger distortion RMS of the two cameras
+  double rotationDeg;
+  double translationCm;
+};
+
+
+static bool calibratePattern( const int numViews,
+                              const bool circles,
+                              const bool pyramid,
+                              const bool bundleAdjust,
+                              DuoPatternResult& result )
+{
+  const cv::Size boardSize = circles ? cv::Size( 4, 11 ) : cv::Size( 9, 6 );
+
+  DuoCalibrator calibDuo( boardSize,
+                          circles ? DuoCalibrator::PATTERN_ASYMMETRIC_CIRCLES
+                                  : DuoCalibrator::PATTERN_CHESSBOARD );
+
+  if( pyramid )
+    calibDuo.setDetectionMode( DuoCalibrator::DETECT_PYRAMID );
+
+  if( bundleAdjust )
+    calibDuo.setSolver( DuoCalibrator::SOLVER_BUNDLE_ADJUST );
+
+  calibDuo.setTracking( false );
+
+  const DuoStereoRig rig = DuoStereoRig::makeDefault( VGA );
+
+  DuoSyntheticSource source( rig,
+                             boardSize,
+                             circles,
+                             calibDuo.getObjectPoints(),
+                             GetTargetImagePath( circles ),
+                             numViews );
+
+  if( !source.isValid() ) return false;
+
+  cv::Mat  left;
+  cv::Mat  right;
+  uint64_t seq       = 0;
+  uint32_t timeStamp = 0;
+
+  std::vector<cv::Point2f> leftPts;
+  std::vector<cv::Point2f> rightPts;
+
+  while( source.grab( left, right, seq, timeStamp ) )
+  {
+    calibDuo.processFrame( left, right, leftPts, rightPts );
+    calibDuo.keepImageSet( leftPts, rightPts );
+  }
+
+  const DuoDetectionStats& stats = calibDuo.getDetectionStats();
+
+  result.numFrames       = stats.numFrames;
+  result.numImageSets    = calibDuo.getNumImageSets();
+  result.detectionMeanMs = stats.getMeanMs();
+  result.detectionRate   = stats.getRate();
+  result.reprojectionPx  = calibDuo.solve();
+
+  if( result.reprojectionPx < 0.0 ) return false;
+
+  const cv::Mat* M[2]     = { &calibDuo.getM1(), &calibDuo.getM2() };
+  const cv::Mat* D[2]     = { &calibDuo.getD1(), &calibDuo.getD2() };
+  const cv::Mat* trueM[2] = { &rig.M1, &rig.M2 };
+  const cv::Mat* trueD[2] = { &rig.D1, &rig.D2 };
+
+  for( int i = 0; i < 2; ++i )
+  {
+    for( int r = 0; r < 2; ++r )
+    {
+      result.focalPx  = std::max( result.focalPx,
+          std::abs( M[i]->at<double>( r, r ) - trueM[i]->at<double>( r, r ) ) );
+      result.centerPx = std::max( result.centerPx,
+          std::abs( M[i]->at<double>( r, 2 ) - trueM[i]->at<double>( r, 2 ) ) );
+    }
+
+    double mapRms = 0.0;
+    double mapMax = 0.0;
+    mappingError( *trueM[i], *trueD[i], *M[i], *D[i], rig.imageSize,
+                  mapRms, mapMax );
+
+    result.mappingPx = std::max( result.mappingPx, mapRms );
+  }
+
+  cv::Mat dr;
+  cv::Rodrigues( calibDuo.getR()*rig.R.t(), dr );
+
+  result.rotationDeg   = cv::norm( dr )*180.0/CV_PI;
+  result.translationCm = cv::norm( calibDuo.getT() - rig.T );
+
+  return true;
+}
+
+
+static void printComparison( const std::string& name,
+                             const double chessboard,
+                             const double circles )
+{
+  std::cout << "  " << std::left << std::setw( 26 ) << name
+            << std::right << std::fixed << std::setprecision( 4 )
+            << std::setw( 12 ) << chessboard
+            << std::setw( 12 ) << circles
+            << std::setw( 12 ) << circles - chessboard << "\n";
+}
+
+
+int RunPatternComparison( const int numViews,
+                          const bool pyramid,
+                          const bool bundleAdjust )
+{
+  DuoPatternResult chessboard;
+  DuoPatternResult circles;
+
+  const bool chessboardOk =
+      calibratePattern( numViews, false, pyramid, bundleAdjust, chessboard );
+  const bool circlesOk =
+      calibratePattern( numViews, true, pyramid, bundleAdjust, circles );
+
+  std::cout << "\nPatterns on the same rig and " << numViews << " poses\n"
+            << "  " << std::left << std::setw( 26 ) << ""
+            << std::right << std::setw( 12 ) << "chessboard"
+            << std::setw( 12 ) << "circles"
+            << std::setw( 12 ) << "difference" << "\n";
+
+  printComparison( "detection mean (ms)",
+                   chessboard.detectionMeanMs, circles.detectionMeanMs );
+  printComparison( "detection rate",
+                   chessboard.detectionRate, circles.detectionRate );
+  printComparison( "image sets kept",
+                   double( chessboard.numImageSets ),
+                   double( circles.numImageSets ) );
+
+  if( !chessboardOk || !circlesOk )
+  {
+    std::cout << "\nCould not calibrate with the "
+              << ( chessboardOk ? "circle grid" : "chessboard" ) << "\n";
+    return 1;
+  }
+
+  printComparison( "reprojection RMS (px)",
+                   chessboard.reprojectionPx, circles.reprojectionPx );
+  printComparison( "fx, fy error (px)",
+                   chessboard.focalPx, circles.focalPx );
+  printComparison( "cx, cy error (px)",
+                   chessboard.centerPx, circles.centerPx );
+  printComparison( "distortion RMS (px)",
+                   chessboard.mappingPx, circles.mappingPx );
+  printComparison( "R error (deg)",
+                   chessboard.rotationDeg, circles.rotationDeg );
+  printComparison( "T error (cm)",
+                   chessboard.translationCm, circles.translationCm );
+
+  return 0;
+}
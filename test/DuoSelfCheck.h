@@ -0,0 +1,34 @@
+#ifndef DUO_SELF_CHECK_H
+#define DUO_SELF_CHECK_H
+
+
+//
+// Headless end-to-end check of DuoCalibrator against DuoSyntheticSource.
+//
+// numViews board poses are rendered through the default synthetic rig,
+// detected, and calibrated; the calibration is then used to rectify the
+// views and compute disparity. The recovered M1/D1/M2/D2/R/T are compared
+// with the rig's ground truth and the cost of every stage is printed. With
+// bundleAdjust, the calibration is solved with DuoBundleAdjuster.
+//
+// Returns 0 if every error is within tolerance, 1 otherwise.
+//
+int RunSelfCheck( const int numViews,
+                  const bool circles,
+                  const bool pyramid,
+                  const bool bundleAdjust = false );
+
+
+//
+// Calibrates the same synthetic rig from the same numViews poses with the
+// chessboard and with the circle grid, and prints one report of both
+// patterns' detection cost and rate and their errors against the ground
+// truth, side by side with their differences.
+//
+// Returns 0 if both patterns calibrated, 1 otherwise.
+//
+int RunPatternComparison( const int numViews,
+                          const bool pyramid,
+                          const bool bundleAdjust = false );
+
+#endif // DUO_SELF_CHECK_H
@@ -0,0 +1,88 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "DuoSelfCheck.h"
+
+
+//
+// End-to-end checks of calibDuo against a simulated DUO, without a camera
+// or a window. Exits non-zero if any check fails.
+//
+
+//
+// Command line options
+//
+struct Options
+{
+  Options()
+    : numViews( 40 )
+    , circles( false )
+    , pyramid( false )
+    , bundleAdjust( false )
+    , comparePatterns( false )
+  {}
+
+  int  numViews;        // --views <n>: rendered board poses
+  bool circles;         // --circles: asymmetric circle grid
+  bool pyramid;         // --pyramid: coarse-to-fine chessboard detection
+  bool bundleAdjust;    // --bundle-adjust: DuoBundleAdjuster
+  bool comparePatterns; // --compare-patterns: chessboard against circles
+};
+
+
+static Options parseOptions( int argc, char** argv )
+{
+  Options options;
+
+  for( int i = 1; i < argc; ++i )
+  {
+    const std::string arg( argv[i] );
+
+    if( arg == "--views" && i + 1 < argc )
+    {
+      options.numViews = std::max( 1, atoi( argv[++i] ) );
+    }
+    else if( arg == "--circles" )
+    {
+      options.circles = true;
+    }
+    else if( arg == "--pyramid" )
+    {
+      options.pyramid = true;
+    }
+    else if( arg == "--bundle-adjust" )
+    {
+      options.bundleAdjust = true;
+    }
+    else if( arg == "--compare-patterns" )
+    {
+      options.comparePatterns = true;
+    }
+    else
+    {
+      std::cout << "Ignoring unknown option " << arg << "\n";
+    }
+  }
+
+  return options;
+}
+
+
+int main( int argc, char** argv )
+{
+  const Options options = parseOptions( argc, argv );
+
+  if( options.comparePatterns )
+  {
+    return RunPatternComparison( options.numViews,
+                                 options.pyramid,
+                                 options.bundleAdjust );
+  }
+
+  return RunSelfCheck( options.numViews,
+                       options.circles,
+                       options.pyramid,
+                       options.bundleAdjust );
+}